@@ -253,7 +253,7 @@ void ggml_file::tokenize(std::vector<uint32_t> &output, const std::string& text,
     llama_sp_bigram::queue work_queue;
 
     if (bos) {
-        output.push_back(1);
+        output.push_back(bos_token_id);
     }
 
     // split string into utf8 chars
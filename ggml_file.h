@@ -9,6 +9,10 @@
 #include <map>
 #include "types.h"
 
+// Special tokens of the LLaMA vocabulary
+const u32 bos_token_id = 1;
+const u32 eos_token_id = 2;
+
 struct ggml_header {
     u32 magic;
     u32 file_version;
@@ -47,6 +51,8 @@ class ggml_file {
     friend class llava_session;
     friend class llava_command_buffer;
     friend class llava_layer_session_data;
+    friend class llava_autotuner;
+    friend class llava_cpu_backend;
 public:
     explicit ggml_file(const char* filepath);
     ~ggml_file();
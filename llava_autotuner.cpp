@@ -0,0 +1,237 @@
+#include "llava_autotuner.h"
+#include "llava_context.h"
+#include "llava_session.h"
+#include "llava_buffer.h"
+#include "llava_layer.h"
+#include "llava_command_buffer.h"
+#include "llava_device.h"
+#include "utils.h"
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <sstream>
+#include <vulkan/vulkan.hpp>
+
+// Dispatches recorded in one benchmarked command buffer, and how many times it is submitted
+const u32 benchmark_dispatch_count = 16;
+const u32 benchmark_run_count = 4;
+
+llava_autotuner::llava_autotuner(llava_context *_context) : context(_context) {
+
+}
+
+u32 llava_autotuner::get_input_size(matmul_family family) const {
+    auto const* model = context->get_model();
+    return (family == matmul_family::dim) ? model->header.dim : model->ff_size;
+}
+
+u32 llava_autotuner::get_row_group_gcd(matmul_family family) const {
+    // Every matrix sharing the family's spevars is dispatched with (rows / 4) / MATMUL_X workgroups, which must be exact
+    auto const* model = context->get_model();
+    if (family == matmul_family::dim) {
+        // wq/wk/wv/wo and output rows are dim and vocab_size, w1/w3 rows are ff_size
+        return gcd(gcd(model->header.dim / 4, model->ff_size / 4), model->header.vocab_size / 4);
+    } else {
+        // w2 rows are dim
+        return model->header.dim / 4;
+    }
+}
+
+llava_buffer *llava_autotuner::get_benchmark_matrix(matmul_family family) const {
+    // The largest matrix of each family, from the first layer, so tuning is measured on the first device and shared with the others
+    llava_layer const& layer = context->get_layers().front();
+    return (family == matmul_family::dim) ? layer.feed_forward_w1 : layer.feed_forward_w2;
+}
+
+matmul_tuning_t llava_autotuner::default_tuning(matmul_family family) const {
+    // Values hand-tuned for 7B and 13B, adapted to the row count constraints of other shapes
+    u32 workgroup_size = context->workgroup_size;
+    u32 blocks_per_row = get_input_size(family) / 32;
+    u32 row_group_gcd = get_row_group_gcd(family);
+
+    matmul_tuning_t tuning;
+    tuning.row_worker_count = ((family == matmul_family::dim) and (get_input_size(family) == 5120)) ? 32 : 128;
+    while ((tuning.row_worker_count > 1) and ((tuning.row_worker_count >= 2 * blocks_per_row) or (tuning.row_worker_count > workgroup_size))) {
+        tuning.row_worker_count >>= 1;
+    }
+
+    tuning.row_per_wavefront = 1;
+    for (u32 x = workgroup_size / tuning.row_worker_count; x >= 1; --x) {
+        if ((row_group_gcd % x) == 0) {
+            tuning.row_per_wavefront = x;
+            break;
+        }
+    }
+    return tuning;
+}
+
+vector<matmul_tuning_t> llava_autotuner::candidates(matmul_family family) const {
+    u32 workgroup_size = context->workgroup_size;
+    u32 blocks_per_row = get_input_size(family) / 32;
+    u32 row_group_gcd = get_row_group_gcd(family);
+
+    vector<matmul_tuning_t> result;
+    // Worker counts must be powers of two for the shared memory reduction
+    for (u32 y = 4; (y <= workgroup_size) and (y < 2 * blocks_per_row); y <<= 1) {
+        for (u32 x = 1; (x * y <= workgroup_size) and (x <= 64); ++x) {
+            if (((row_group_gcd % x) == 0) and (x * y >= 64)) {
+                result.push_back({x, y});
+            }
+        }
+    }
+    return result;
+}
+
+string llava_autotuner::cache_key(matmul_family family) const {
+    llava_buffer const* matrix = get_benchmark_matrix(family);
+    vk::PhysicalDeviceProperties properties = matrix->device->get_physical_device().getProperties();
+
+    stringstream ss;
+    ss << hex << properties.vendorID << ":" << properties.deviceID << ":" << properties.driverVersion << dec;
+    ss << ":" << ((family == matmul_family::dim) ? "dim" : "ff");
+    ss << ":" << get_input_size(family) << ":" << get_row_group_gcd(family);
+    ss << ":" << ftype_name(matrix->type) << (matrix->weight_buffer_is_f16() ? "_fp16" : "");
+    ss << ":" << (context->fp16_activations_enabled() ? "f16act" : "f32act");
+    ss << ":" << context->workgroup_size;
+    return ss.str();
+}
+
+void llava_autotuner::set_tuning(matmul_family family, matmul_tuning_t const& tuning) {
+    if (family == matmul_family::dim) {
+        context->dim_matmul_tuning = tuning;
+    } else {
+        context->ff_matmul_tuning = tuning;
+    }
+}
+
+double llava_autotuner::benchmark(llava_session *session, matmul_family family, matmul_tuning_t const& tuning) {
+    auto const* model = context->get_model();
+    llava_buffer* matrix = get_benchmark_matrix(family);
+    u32 output_size = (family == matmul_family::dim) ? model->ff_size : model->header.dim;
+
+    set_tuning(family, tuning);
+    session->recreate_spevars();
+
+    llava_buffer input(matrix->device, session->get_activation_type(), get_input_size(family), 1);
+    llava_buffer output(matrix->device, session->get_activation_type(), output_size, 1);
+    llava_command_buffer command_buffer(session, matrix->device);
+    for (u32 i = 0; i < benchmark_dispatch_count; ++i) {
+        command_buffer.matmul(&output, matrix, &input);
+    }
+    command_buffer.end_recording();
+
+    // First run includes pipeline creation
+    command_buffer.run();
+    command_buffer.wait_idle();
+
+    auto start = chrono::steady_clock::now();
+    for (u32 i = 0; i < benchmark_run_count; ++i) {
+        command_buffer.run();
+        command_buffer.wait_idle();
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    return elapsed.count() / (benchmark_run_count * benchmark_dispatch_count);
+}
+
+void llava_autotuner::tune(bool run_benchmark, u32 verbosity) {
+    load_cache();
+
+    // Both families are seeded before any benchmark, spevars are built from both and a zero shape is invalid
+    vector<matmul_family> uncached_families;
+    for (matmul_family family : {matmul_family::dim, matmul_family::ff}) {
+        if (auto it = cache.find(cache_key(family)); it != cache.end()) {
+            set_tuning(family, it->second);
+        } else {
+            set_tuning(family, default_tuning(family));
+            uncached_families.push_back(family);
+        }
+    }
+
+    bool cache_updated = false;
+    for (matmul_family family : uncached_families) {
+        string key = cache_key(family);
+        matmul_tuning_t best = default_tuning(family);
+        if (run_benchmark) {
+            if (verbosity) {
+                cout << "[*] Auto-tuning matmul for " << key << endl;
+            }
+
+            // Only matmuls are recorded, so the session needs its spevars but none of its buffers
+            llava_session session(context);
+            session.batch_size = 1;
+            double best_time = benchmark(&session, family, best);
+            for (matmul_tuning_t const& candidate : candidates(family)) {
+                // A draft context does not own the signal fd, the main context checks it
+                if ((context->get_signal_fd() != -1) and context->pop_signal()) {
+                    exit(1);
+                }
+                double candidate_time = benchmark(&session, family, candidate);
+                if (verbosity >= 2) {
+                    cout << "    " << candidate.row_per_wavefront << "x" << candidate.row_worker_count << ": " << candidate_time * 1e6 << "us" << endl;
+                }
+                if (candidate_time < best_time) {
+                    best_time = candidate_time;
+                    best = candidate;
+                }
+            }
+            if (verbosity) {
+                cout << "[*] Selected " << best.row_per_wavefront << " rows x " << best.row_worker_count << " workers (" << best_time * 1e6 << "us)" << endl;
+            }
+            cache[key] = best;
+            cache_updated = true;
+        }
+        set_tuning(family, best);
+    }
+
+    if (cache_updated) {
+        save_cache();
+    }
+}
+
+string llava_autotuner::get_cache_path() {
+    const char* cache_home = ::getenv("XDG_CACHE_HOME");
+    if (cache_home and *cache_home) {
+        return string(cache_home) + "/llava_autotune.txt";
+    }
+    const char* home = ::getenv("HOME");
+    if (home and *home) {
+        return string(home) + "/.cache/llava_autotune.txt";
+    }
+    return {};
+}
+
+void llava_autotuner::load_cache() {
+    string path = get_cache_path();
+    if (path.empty()) {
+        return;
+    }
+
+    // One "key row_per_wavefront row_worker_count" entry per line
+    ifstream in(path);
+    string key;
+    matmul_tuning_t tuning;
+    while (in >> key >> tuning.row_per_wavefront >> tuning.row_worker_count) {
+        cache[key] = tuning;
+    }
+}
+
+void llava_autotuner::save_cache() const {
+    string path = get_cache_path();
+    if (path.empty()) {
+        return;
+    }
+
+    // Fresh hosts and containers may have no cache directory yet
+    error_code error;
+    filesystem::create_directories(filesystem::path(path).parent_path(), error);
+    ofstream out(path, ios::trunc);
+    if (not out) {
+        cerr << "[*] Cannot write auto-tuning cache to " << path << endl;
+        return;
+    }
+    for (auto& [key, tuning] : cache) {
+        out << key << " " << tuning.row_per_wavefront << " " << tuning.row_worker_count << "\n";
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef VULKAN_LLAMA_LLAVA_AUTOTUNER_H
+#define VULKAN_LLAMA_LLAVA_AUTOTUNER_H
+
+#include "types.h"
+#include <map>
+#include <vector>
+
+// Shape of a matmul workgroup: MATMUL_X rows, each reduced by MATMUL_Y workers
+struct matmul_tuning_t {
+    u32 row_per_wavefront = 0;
+    u32 row_worker_count = 0;
+};
+
+// Picks matmul workgroup shapes for the loaded model on the selected device
+// Winners are benchmarked once and cached on disk, keyed by device, driver and matrix shape
+class llava_autotuner {
+public:
+    explicit llava_autotuner(llava_context* context);
+    void tune(bool benchmark, u32 verbosity);
+
+private:
+    enum class matmul_family { dim, ff };
+
+    llava_context* const context;
+
+    [[nodiscard]] u32 get_input_size(matmul_family family) const;
+    [[nodiscard]] u32 get_row_group_gcd(matmul_family family) const;
+    [[nodiscard]] llava_buffer* get_benchmark_matrix(matmul_family family) const;
+    [[nodiscard]] matmul_tuning_t default_tuning(matmul_family family) const;
+    [[nodiscard]] vector<matmul_tuning_t> candidates(matmul_family family) const;
+    [[nodiscard]] string cache_key(matmul_family family) const;
+    [[nodiscard]] double benchmark(llava_session* session, matmul_family family, matmul_tuning_t const& tuning);
+    void set_tuning(matmul_family family, matmul_tuning_t const& tuning);
+
+private: // disk cache
+    map<string, matmul_tuning_t> cache;
+    static string get_cache_path();
+    void load_cache();
+    void save_cache() const;
+};
+
+#endif //VULKAN_LLAMA_LLAVA_AUTOTUNER_H
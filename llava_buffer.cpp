@@ -4,6 +4,7 @@
 #include "llava_buffer.h"
 #include "llava_device_memory.h"
 #include "llava_context.h"
+#include "llava_device.h"
 #include "utils.h"
 
 struct [[maybe_unused]] q4_0_block {
@@ -28,16 +29,17 @@ struct [[maybe_unused]] q8_0_block_f16 {
 
 auto wanted_bits = vk::BufferUsageFlagBits::eTransferSrc | vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eStorageBuffer;
 
-llava_buffer::llava_buffer(llava_context *_context,
+llava_buffer::llava_buffer(llava_device *_device,
                            ggml_value_type _type,
                            u32 shape1,
                            u32 shape2,
                            llava_device_memory *_device_memory,
-                           string _name) : context(_context),
+                           string _name) : context(_device->context),
+                                           device(_device),
                                            type(_type),
                                            shape(shape1, shape2),
                                            device_memory_is_shared(_device_memory != nullptr),
-                                           device_memory(_device_memory ? _device_memory : new llava_device_memory(context)),
+                                           device_memory(_device_memory ? _device_memory : new llava_device_memory(device)),
                                            pretty_name(std::move(_name)) {
     assert (not device_memory->is_frozen());
     device_memory->register_llava_buffer(this);
@@ -49,46 +51,100 @@ llava_buffer::llava_buffer(llava_context *_context,
     }
 }
 
-llava_buffer::llava_buffer(llava_context *_context,
+llava_buffer::llava_buffer(llava_device *_device,
                            ggml_data_descriptor const &table,
-                           llava_device_memory *_device_memory) : context(_context),
+                           llava_device_memory *_device_memory) : context(_device->context),
+                                                                  device(_device),
                                                                   backing_buffer_name(table.name),
                                                                   type(table.ftype),
                                                                   shape(table.shape1, table.shape2),
                                                                   device_memory_is_shared(_device_memory != nullptr),
-                                                                  device_memory(_device_memory ? _device_memory : new llava_device_memory(context)) {
+                                                                  device_memory(_device_memory ? _device_memory : new llava_device_memory(device)),
+                                                                  backing_tables({&table}) {
     assert (not device_memory->is_frozen());
     device_memory->register_llava_buffer(this);
+    push_weight_buffers(table.model_version, table.size);
 
+    if (not device_memory_is_shared) {
+        device_memory->freeze();
+    }
+}
+
+static string join_table_names(vector<ggml_data_descriptor const*> const& tables) {
+    string name;
+    for (auto const* table : tables) {
+        name += (name.empty() ? "" : "+") + table->name;
+    }
+    return name;
+}
+
+static u32 sum_table_rows(vector<ggml_data_descriptor const*> const& tables) {
+    u32 rows = 0;
+    for (auto const* table : tables) {
+        rows += table->shape1;
+    }
+    return rows;
+}
+
+llava_buffer::llava_buffer(llava_device *_device,
+                           vector<ggml_data_descriptor const*> const& tables,
+                           llava_device_memory *_device_memory) : context(_device->context),
+                                                                  device(_device),
+                                                                  backing_buffer_name(join_table_names(tables)),
+                                                                  type(tables.at(0)->ftype),
+                                                                  shape(sum_table_rows(tables), tables.at(0)->shape2),
+                                                                  device_memory_is_shared(_device_memory != nullptr),
+                                                                  device_memory(_device_memory ? _device_memory : new llava_device_memory(device)),
+                                                                  backing_tables(tables) {
+    assert (not device_memory->is_frozen());
+    device_memory->register_llava_buffer(this);
+
+    size_t total_size = 0;
+    for (auto const* table : backing_tables) {
+        // Row groups of 4 are interleaved on GPU, so every part must start on a group boundary
+        assert(table->ftype == type);
+        assert(table->model_version == backing_tables.front()->model_version);
+        assert(table->shape2 == shape.second);
+        assert((table->shape1 % 4) == 0);
+        total_size += table->size;
+    }
+    push_weight_buffers(backing_tables.front()->model_version, total_size);
+
+    if (not device_memory_is_shared) {
+        device_memory->freeze();
+    }
+}
+
+void llava_buffer::push_weight_buffers(u32 model_version, size_t table_size) {
     if (type == ggml_value_type::f32) {
         push_buffer(shape.first * shape.second * 4);
     } else if (type == ggml_value_type::q4_0) {
-        if (table.model_version == 1) {
+        if (model_version == 1) {
             assert(shape.first % 32 == 0);
             u32 block_count = (shape.second * (shape.first >> 5));
-            assert(table.size == 20 * block_count);
+            assert(table_size == 20 * block_count);
             push_buffer(block_count * 4);
             push_buffer(block_count * 16);
-        } else if (table.model_version == 3) {
+        } else if (model_version == 3) {
             assert(shape.first % 32 == 0);
             u32 block_count = (shape.second * (shape.first >> 5));
-            assert(table.size == 18 * block_count);
+            assert(table_size == 18 * block_count);
             push_buffer(block_count * 2);
             push_buffer(block_count * 16);
         } else {
             assert(false);
         }
     } else if (type == ggml_value_type::q8_0) {
-        if (table.model_version == 1) {
+        if (model_version == 1) {
             assert(shape.first % 32 == 0);
             u32 block_count = (shape.second * (shape.first >> 5));
-            assert(table.size == 36 * block_count);
+            assert(table_size == 36 * block_count);
             push_buffer(block_count * 4);
             push_buffer(block_count * 32);
-        } else if (table.model_version == 3) {
+        } else if (model_version == 3) {
             assert(shape.first % 32 == 0);
             u32 block_count = (shape.second * (shape.first >> 5));
-            assert(table.size == 34 * block_count);
+            assert(table_size == 34 * block_count);
             push_buffer(block_count * 2);
             push_buffer(block_count * 32);
         } else {
@@ -97,18 +153,14 @@ llava_buffer::llava_buffer(llava_context *_context,
     } else {
         assert(false);
     }
-
-    if (not device_memory_is_shared) {
-        device_memory->freeze();
-    }
 }
 
 void llava_buffer::push_buffer(size_t buffer_size) {
     auto* buffer = new vk::Buffer;
-    vk::Buffer _buffer = context->get_device().createBuffer({{}, buffer_size, wanted_bits});
+    vk::Buffer _buffer = device->get_device().createBuffer({{}, buffer_size, wanted_bits});
     buffer->operator=(_buffer);
-    auto alignment = context->get_device().getBufferMemoryRequirements(*buffer).alignment;
-    auto required_size = context->get_device().getBufferMemoryRequirements(*buffer).size;
+    auto alignment = device->get_device().getBufferMemoryRequirements(*buffer).alignment;
+    auto required_size = device->get_device().getBufferMemoryRequirements(*buffer).size;
     assert (required_size >= buffer_size);
     size_t new_buffer_offset = device_memory->register_buffer(alignment, required_size);
     buffers.emplace_back(buffer_size, new_buffer_offset, buffer);
@@ -116,7 +168,7 @@ void llava_buffer::push_buffer(size_t buffer_size) {
 
 llava_buffer::~llava_buffer() {
     for (auto &buffer: buffers) {
-        context->get_device().destroy(*(buffer.buffer));
+        device->get_device().destroy(*(buffer.buffer));
         delete buffer.buffer;
     }
 
@@ -135,7 +187,7 @@ void llava_buffer::on_memory_freeze() {
     buffers_bound = true;
 
     for (buffer_record_t &buffer: buffers) {
-        context->get_device().bindBufferMemory(*(buffer.buffer), *(device_memory->get_device_memory()), buffer.offset);
+        device->get_device().bindBufferMemory(*(buffer.buffer), *(device_memory->get_device_memory()), buffer.offset);
     }
 }
 
@@ -183,21 +235,35 @@ void llava_buffer::load_from_disk(void *_target_buffer) {
     }
     assert(is_allocated());
 
-    auto &table = context->get_model()->get_buffer_descriptor(backing_buffer_name);
+    u32 first_row = 0;
+    for (auto const* table : backing_tables) {
+        load_table_from_disk(target_buffer, *table, first_row);
+        first_row += table->shape1;
+    }
+    assert(first_row == shape.first);
+}
+
+void llava_buffer::load_table_from_disk(u8 *target_buffer, ggml_data_descriptor const &table, u32 first_row) {
+    // Sub-buffers are stored row-major (by groups of 4 rows), so a part starting at first_row is at a proportional offset
+    vector<u8*> targets;
+    for (auto &buffer: buffers) {
+        targets.push_back(target_buffer + buffer.offset + (buffer.size / shape.first) * first_row);
+    }
+
     if (type == ggml_value_type::f32) {
-        memcpy(target_buffer + buffers.at(0).offset, context->get_model()->mapping + table.offset, (size_t) table.size);
+        memcpy(targets.at(0), context->get_model()->mapping + table.offset, (size_t) table.size);
         return;
     }
 
     auto model_version = context->get_model()->header.file_version;
     if ((type == ggml_value_type::q4_0) and (model_version == 1)) {
-        u32 column_count = shape.second;
+        u32 column_count = table.shape2;
         auto *raw_data = reinterpret_cast<q4_0_block *>(context->get_model()->mapping + table.offset);
-        size_t block_count = (shape.first * shape.second) / 32;
+        size_t block_count = (table.shape1 * table.shape2) / 32;
 
         {
             // TODO not perf
-            auto *d_data = (float *) (target_buffer + buffers.at(0).offset);
+            auto *d_data = (float *) (targets.at(0));
             for (size_t i = 0; i < block_count; ++i) {
                 u32 row_id = i / (column_count / 32);
                 u32 column_id = i % (column_count / 32);
@@ -208,7 +274,7 @@ void llava_buffer::load_from_disk(void *_target_buffer) {
         }
 
         {
-            auto *q_data = (u32 *) (target_buffer + buffers.at(1).offset);
+            auto *q_data = (u32 *) (targets.at(1));
             for (size_t i = 0; i < block_count; ++i) {
                 u32 row_id = i / (column_count / 32);
                 u32 column_id = i % (column_count / 32);
@@ -224,13 +290,13 @@ void llava_buffer::load_from_disk(void *_target_buffer) {
     }
 
     if ((type == ggml_value_type::q4_0) and (model_version == 3)) {
-        u32 column_count = shape.second;
+        u32 column_count = table.shape2;
         u32 column_count_d32 = column_count / 32;
         auto *raw_data = reinterpret_cast<q4_0_block_f16 *>(context->get_model()->mapping + table.offset);
-        size_t block_count = (shape.first * shape.second) / 32;
+        size_t block_count = (table.shape1 * table.shape2) / 32;
 
-        auto *d_data = (u8 *) (target_buffer + buffers.at(0).offset);
-        auto *q_data = (u8 *) (target_buffer + buffers.at(1).offset);
+        auto *d_data = (u8 *) (targets.at(0));
+        auto *q_data = (u8 *) (targets.at(1));
 
         u8 buffer[64];
         auto *d_data_buf = new float[4 * column_count_d32];
@@ -279,13 +345,13 @@ void llava_buffer::load_from_disk(void *_target_buffer) {
     }
 
     if ((type == ggml_value_type::q8_0) and (model_version == 3)) {
-        u32 column_count = shape.second;
+        u32 column_count = table.shape2;
         u32 column_count_d32 = column_count / 32;
         auto *data = reinterpret_cast<q8_0_block_f16 *>(context->get_model()->mapping + table.offset);
-        size_t block_count = (shape.first * shape.second) / 32;
+        size_t block_count = (table.shape1 * table.shape2) / 32;
 
-        auto *d_data = (u8 *) (target_buffer + buffers.at(0).offset);
-        auto *q_data = (u8 *) (target_buffer + buffers.at(1).offset);
+        auto *d_data = (u8 *) (targets.at(0));
+        auto *q_data = (u8 *) (targets.at(1));
 
         u32 buffer[32];
         auto *d_data_buf = new float[4 * column_count_d32];
@@ -411,7 +477,7 @@ void llava_buffer::hexdump(size_t n, size_t offset) const {
     if (offset >= buffer_size) {
         cout << "...\n";
     } else {
-        u8* buffer_memory = (u8*)context->get_device().mapMemory(deviceMemory, offset, effective_sz);
+        u8* buffer_memory = (u8*)device->get_device().mapMemory(deviceMemory, offset, effective_sz);
         for (u32 j = 0; j < effective_sz; j+= 16) {
             cout << hex << offset + j << ": ";
             for (u32 k = 0; k < 16; k++) {
@@ -422,42 +488,42 @@ void llava_buffer::hexdump(size_t n, size_t offset) const {
             }
             cout << "\n";
         }
-        context->get_device().unmapMemory(deviceMemory);
+        device->get_device().unmapMemory(deviceMemory);
     }
     cout << flush;
 }
 
 void llava_buffer::f32_dump(size_t n, size_t offset, bool in_line) const {
     assert(is_allocated());
-    auto* buffer_memory = (float*)context->get_device().mapMemory(deviceMemory, 0, buffer_size);
+    auto* buffer_memory = (float*)device->get_device().mapMemory(deviceMemory, 0, buffer_size);
     for (size_t j = 0; j < n; j++) {
         cout << buffer_memory[offset + j] << (in_line ? " " : "\n");
     }
     if (in_line) {
         cout << endl;
     }
-    context->get_device().unmapMemory(deviceMemory);
+    device->get_device().unmapMemory(deviceMemory);
 }
 
 
 
  void llava_buffer::fill_f32(float value) const {
     assert(is_allocated() and type == ggml_value_type::f32);
-    auto* z = static_cast<float *>(context->get_device().mapMemory(deviceMemory, 0, -1));
+    auto* z = static_cast<float *>(device->get_device().mapMemory(deviceMemory, 0, -1));
     for(u32 i = 0; i < shape.first * shape.second; ++i) {
         z[i] = value;
     }
-    context->get_device().unmapMemory(deviceMemory);
+    device->get_device().unmapMemory(deviceMemory);
 }
 
 bool llava_buffer::contains_nan() const {
     assert(is_allocated() and type == ggml_value_type::f32);
-    auto* z = static_cast<float *>(context->get_device().mapMemory(deviceMemory, 0, -1));
+    auto* z = static_cast<float *>(device->get_device().mapMemory(deviceMemory, 0, -1));
     for(size_t i = 0; i < shape.first * shape.second; ++i) {
         if(isnan(z[i]))
             return true;
     }
-    context->get_device().unmapMemory(deviceMemory);
+    device->get_device().unmapMemory(deviceMemory);
     return false;
 } */
 
@@ -14,8 +14,9 @@ struct buffer_record_t {
 
 class llava_buffer {
 public:
-    llava_buffer(llava_context* context, ggml_value_type type, u32 shape1, u32 shape2 = 1, llava_device_memory* device_memory = nullptr, string name = ""); // Anonymous RW buffer
-    llava_buffer(llava_context* context, ggml_data_descriptor const&, llava_device_memory* device_memory = nullptr); // From a data descriptor
+    llava_buffer(llava_device* device, ggml_value_type type, u32 shape1, u32 shape2 = 1, llava_device_memory* device_memory = nullptr, string name = ""); // Anonymous RW buffer
+    llava_buffer(llava_device* device, ggml_data_descriptor const&, llava_device_memory* device_memory = nullptr); // From a data descriptor
+    llava_buffer(llava_device* device, vector<ggml_data_descriptor const*> const&, llava_device_memory* device_memory = nullptr); // Rows of several descriptors, concatenated
     llava_buffer(llava_buffer const&) = delete;
     llava_buffer(llava_buffer&) = delete;
     llava_buffer(llava_buffer&&) = delete;
@@ -45,6 +46,7 @@ public:
     bool weight_buffer_is_f16() const;
 public:
     llava_context* const context;
+    llava_device* const device;
     const string backing_buffer_name;
     const string pretty_name;
     const ggml_value_type type;
@@ -54,8 +56,13 @@ public:
 
 private:
     void push_buffer(size_t buffer_size);
+    void push_weight_buffers(u32 model_version, size_t table_size);
+    void load_table_from_disk(u8* target_buffer, ggml_data_descriptor const& table, u32 first_row);
+    vector<ggml_data_descriptor const*> const backing_tables;
     vector<buffer_record_t> buffers;
     bool buffers_bound = false;
 };
 
+float halfToFloat(uint16_t half);
+
 #endif
@@ -1,43 +1,104 @@
 #include "llava_command_buffer.h"
 #include "llava_context.h"
 #include "llava_session.h"
+#include "llava_device.h"
 #include "utils.h"
+#include <set>
 
-llava_command_buffer::llava_command_buffer(llava_session *_session) : session(_session),
+// Sets per descriptor pool of the arena, most pipelines bind far less than 16 buffers
+static const u32 descriptor_pool_set_count = 256;
+
+llava_command_buffer::llava_command_buffer(llava_session *_session, llava_device* _device, session_partition_t* _partition) : session(_session),
+                                                                      device(_device),
+                                                                      partition(_partition),
                                                                       backlog_size(session->backlog_size),
                                                                       workgroup_size(session->ctx->workgroup_size),
                                                                       batch_size(session->batch_size),
-                                                                      fence(session->ctx->device.createFence({})) {
-
+                                                                      current_layer(llava_profiler::head_layer_id),
+                                                                      fence(device->get_device().createFence({})) {
+    command_pool = device->get_device().createCommandPool({{}, device->get_queue_family_index()});
 }
 
 llava_command_buffer::~llava_command_buffer() {
     wait_idle();
-    lock_guard guard1(session->ctx->command_pool_mutex);
-    lock_guard guard2(session->ctx->descriptor_pool_mutex);
-    session->ctx->get_device().destroy(fence);
-    fence = nullptr;
     buffer_to_last_write_event.clear();
     command_buffer_raw.clear();
     command_buffer.clear();
+    // Command buffers and descriptor sets are released in bulk with their pools
+    for (auto& descriptor_pool : descriptor_pools) {
+        device->get_device().destroy(descriptor_pool);
+    }
+    descriptor_pools.clear();
+    device->get_device().destroy(command_pool);
+    command_pool = nullptr;
+    device->get_device().destroy(fence);
+    fence = nullptr;
 }
 
-void llava_command_buffer::wait_idle() const {
-    (void) session->ctx->get_device().waitForFences(1, &fence, true, 1000000000000UL);
+vk::DescriptorSet llava_command_buffer::allocate_descriptor_set(vk::DescriptorSetLayout const& layout, u32 descriptor_count) {
+    if (not descriptor_pools.empty()) {
+        try {
+            return device->get_device().allocateDescriptorSets({descriptor_pools.back(), 1, &layout}).front();
+        } catch (vk::OutOfPoolMemoryError const&) {
+        } catch (vk::FragmentedPoolError const&) {
+        }
+    }
+    vk::DescriptorPoolSize descriptor_pool_size(vk::DescriptorType::eStorageBuffer, max(16 * descriptor_pool_set_count, descriptor_count));
+    descriptor_pools.push_back(device->get_device().createDescriptorPool({{}, descriptor_pool_set_count, 1, &descriptor_pool_size}));
+    return device->get_device().allocateDescriptorSets({descriptor_pools.back(), 1, &layout}).front();
+}
+
+void llava_command_buffer::wait_idle() {
+    (void) device->get_device().waitForFences(1, &fence, true, 1000000000000UL);
+    if (timestamps_pending) {
+        timestamps_pending = false;
+        collect_timestamps();
+    }
+}
+
+void llava_command_buffer::collect_timestamps() {
+    llava_context *context = session->ctx;
+    double period_us = device->get_physical_device().getProperties().limits.timestampPeriod / 1000.;
+    u64 valid_mask = device->timestamp_valid_mask;
+    for (auto &command: command_buffer) {
+        if (not command.timestampPool) {
+            continue;
+        }
+        auto results = device->get_device().getQueryPoolResults<u64>(command.timestampPool, 0, 2, 2 * sizeof(u64), sizeof(u64), vk::QueryResultFlagBits::e64);
+        if (results.result != vk::Result::eSuccess) {
+            continue;
+        }
+        u64 ticks = (results.value.at(1) - results.value.at(0)) & valid_mask;
+        context->get_profiler().record(command.pipeline_name, command.layer_id, double(ticks) * period_us);
+    }
 }
 
 void llava_command_buffer::record_execution() {
     assert(command_buffer_raw.empty());
+    assert(partition != nullptr);
 
-    llava_buffer *current_logit = session->current_thought;
+    llava_buffer *current_logit = partition->current_thought;
     assert(session->get_layer_data().size() == session->ctx->get_layers().size());
-    for (u32 i = 0; i < session->ctx->get_layers().size(); ++i) {
+    for (u32 i = device->first_layer; i < device->first_layer + device->layer_count; ++i) {
+        current_layer = i;
         current_logit = session->ctx->get_layers().at(i).execute(this, session->get_layer_data().at(i), current_logit);
     }
+    current_layer = llava_profiler::head_layer_id;
 
-    normalize_logit(session->current_thought_sublayer, current_logit, session->norm_w);
-    matmul(session->output_probs, session->output_w, session->current_thought_sublayer);
+    if ((device != session->ctx->get_devices().back()) or session->ctx->head_on_cpu()) {
+        // The residual is handed over to the next device or to the CPU from current_thought
+        if (current_logit != partition->current_thought) {
+            copy_logit(partition->current_thought, current_logit);
+        }
+    } else {
+        normalize_logit(session->final_norm_logit, current_logit, session->norm_w);
+        matmul(session->output_probs, session->output_w, session->final_norm_logit);
+    }
+    end_recording();
+}
 
+void llava_command_buffer::end_recording() {
+    assert(command_buffer_raw.empty());
     command_buffer_raw.reserve(command_buffer.size());
     for (auto &command: command_buffer) {
         command_buffer_raw.push_back(command.commandBuffer);
@@ -46,16 +107,26 @@ void llava_command_buffer::record_execution() {
 
 void llava_command_buffer::run() {
     for (auto &x: command_buffer) {
-        session->ctx->get_device().resetEvent(x.completionEvent);
+        device->get_device().resetEvent(x.completionEvent);
     }
-    session->ctx->device.resetFences({fence});
+    device->get_device().resetFences({fence});
 
     vk::SubmitInfo submitInfo({}, {}, command_buffer_raw, {});
-    session->ctx->get_queue().submit(submitInfo, fence);
+    {
+        // Sessions of other threads submit to the same queue
+        lock_guard guard(device->queue_mutex);
+        device->get_queue().submit(submitInfo, fence);
+    }
+    timestamps_pending = session->ctx->profiling_enabled();
+}
+
+static string activation_suffix(llava_buffer const* activation) {
+    return (activation->type == ggml_value_type::f16) ? string(f16act_suffix) : string();
 }
 
 void llava_command_buffer::normalize_logit(llava_buffer *outbuf, llava_buffer *inbuf, llava_buffer *weights) {
-    return record_command("normalize", {outbuf, inbuf, weights}, 1, 1, batch_size);
+    assert(inbuf->type == ggml_value_type::f32);
+    return record_command("normalize" + activation_suffix(outbuf), {outbuf, inbuf, weights}, 1, 1, batch_size);
 }
 
 void llava_command_buffer::matmul(llava_buffer *outbuf, llava_buffer *matrix, llava_buffer *inbuf) {
@@ -65,6 +136,7 @@ void llava_command_buffer::matmul(llava_buffer *outbuf, llava_buffer *matrix, ll
     assert(outbuf->shape.first == matrix->shape.first);
     assert(inbuf->shape.second == batch_size);
     assert(outbuf->shape.second == batch_size);
+    assert(outbuf->type == inbuf->type);
 
     string suffix;
     if (matrix->type == ggml_value_type::q8_0) {
@@ -73,6 +145,7 @@ void llava_command_buffer::matmul(llava_buffer *outbuf, llava_buffer *matrix, ll
     if (matrix->weight_buffer_is_f16()) {
         suffix += "_fp16";
     }
+    suffix += activation_suffix(inbuf);
     if (inbuf->shape.first == model->header.dim) {
         assert(outbuf->shape.first % (4 * spevar.matmul_dim_row_per_wavefront) == 0);
         return record_command("matmul_dim" + suffix, {outbuf, matrix, inbuf}, outbuf->shape.first / (spevar.matmul_dim_row_per_wavefront * 4), 1, batch_size);
@@ -84,6 +157,40 @@ void llava_command_buffer::matmul(llava_buffer *outbuf, llava_buffer *matrix, ll
     }
 }
 
+void llava_command_buffer::matmul_qkv(llava_buffer *q_out, llava_buffer *k_out, llava_buffer *v_out, llava_buffer *matrix, llava_buffer *inbuf, llava_buffer *norm_weights) {
+    auto const *model = session->model;
+    auto &spevar = session->get_spevar_struct();
+    u32 dim = model->header.dim;
+    assert(matrix->shape.first == 3 * dim);
+    assert(matrix->shape.second == dim);
+    assert(inbuf->shape.first == dim);
+    assert(inbuf->shape.second == batch_size);
+    for (llava_buffer *outbuf : {q_out, k_out, v_out}) {
+        assert(outbuf->shape.first == dim);
+        assert(outbuf->shape.second == batch_size);
+        assert(outbuf->type == q_out->type);
+    }
+
+    string suffix;
+    if (matrix->type == ggml_value_type::q8_0) {
+        suffix += "_q8";
+    }
+    if (matrix->weight_buffer_is_f16()) {
+        suffix += "_fp16";
+    }
+    suffix += activation_suffix(q_out);
+    assert(matrix->shape.first % (4 * spevar.matmul_dim_row_per_wavefront) == 0);
+    u32 countX = matrix->shape.first / (spevar.matmul_dim_row_per_wavefront * 4);
+    if (norm_weights) {
+        // Normalizes the raw f32 input on the fly
+        assert(inbuf->type == ggml_value_type::f32);
+        assert(norm_weights->shape.first == dim);
+        return record_command("matmul_qkv_norm" + suffix, {q_out, k_out, v_out, matrix, inbuf, norm_weights}, countX, 1, batch_size, 3);
+    }
+    assert(inbuf->type == q_out->type);
+    return record_command("matmul_qkv" + suffix, {q_out, k_out, v_out, matrix, inbuf}, countX, 1, batch_size, 3);
+}
+
 void llava_command_buffer::matmul_add_inplace(llava_buffer *outbuf, llava_buffer *matrix, llava_buffer *inbuf) {
     auto const *model = session->model;
     auto &spevar = session->get_spevar_struct();
@@ -91,6 +198,7 @@ void llava_command_buffer::matmul_add_inplace(llava_buffer *outbuf, llava_buffer
     assert(outbuf->shape.first == matrix->shape.first);
     assert(inbuf->shape.second == batch_size);
     assert(outbuf->shape.second == batch_size);
+    assert(outbuf->type == ggml_value_type::f32);
 
     string suffix;
     if (matrix->type == ggml_value_type::q8_0) {
@@ -99,6 +207,7 @@ void llava_command_buffer::matmul_add_inplace(llava_buffer *outbuf, llava_buffer
     if (matrix->weight_buffer_is_f16()) {
         suffix += "_fp16";
     }
+    suffix += activation_suffix(inbuf);
     if (inbuf->shape.first == model->header.dim) {
         assert(outbuf->shape.first % (4 * spevar.matmul_dim_row_per_wavefront) == 0);
         return record_command("matmul_add_dim" + suffix, {outbuf, matrix, inbuf}, outbuf->shape.first / (spevar.matmul_dim_row_per_wavefront * 4), 1, batch_size);
@@ -110,7 +219,7 @@ void llava_command_buffer::matmul_add_inplace(llava_buffer *outbuf, llava_buffer
     }
 }
 
-void llava_command_buffer::matmul_silu_ff(llava_buffer *outbuf, llava_buffer *w3_matrix, llava_buffer *w1_matrix, llava_buffer *inbuf) {
+void llava_command_buffer::matmul_silu_ff(llava_buffer *outbuf, llava_buffer *w3_matrix, llava_buffer *w1_matrix, llava_buffer *inbuf, llava_buffer *norm_weights) {
     auto const *model = session->model;
     auto &spevar = session->get_spevar_struct();
     assert(w3_matrix->shape == w1_matrix->shape);
@@ -127,8 +236,17 @@ void llava_command_buffer::matmul_silu_ff(llava_buffer *outbuf, llava_buffer *w3
     if (w3_matrix->weight_buffer_is_f16()) {
         suffix += "_fp16";
     }
+    suffix += activation_suffix(outbuf);
     assert(outbuf->shape.first % (4 * spevar.matmul_dim_row_per_wavefront) == 0);
-    return record_command("matmul_silu_ff" + suffix, {outbuf, w3_matrix, w1_matrix, inbuf}, outbuf->shape.first / (spevar.matmul_dim_row_per_wavefront * 4), 1, batch_size);
+    u32 countX = outbuf->shape.first / (spevar.matmul_dim_row_per_wavefront * 4);
+    if (norm_weights) {
+        // Normalizes the raw f32 input on the fly
+        assert(inbuf->type == ggml_value_type::f32);
+        assert(norm_weights->shape.first == model->header.dim);
+        return record_command("matmul_silu_ff_norm" + suffix, {outbuf, w3_matrix, w1_matrix, inbuf, norm_weights}, countX, 1, batch_size);
+    }
+    assert(outbuf->type == inbuf->type);
+    return record_command("matmul_silu_ff" + suffix, {outbuf, w3_matrix, w1_matrix, inbuf}, countX, 1, batch_size);
 }
 
 void llava_command_buffer::kv_copy(llava_buffer *out_cache, llava_buffer *input_line) {
@@ -138,7 +256,24 @@ void llava_command_buffer::kv_copy(llava_buffer *out_cache, llava_buffer *input_
     assert(out_cache->shape.second == model->header.dim);
     assert(input_line->shape.first == model->header.dim);
     assert(input_line->shape.second == batch_size);
-    return record_command("copy_to_cache", {out_cache, session->config_buffer, input_line}, updiv(model->header.dim, workgroup_size), 1, batch_size);
+    return record_command("copy_to_cache" + activation_suffix(input_line), {out_cache, partition->config_buffer, input_line}, updiv(model->header.dim, workgroup_size), 1, batch_size);
+}
+
+void llava_command_buffer::kv_shift(llava_buffer *cache) {
+    auto const *model = session->model;
+
+    assert(cache->shape.first == backlog_size);
+    assert(cache->shape.second == model->header.dim);
+    return record_command("kv_shift", {cache, partition->shift_config}, updiv(model->header.dim, workgroup_size), 1, 1);
+}
+
+void llava_command_buffer::kv_gather(llava_buffer *cache, u32 step_count) {
+    auto const *model = session->model;
+
+    assert(cache->shape.first == backlog_size);
+    assert(cache->shape.second == model->header.dim);
+    assert(step_count > 0);
+    return record_command("kv_gather", {cache, partition->beam_parents}, updiv(model->header.dim, workgroup_size), step_count, 1);
 }
 
 void llava_command_buffer::copy_logit(llava_buffer *out_logit, llava_buffer *input_logit) {
@@ -164,7 +299,7 @@ void llava_command_buffer::multi_head_attention(llava_buffer *out_buffer, llava_
     assert(out_buffer->shape.first == backlog_size);
     assert(out_buffer->shape.second == model->header.n_heads * batch_size);
 
-    return record_command("mhsa", {out_buffer, session->config_buffer, cache_buffer, query}, updiv(model->header.n_heads * backlog_size, workgroup_size), 1, batch_size);
+    return record_command("mhsa" + activation_suffix(query), {out_buffer, partition->config_buffer, cache_buffer, query}, updiv(model->header.n_heads * backlog_size, workgroup_size), 1, batch_size);
 }
 
 void llava_command_buffer::inplace_softmax(llava_buffer *inout_buffer) {
@@ -173,7 +308,7 @@ void llava_command_buffer::inplace_softmax(llava_buffer *inout_buffer) {
     assert(inout_buffer->shape.first == backlog_size);
     assert(inout_buffer->shape.second == model->header.n_heads * batch_size);
 
-    return record_command("softmax", {inout_buffer, session->config_buffer}, updiv(model->header.n_heads, session->get_spevar_struct().softmax_head_per_wavefront), 1, batch_size);
+    return record_command("softmax", {inout_buffer, partition->config_buffer}, updiv(model->header.n_heads, session->get_spevar_struct().softmax_head_per_wavefront), 1, batch_size);
 }
 
 void llava_command_buffer::perform_kqv_matching(llava_buffer *v_out, llava_buffer *v_cache, llava_buffer *softmax_out) {
@@ -190,17 +325,19 @@ void llava_command_buffer::perform_kqv_matching(llava_buffer *v_out, llava_buffe
     assert(softmax_out->shape.first == backlog_size);
     assert(softmax_out->shape.second == model->header.n_heads * batch_size);
 
-    return record_command("kqv_matching", {v_out, v_cache, softmax_out}, updiv(model->header.dim, session->get_spevar_struct().softmax_head_per_wavefront), 1, batch_size);
+    return record_command("kqv_matching" + activation_suffix(v_out), {v_out, v_cache, softmax_out}, updiv(model->header.dim, session->get_spevar_struct().softmax_head_per_wavefront), 1, batch_size);
 }
 
 void llava_command_buffer::record_command(const string &pipeline_name,
                                           const initializer_list<llava_buffer *> &l_buffers,
                                           u32 countX,
                                           u32 countY,
-                                          u32 countZ) {
+                                          u32 countZ,
+                                          u32 output_count) {
     llava_context *context = session->ctx;
-    assert(l_buffers.size() != 0);
-    llava_buffer *const output_buffer = *(l_buffers.begin());
+    assert(l_buffers.size() >= output_count);
+    // The first output_count buffers are written by the command, the others are only read
+    set<llava_buffer *> const output_buffers(l_buffers.begin(), l_buffers.begin() + output_count);
 
     u32 buffer_count = 0;
     for (llava_buffer *buffer: l_buffers) {
@@ -212,19 +349,15 @@ void llava_command_buffer::record_command(const string &pipeline_name,
     writes.reserve(buffer_count);
     buffersInfo.reserve(buffer_count);
 
-    auto *pipeline = context->get_pipeline(pipeline_name, buffer_count, session->get_spevar_struct());
+    auto *pipeline = device->get_pipeline(pipeline_name, buffer_count, session->get_spevar_struct());
 
-    vk::DescriptorSet descriptorSet;
-    {
-        lock_guard guard(context->descriptor_pool_mutex);
-        descriptorSet = context->get_device().allocateDescriptorSets({context->get_descriptor_pool(), 1, &pipeline->descriptorSetLayout}).front();
-    }
-    vk::CommandBuffer commandBuffer;
-    {
-        lock_guard guard(context->command_pool_mutex);
-        commandBuffer = context->get_device().allocateCommandBuffers({context->get_command_pool(), vk::CommandBufferLevel::ePrimary, 1}).front();
+    vk::DescriptorSet descriptorSet = allocate_descriptor_set(pipeline->descriptorSetLayout, buffer_count);
+    vk::CommandBuffer commandBuffer = device->get_device().allocateCommandBuffers({command_pool, vk::CommandBufferLevel::ePrimary, 1}).front();
+    vk::Event completionEvent(device->get_device().createEvent({}));
+    vk::QueryPool timestampPool;
+    if (context->profiling_enabled()) {
+        timestampPool = device->get_device().createQueryPool({{}, vk::QueryType::eTimestamp, 2});
     }
-    vk::Event completionEvent(context->get_device().createEvent({}));
 
     vector<pair<vk::Buffer, bool>> buffers;
     for (llava_buffer *buffer: l_buffers) {
@@ -245,7 +378,7 @@ void llava_command_buffer::record_command(const string &pipeline_name,
         writes.emplace_back(descriptorSet, i, 0, 1, vk::DescriptorType::eStorageBuffer, nullptr, buffersInfo.data() + i);
     }
 
-    context->get_device().updateDescriptorSets(writes, {});
+    device->get_device().updateDescriptorSets(writes, {});
 
     vector<vk::BufferMemoryBarrier> barriers;
     vector<vk::Event> events;
@@ -256,15 +389,17 @@ void llava_command_buffer::record_command(const string &pipeline_name,
             // Wait for it !
             events.emplace_back(it->second);
             for (auto &sub_buffer: buffer->get_sub_buffers()) {
-                auto dstAccessMask = (buffer == output_buffer) ? (vk::AccessFlagBits::eShaderWrite) : (vk::AccessFlagBits::eShaderRead);
-                auto srcAccessMask = ((buffer == session->config_buffer) or ((buffer == session->current_thought) and (not buffer_to_last_write_event.contains(buffer))))
-                                     ? (vk::AccessFlagBits::eHostWrite) : (vk::AccessFlagBits::eShaderWrite);
-                barriers.emplace_back(srcAccessMask, dstAccessMask, context->get_queue_family_index(), context->get_queue_family_index(), *(sub_buffer.buffer), 0, sub_buffer.size);
+                auto dstAccessMask = output_buffers.contains(buffer) ? (vk::AccessFlagBits::eShaderWrite) : (vk::AccessFlagBits::eShaderRead);
+                bool host_written = partition and ((buffer == partition->config_buffer) or ((buffer == partition->current_thought) and (not buffer_to_last_write_event.contains(buffer))));
+                auto srcAccessMask = host_written ? (vk::AccessFlagBits::eHostWrite) : (vk::AccessFlagBits::eShaderWrite);
+                barriers.emplace_back(srcAccessMask, dstAccessMask, device->get_queue_family_index(), device->get_queue_family_index(), *(sub_buffer.buffer), 0, sub_buffer.size);
             }
         }
     }
 
-    buffer_to_last_write_event[output_buffer] = completionEvent;
+    for (llava_buffer *output_buffer: output_buffers) {
+        buffer_to_last_write_event[output_buffer] = completionEvent;
+    }
 
     commandBuffer.begin(vk::CommandBufferBeginInfo());
     commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, pipeline->pipeline);
@@ -272,25 +407,42 @@ void llava_command_buffer::record_command(const string &pipeline_name,
     if (not events.empty()) {
         commandBuffer.waitEvents(events, vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eComputeShader, {}, barriers, {});
     }
+    if (timestampPool) {
+        // Queries are reset on every submission, the command buffer is replayed for each token
+        // The first timestamp is written once previously submitted compute work is done, so overlapping dispatches are not double counted
+        commandBuffer.resetQueryPool(timestampPool, 0, 2);
+        commandBuffer.writeTimestamp(vk::PipelineStageFlagBits::eComputeShader, timestampPool, 0);
+    }
     commandBuffer.dispatch(countX, countY, countZ);
+    if (timestampPool) {
+        commandBuffer.writeTimestamp(vk::PipelineStageFlagBits::eComputeShader, timestampPool, 1);
+    }
     commandBuffer.setEvent(completionEvent, vk::PipelineStageFlagBits::eComputeShader);
     commandBuffer.end();
 
-    command_buffer.emplace_back(context, descriptorSet, commandBuffer, completionEvent);
+    command_buffer.emplace_back(device, descriptorSet, commandBuffer, completionEvent, timestampPool, pipeline_name, current_layer);
 }
 
 llava_wrapped_command::~llava_wrapped_command() {
-    context->get_device().freeCommandBuffers(context->get_command_pool(), commandBuffer);
-    context->get_device().freeDescriptorSets(context->get_descriptor_pool(), descriptorSet);
-    context->get_device().destroy(completionEvent);
+    // commandBuffer and descriptorSet belong to the pools of their llava_command_buffer
+    device->get_device().destroy(completionEvent);
+    if (timestampPool) {
+        device->get_device().destroy(timestampPool);
+    }
 }
 
-llava_wrapped_command::llava_wrapped_command(llava_context *_context,
+llava_wrapped_command::llava_wrapped_command(llava_device *_device,
                                              vk::DescriptorSet _descriptorSet,
                                              vk::CommandBuffer _commandBuffer,
-                                             vk::Event _completionEvent) : context(_context),
-                                                                           descriptorSet(_descriptorSet),
-                                                                           commandBuffer(_commandBuffer),
-                                                                           completionEvent(_completionEvent) {
+                                             vk::Event _completionEvent,
+                                             vk::QueryPool _timestampPool,
+                                             string _pipeline_name,
+                                             u32 _layer_id) : device(_device),
+                                                              descriptorSet(_descriptorSet),
+                                                              commandBuffer(_commandBuffer),
+                                                              completionEvent(_completionEvent),
+                                                              timestampPool(_timestampPool),
+                                                              pipeline_name(std::move(_pipeline_name)),
+                                                              layer_id(_layer_id) {
 
 }
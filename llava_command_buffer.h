@@ -10,47 +10,69 @@
 
 class llava_wrapped_command {
 public:
-    llava_wrapped_command(llava_context* context, vk::DescriptorSet descriptorSet, vk::CommandBuffer commandBuffer, vk::Event completionEvent);
+    llava_wrapped_command(llava_device* device, vk::DescriptorSet descriptorSet, vk::CommandBuffer commandBuffer, vk::Event completionEvent, vk::QueryPool timestampPool, string pipeline_name, u32 layer_id);
     llava_wrapped_command(llava_wrapped_command const&) = delete;
     llava_wrapped_command(llava_wrapped_command&) = delete;
     llava_wrapped_command(llava_wrapped_command&&) = delete;
     ~llava_wrapped_command();
-    llava_context* const context;
+    llava_device* const device;
     const vk::DescriptorSet descriptorSet;
     const vk::CommandBuffer commandBuffer;
     const vk::Event completionEvent;
+
+public: // profiling, timestampPool is null when disabled
+    const vk::QueryPool timestampPool;
+    const string pipeline_name;
+    const u32 layer_id;
 };
 
 class llava_command_buffer {
 public:
-    explicit llava_command_buffer(llava_session *session);
+    // Records the layers held by the partition's device, a null partition only allows standalone commands
+    llava_command_buffer(llava_session *session, llava_device* device, session_partition_t* partition = nullptr);
     ~llava_command_buffer();
     void record_execution();
+    void end_recording();
     void run();
     void normalize_logit(llava_buffer* outbuf, llava_buffer* inbuf, llava_buffer* weights);
     void matmul(llava_buffer* outbuf, llava_buffer*, llava_buffer*);
+    void matmul_qkv(llava_buffer* q_out, llava_buffer* k_out, llava_buffer* v_out, llava_buffer* wqkv_matrix, llava_buffer* inbuf, llava_buffer* norm_weights = nullptr);
     void matmul_add_inplace(llava_buffer* outbuf, llava_buffer*, llava_buffer*);
     void kv_copy(llava_buffer*, llava_buffer*);
+    void kv_shift(llava_buffer* cache);
+    void kv_gather(llava_buffer* cache, u32 step_count);
     void copy_logit(llava_buffer*, llava_buffer*);
     void multi_head_attention(llava_buffer* attn_out, llava_buffer* k_cache, llava_buffer* query);
     void perform_kqv_matching(llava_buffer* v_out, llava_buffer* v_cache, llava_buffer* softmax_out);
     void inplace_softmax(llava_buffer*);
-    void matmul_silu_ff(llava_buffer *outbuf, llava_buffer *w3_matrix, llava_buffer *w1_matrix, llava_buffer *inbuf);
+    void matmul_silu_ff(llava_buffer *outbuf, llava_buffer *w3_matrix, llava_buffer *w1_matrix, llava_buffer *inbuf, llava_buffer* norm_weights = nullptr);
 
 public:
-    void record_command(const string& pipeline_name, const initializer_list<llava_buffer *> &buffers, uint32_t countX, uint32_t countY = 1, uint32_t countZ = 1);
-    void wait_idle() const;
+    void record_command(const string& pipeline_name, const initializer_list<llava_buffer *> &buffers, uint32_t countX, uint32_t countY = 1, uint32_t countZ = 1, uint32_t output_count = 1);
+    void wait_idle();
 
 public:
     llava_session* const session;
+    llava_device* const device;
+    session_partition_t* const partition;
     u32 const backlog_size;
     u32 const workgroup_size;
     u32 const batch_size;
+    u32 current_layer;
 
 private: // command buffer stuff
     list<llava_wrapped_command> command_buffer;
     vector<vk::CommandBuffer> command_buffer_raw;
     vk::Fence fence;
+    bool timestamps_pending = false;
+
+private: // pools owned by this command buffer, so that recording never waits for other sessions
+    vk::CommandPool command_pool;
+    vector<vk::DescriptorPool> descriptor_pools; // Arena, a pool is added when the last one is full
+    vk::DescriptorSet allocate_descriptor_set(vk::DescriptorSetLayout const& layout, u32 descriptor_count);
+
+private:
+    void collect_timestamps();
 
 private:
     map<llava_buffer*, vk::Event> buffer_to_last_write_event;
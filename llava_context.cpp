@@ -4,6 +4,7 @@
 #include "llava_layer.h"
 #include "llava_command_buffer.h"
 #include "llava_session.h"
+#include "llava_cpu_backend.h"
 #include "utils.h"
 #include <iostream>
 #include <csignal>
@@ -35,54 +36,41 @@ llava_context::llava_context() = default;
 
 vk::PhysicalDevice llava_context::find_suitable_physical_device() {
     auto physical_devices = vulkan_instance.enumeratePhysicalDevices();
-    for (vk::PhysicalDevice const &pd : physical_devices) {
-        if (pd.getProperties().deviceType == vk::PhysicalDeviceType::eDiscreteGpu) {
-            if (find_suitable_memory_type(pd) != (~0U)) {
-                return pd;
-            } else if (verbosity > 0) {
-                cout << "[*] Not using GPU " << pd.getProperties().deviceName << " as it does not meet memory requirements" << endl;
-            }
-        }
-    }
-
-    for (vk::PhysicalDevice const &pd : physical_devices) {
-        if (pd.getProperties().deviceType == vk::PhysicalDeviceType::eIntegratedGpu) {
-            if (find_suitable_memory_type(pd) != (~0U)) {
-                return pd;
-            } else if (verbosity > 0) {
-                cout << "[*] Not using GPU " << pd.getProperties().deviceName << " as it does not meet memory requirements" << endl;
+    // Devices holding the requested layers, the whole model by default, are preferred, any other one can still take part of them
+    size_t requested_size = model->mapping_size;
+    if ((requested_gpu_layers > 0) and (u32(requested_gpu_layers) < model->header.n_layers)) {
+        requested_size = requested_gpu_layers * get_layer_size();
+    }
+    vector<size_t> min_heap_sizes = {requested_size, 0};
+    for (size_t min_heap_size : min_heap_sizes) {
+        for (vk::PhysicalDeviceType device_type : {vk::PhysicalDeviceType::eDiscreteGpu, vk::PhysicalDeviceType::eIntegratedGpu}) {
+            for (vk::PhysicalDevice const &pd : physical_devices) {
+                if (pd.getProperties().deviceType != device_type) {
+                    continue;
+                }
+                if (llava_device::find_suitable_memory_type(pd, min_heap_size) != (~0U)) {
+                    return pd;
+                } else if ((verbosity > 0) and (min_heap_size == min_heap_sizes.back())) {
+                    cout << "[*] Not using GPU " << pd.getProperties().deviceName << " as it does not meet memory requirements" << endl;
+                }
             }
         }
     }
 
-    cerr << "[!] Cannot find suitable GPU" << endl;
-    exit(1);
-}
-
-uint32_t llava_context::get_queue_family_index() const {
-    return queueFamilyIndex;
-}
-
-vk::PhysicalDevice& llava_context::get_physical_device() {
-    return physical_device;
+    return nullptr;
 }
 
 llava_context::~llava_context() {
-    named_pipelines.clear();
+    delete draft_context;
+    draft_context = nullptr;
     layers.clear();
+    delete cpu_backend;
+    cpu_backend = nullptr;
 
-    if (device) {
-        device.destroy(command_pool);
-        device.destroy(descriptor_pool);
-        device.destroy(pipeline_cache);
-        command_pool = nullptr;
-        descriptor_pool = nullptr;
-        pipeline_cache = nullptr;
-        device.destroy();
-    }
-    queue = nullptr;
-    physical_device = nullptr;
-    device = nullptr;
+    for (llava_device* device : devices) {
+        delete device;
+    }
+    devices.clear();
     if (vulkan_instance) {
         vulkan_instance.destroy();
     }
@@ -95,55 +83,6 @@ llava_context::~llava_context() {
     }
 }
 
-u32 llava_context::find_suitable_memory_type(vk::PhysicalDevice const& _physical_device) {
-    auto memory_properties = _physical_device.getMemoryProperties();
-    set<u32> accepted_memory_heaps;
-    for(u32 i = 0; i < memory_properties.memoryHeapCount; i++) {
-        if (memory_properties.memoryHeaps.at(i).size > model->mapping_size) {
-            accepted_memory_heaps.insert(i);
-        }
-    }
-    auto wanted_flags = vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent;
-    list<u32> device_not_local_types;
-    for(u32 i = 0; i < memory_properties.memoryTypeCount; ++i) {
-        auto& memType = memory_properties.memoryTypes.at(i);
-        if (not accepted_memory_heaps.contains(memType.heapIndex)) {
-            continue;
-        }
-
-        if ((memType.propertyFlags & wanted_flags) != wanted_flags) {
-            continue;
-        }
-
-        if (memType.propertyFlags & vk::MemoryPropertyFlagBits::eDeviceLocal) {
-            return i;
-        } else {
-            device_not_local_types.push_back(i);
-        }
-    }
-
-    if (not device_not_local_types.empty()) {
-        return device_not_local_types.front();
-    }
-
-    return ~0U;
-}
-
-u32 llava_context::find_suitable_queue_index() {
-    vector<vk::QueueFamilyProperties> queueFamilyProperties = physical_device.getQueueFamilyProperties();
-    for (uint32_t i = 0; i < queueFamilyProperties.size(); i++) {
-        if ((queueFamilyProperties.at(i).queueFlags & vk::QueueFlagBits::eCompute) and ((queueFamilyProperties.at(i).queueFlags & vk::QueueFlagBits::eGraphics) != vk::QueueFlagBits::eGraphics)) {
-            return i;
-        }
-    }
-    for (uint32_t i = 0; i < queueFamilyProperties.size(); i++) {
-        if (queueFamilyProperties.at(i).queueFlags & vk::QueueFlagBits::eCompute) {
-            return i;
-        }
-    }
-    return ~0U;
-}
-
 bool streq(const char* a1, const char* a2) {
     return (strcmp(a1, a2) == 0);
 }
@@ -156,6 +95,8 @@ int llava_context::run(int argc, char **argv) {
     bool controlled = false;
     bool debug_mode = false;
     bool only_print_header = false;
+    bool autotune = true;
+    bool tune_only = false;
     string model_path;
     bool model_path_provided = false;
     string prompt = "The ten best monuments to see in Paris are";
@@ -179,7 +120,7 @@ int llava_context::run(int argc, char **argv) {
             ++i;
             model_path = argv[i];
         } else if (streq(argv[i], "--help") or streq(argv[i], "-h")) {
-            cout << (argc ? argv[0] : "./llama_vulkan") << " [-h] [-m model_name.bin] [prompt] [-r]" << endl;
+            cout << (argc ? argv[0] : "./llama_vulkan") << " [-h] [-m model_name.bin] [--fp16-activations] [--no-autotune] [--tune-only] [--profile] [--cpu] [--gpu-layers n|auto] [--devices id,id...] [--draft-model draft.bin] [--lookup-ngram n] [--draft-tokens k] [--beams n] [--keep n] [--window n] [--prefill-chunk n] [--threads n] [--server-workers n] [--unix-socket path] [prompt] [-r]" << endl;
             exit(0);
         } else if (streq(argv[i], "--verbose") or streq(argv[i], "-v")) {
             verbosity++;
@@ -189,6 +130,121 @@ int llava_context::run(int argc, char **argv) {
             server_mode = true;
         } else if (streq(argv[i], "--sigdebug")) {
             signal_debug = true;
+        } else if (streq(argv[i], "--fp16-activations")) {
+            fp16_activations = true;
+        } else if (streq(argv[i], "--no-autotune")) {
+            autotune = false;
+        } else if (streq(argv[i], "--tune-only")) {
+            tune_only = true;
+        } else if (streq(argv[i], "--profile")) {
+            profiling = true;
+        } else if (streq(argv[i], "--cpu")) {
+            requested_gpu_layers = 0;
+        } else if (streq(argv[i], "--gpu-layers") or streq(argv[i], "-ngl")) {
+            if (i + 1 >= argc) {
+                cerr << "[!] Expected layer count after " << argv[i] << endl;
+                exit(1);
+            }
+            ++i;
+            requested_gpu_layers = (streq(argv[i], "auto")) ? -1 : (int) strtol(argv[i], nullptr, 10);
+        } else if (streq(argv[i], "--devices")) {
+            if (i + 1 >= argc) {
+                cerr << "[!] Expected comma separated device ids after " << argv[i] << endl;
+                exit(1);
+            }
+            ++i;
+            requested_device_ids.clear();
+            for (char* cursor = argv[i]; *cursor;) {
+                requested_device_ids.push_back(strtoul(cursor, &cursor, 10));
+                if (*cursor == ',') {
+                    cursor++;
+                } else if (*cursor) {
+                    cerr << "[!] Invalid device list " << argv[i] << endl;
+                    exit(1);
+                }
+            }
+        } else if (streq(argv[i], "--draft-model") or streq(argv[i], "-md")) {
+            if (i + 1 >= argc) {
+                cerr << "[!] Expected draft model path after " << argv[i] << endl;
+                exit(1);
+            }
+            ++i;
+            draft_model_path = argv[i];
+        } else if (streq(argv[i], "--lookup-ngram")) {
+            if (i + 1 >= argc) {
+                cerr << "[!] Expected n-gram size after " << argv[i] << endl;
+                exit(1);
+            }
+            ++i;
+            lookup_ngram_size = strtoul(argv[i], nullptr, 10);
+        } else if (streq(argv[i], "--draft-tokens")) {
+            if (i + 1 >= argc) {
+                cerr << "[!] Expected token count after " << argv[i] << endl;
+                exit(1);
+            }
+            ++i;
+            draft_token_count = strtoul(argv[i], nullptr, 10);
+        } else if (streq(argv[i], "--keep")) {
+            if (i + 1 >= argc) {
+                cerr << "[!] Expected token count after " << argv[i] << endl;
+                exit(1);
+            }
+            ++i;
+            context_keep = strtoul(argv[i], nullptr, 10);
+        } else if (streq(argv[i], "--window")) {
+            if (i + 1 >= argc) {
+                cerr << "[!] Expected token count after " << argv[i] << endl;
+                exit(1);
+            }
+            ++i;
+            attention_window = strtoul(argv[i], nullptr, 10);
+            if ((attention_window & (attention_window - 1)) or (attention_window < 64) or (2 * attention_window > max_backlog_size)) {
+                cerr << "[!] The attention window must be a power of two between 64 and " << max_backlog_size / 2 << endl;
+                exit(1);
+            }
+        } else if (streq(argv[i], "--prefill-chunk")) {
+            if (i + 1 >= argc) {
+                cerr << "[!] Expected token count after " << argv[i] << endl;
+                exit(1);
+            }
+            ++i;
+            prefill_chunk = strtoul(argv[i], nullptr, 10);
+            if ((prefill_chunk < 16) or (prefill_chunk > max_backlog_size)) {
+                cerr << "[!] The prefill chunk must be between 16 and " << max_backlog_size << " tokens" << endl;
+                exit(1);
+            }
+        } else if (streq(argv[i], "--beams")) {
+            if (i + 1 >= argc) {
+                cerr << "[!] Expected beam count after " << argv[i] << endl;
+                exit(1);
+            }
+            ++i;
+            beam_width = strtoul(argv[i], nullptr, 10);
+            if (beam_width > max_beam_width) {
+                cerr << "[!] At most " << max_beam_width << " beams are supported" << endl;
+                exit(1);
+            }
+        } else if (streq(argv[i], "--threads") or streq(argv[i], "-t")) {
+            if (i + 1 >= argc) {
+                cerr << "[!] Expected thread count after " << argv[i] << endl;
+                exit(1);
+            }
+            ++i;
+            cpu_thread_count = strtoul(argv[i], nullptr, 10);
+        } else if (streq(argv[i], "--server-workers")) {
+            if (i + 1 >= argc) {
+                cerr << "[!] Expected thread count after " << argv[i] << endl;
+                exit(1);
+            }
+            ++i;
+            server_worker_count = strtoul(argv[i], nullptr, 10);
+        } else if (streq(argv[i], "--unix-socket")) {
+            if (i + 1 >= argc) {
+                cerr << "[!] Expected socket path after " << argv[i] << endl;
+                exit(1);
+            }
+            ++i;
+            unix_socket_path = argv[i];
         } else {
             if (i + 1 != argc) {
                 cerr << "[!] Unexpected argument " << argv[i] << endl;
@@ -227,114 +283,46 @@ int llava_context::run(int argc, char **argv) {
         return 0;
     }
 
-    vk::ApplicationInfo applicationInfo("llava", 1, "llava0", 1, VK_API_VERSION_1_2);
-
-    vector<const char *> enabled_layers;
-    if (debug_mode) {
-        enabled_layers.emplace_back("VK_LAYER_KHRONOS_validation");
-    }
-
-    // create an Instance
-    vulkan_instance = vk::createInstance({{}, &applicationInfo, enabled_layers});
-    physical_device = find_suitable_physical_device();
-    if (verbosity) {
-        cout << "Selected device: " << physical_device.getProperties().deviceName << endl;
-    }
-
-    queueFamilyIndex = find_suitable_queue_index();
-    if (!~queueFamilyIndex) {
-        cerr << "[!] No compute queue family found on selected device" << endl;
+    if (not setup_backends(debug_mode)) {
         return 1;
     }
-    if (verbosity >= 2) {
-        cout << "Selected queue: " << queueFamilyIndex << endl;
-    }
 
-    mainMemoryTypeIndex = find_suitable_memory_type(physical_device);
-    if (!~mainMemoryTypeIndex) {
-        cerr << "[!] No suitable memory type found on selected device" << endl;
+    if (not setup_signal_handling()) {
+        cerr << "[!] Cannot setup signal handling" << endl;
         return 1;
     }
 
-    this->workgroup_size = physical_device.getProperties().limits.maxComputeWorkGroupInvocations;
-    ulog2(this->workgroup_size); // Assert it is a pow2
-
-    // create a Device
-    float queuePriority = 0.0f;
-    vk::DeviceQueueCreateInfo deviceQueueCreateInfo(vk::DeviceQueueCreateFlags(), queueFamilyIndex, 1, &queuePriority);
-    vk::PhysicalDevice16BitStorageFeatures features16bit;
-    features16bit.storageInputOutput16 = false;
-    features16bit.uniformAndStorageBuffer16BitAccess = false;
-    features16bit.storageBuffer16BitAccess = true;
-    device = physical_device.createDevice(vk::DeviceCreateInfo(vk::DeviceCreateFlags(), deviceQueueCreateInfo, {}, {}, {}, &features16bit));
-
-    // create a CommandPool to allocate a CommandBuffer from
-    command_pool = device.createCommandPool({{}, queueFamilyIndex});
-
-    // Descriptor pool
-    vk::DescriptorPoolSize descriptorPoolSize(vk::DescriptorType::eStorageBuffer, 4096 * 16);
-    descriptor_pool = device.createDescriptorPool({vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet,
-                                                   descriptorPoolSize.descriptorCount, 1, &descriptorPoolSize});
-    // Queue
-    queue = device.getQueue(queueFamilyIndex, 0);
-
-    // Pipeline cache
-    pipeline_cache = device.createPipelineCache({{}, 0, nullptr});
-
-    if (not setup_signal_handling()) {
-        cerr << "[!] Cannot setup signal handling" << endl;
+    if (not load_layers()) {
         return 1;
     }
 
-    layers.reserve(model->header.n_layers);
-    for (u32 i = 0; i < model->header.n_layers; ++i) {
-        layers.emplace_back(this, i);
+#ifdef RUNTIME_BUILD_ENABLED
+    glslang::InitializeProcess();
+#endif
+
+    if (gpu_enabled()) {
+        // Without benchmarking, cached results are still used and defaults fill the gaps
+        llava_autotuner autotuner(this);
+        autotuner.tune(autotune, verbosity);
     }
 
-    for (auto& layer : layers) {
-        if (pop_signal()) {
+    if (not draft_model_path.empty()) {
+        draft_context = new llava_context();
+        if (not draft_context->load_draft(this, draft_model_path, debug_mode, autotune)) {
             return 1;
         }
-        layer.freeze_storage();
     }
-
-    {
-        list<u32> layers_to_load;
-        mutex gpu_load_mutex;
-        for (auto& layer : layers) {
-            layers_to_load.push_back(layer.layer_id);
-        }
-        vector<thread> gpu_load_threads;
-        for(u32 i = 0; i < 8; ++i) {
-            gpu_load_threads.emplace_back([this, &layers_to_load, &gpu_load_mutex](){
-                while (true) {
-                    u32 to_load;
-                    {
-                        lock_guard guard(gpu_load_mutex);
-                        if(layers_to_load.empty()) {
-                            break;
-                        }
-                        to_load = layers_to_load.front();
-                        layers_to_load.pop_front();
-                    }
-                    this->layers.at(to_load).load_to_gpu();
-                }
-            });
-        }
-        for (auto& t : gpu_load_threads) {
-            t.join();
-        }
+    if (tune_only) {
+        // Fills the auto-tuning cache and exits
+        return 0;
     }
-
-#ifdef RUNTIME_BUILD_ENABLED
-    glslang::InitializeProcess();
-#endif
+    // Benchmark dispatches are not part of the report
+    profiler.reset();
 
     if (server_mode) {
         lsrv::llava_server server(this);
         server.serve_forever();
     } else {
-        u32 eos_id = 2;
         llava_session session(this);
 
         if (not session.set_text(prompt)) {
@@ -343,13 +331,57 @@ int llava_context::run(int argc, char **argv) {
         }
 
         cout << prompt << flush;
-        u32 next_token = session.predict_next_token();
-        while (true) {
+        u32 next_token = eos_token_id;
+        bool sampling = true;
+        if (beam_width > 1) {
+            // The best hypothesis is only known at the end
+            sampling = false;
+            if (not session.start_beam_search(beam_width)) {
+                cerr << "[!] Cannot start beam search" << endl;
+                exit(1);
+            }
+            while (not session.beam_search_done() and not pop_signal()) {
+                if (not session.advance_beams()) {
+                    break; // Too many tokens
+                }
+            }
+            vector<u32> best_tokens;
+            if (not session.end_beam_search(best_tokens)) {
+                cerr << "[!] Beam search failed" << endl;
+            }
+            for (u32 token : best_tokens) {
+                cout << model->tokens[token].text;
+            }
+        } else if (session.speculation_enabled()) {
+            // Several tokens per weight pass, pushed by the session as they are accepted
+            vector<u32> new_tokens;
+            bool done = false;
+            while (not done and not pop_signal()) {
+                new_tokens.clear();
+                if (not session.predict_next_tokens(new_tokens)) {
+                    break; // Too many tokens
+                }
+                for (u32 token : new_tokens) {
+                    if (token == eos_token_id) {
+                        done = true;
+                        break;
+                    }
+                    cout << model->tokens[token].text << flush;
+                }
+            }
+            if (verbosity) {
+                auto [accepted, proposed] = session.get_speculation_stats();
+                cout << endl << "[*] Accepted " << accepted << "/" << proposed << " draft tokens";
+            }
+        } else {
+            next_token = session.predict_next_token();
+        }
+        while (sampling and not session.speculation_enabled()) {
             if (~next_token == 0) {
                 cerr << "Unknown error" << endl;
                 break;
             }
-            if (pop_signal() or (next_token == eos_id)) {
+            if (pop_signal() or (next_token == eos_token_id)) {
                 break;
             }
 
@@ -365,11 +397,15 @@ int llava_context::run(int argc, char **argv) {
             next_token = session.finish_next_token_prediction();
         }
 
-        if (next_token != eos_id) {
+        if (next_token != eos_token_id) {
             cout << model->tokens[next_token].text;
         }
 
         cout << endl;
+
+        if (profiling) {
+            profiler.print_report(cout);
+        }
     }
 
 #ifdef RUNTIME_BUILD_ENABLED
@@ -379,64 +415,240 @@ int llava_context::run(int argc, char **argv) {
     return 0;
 }
 
-vk::Device& llava_context::get_device() {
-    assert(device);
-    return device;
-}
+bool llava_context::setup_backends(bool debug_mode) {
+    if ((requested_gpu_layers != 0) and not setup_vulkan(debug_mode)) {
+        return false;
+    }
 
-vk::CommandPool& llava_context::get_command_pool() {
-    assert(command_pool);
-    return command_pool;
+    if (head_on_cpu()) {
+        u32 thread_count = cpu_thread_count ? cpu_thread_count : max(1U, thread::hardware_concurrency());
+        cpu_backend = new llava_cpu_backend(model, thread_count);
+        if (verbosity) {
+            cout << "Running " << (model->header.n_layers - gpu_layer_count) << "/" << model->header.n_layers << " layers on CPU: " << cpu_backend->get_thread_count() << " threads, " << llava_cpu_backend::get_simd_name() << " kernels" << endl;
+        }
+        if (profiling and not gpu_enabled()) {
+            cerr << "[*] Profiling relies on GPU timestamps, disabled on CPU" << endl;
+            profiling = false;
+        }
+    }
+    return true;
 }
 
-vk::DescriptorPool& llava_context::get_descriptor_pool() {
-    assert(descriptor_pool);
-    return descriptor_pool;
-}
+bool llava_context::load_layers() {
+    layers.reserve(model->header.n_layers);
+    for (u32 i = 0; i < model->header.n_layers; ++i) {
+        layers.emplace_back(this, i);
+    }
 
-vk::PipelineCache& llava_context::get_pipeline_cache() {
-    assert(pipeline_cache);
-    return pipeline_cache;
+    for (auto& layer : layers) {
+        // A draft context does not own the signal fd, the main context checks it
+        if ((sigfd != -1) and pop_signal()) {
+            return false;
+        }
+        layer.freeze_storage();
+    }
+
+    list<u32> layers_to_load;
+    mutex gpu_load_mutex;
+    for (auto& layer : layers) {
+        layers_to_load.push_back(layer.layer_id);
+    }
+    vector<thread> gpu_load_threads;
+    for(u32 i = 0; i < 8; ++i) {
+        gpu_load_threads.emplace_back([this, &layers_to_load, &gpu_load_mutex](){
+            while (true) {
+                u32 to_load;
+                {
+                    lock_guard guard(gpu_load_mutex);
+                    if(layers_to_load.empty()) {
+                        break;
+                    }
+                    to_load = layers_to_load.front();
+                    layers_to_load.pop_front();
+                }
+                this->layers.at(to_load).load_to_gpu();
+            }
+        });
+    }
+    for (auto& t : gpu_load_threads) {
+        t.join();
+    }
+    return true;
 }
 
-ggml_file const* llava_context::get_model() const {
-    assert(model);
-    return model;
+bool llava_context::load_draft(llava_context const* target, string const& draft_path, bool debug_mode, bool autotune) {
+    // The draft picks its own device, and only follows the target's settings that do not change its results
+    verbosity = target->verbosity;
+    signal_debug = target->signal_debug;
+    use_prebuilt_shaders = target->use_prebuilt_shaders;
+    fp16_activations = target->fp16_activations;
+    cpu_thread_count = target->cpu_thread_count;
+    context_keep = target->context_keep;
+    attention_window = target->attention_window;
+    prefill_chunk = target->prefill_chunk;
+    if (target->requested_gpu_layers == 0) {
+        requested_gpu_layers = 0;
+    }
+
+    model = new ggml_file(draft_path.c_str());
+    if (not model->is_open()) {
+        return false;
+    }
+    // Proposals are token ids, so both models must share the vocabulary
+    bool same_vocabulary = (model->tokens.size() == target->model->tokens.size());
+    for (u32 i = 0; same_vocabulary and (i < model->tokens.size()); ++i) {
+        same_vocabulary = (model->tokens.at(i).text == target->model->tokens.at(i).text);
+    }
+    if (not same_vocabulary) {
+        cerr << "[!] The draft model's vocabulary differs from the model's one" << endl;
+        return false;
+    }
+
+    if (verbosity) {
+        cout << "Loading draft model " << draft_path << endl;
+    }
+    if (not setup_backends(debug_mode) or not load_layers()) {
+        return false;
+    }
+    if (gpu_enabled()) {
+        llava_autotuner autotuner(this);
+        autotuner.tune(autotune, verbosity);
+    }
+    return true;
 }
 
-using pipeline_signature = pair<string, specialization_variables_t>;
+bool llava_context::setup_vulkan(bool debug_mode) {
+    vk::ApplicationInfo applicationInfo("llava", 1, "llava0", 1, VK_API_VERSION_1_2);
 
-std::weak_ordering operator<=>(const pipeline_signature &lhs, const pipeline_signature &rhs) {
-    auto f = lhs.first <=> rhs.first;
-    if(f != std::weak_ordering::equivalent) {
-        return f;
+    vector<const char *> enabled_layers;
+    if (debug_mode) {
+        enabled_layers.emplace_back("VK_LAYER_KHRONOS_validation");
     }
-    int r = memcmp(&lhs.second, &rhs.second, sizeof(rhs.second));
-    if (r < 0) {
-        return std::weak_ordering::less;
+
+    // create an Instance
+    vulkan_instance = vk::createInstance({{}, &applicationInfo, enabled_layers});
+    vector<vk::PhysicalDevice> physical_devices;
+    if (requested_device_ids.empty()) {
+        vk::PhysicalDevice physical_device = find_suitable_physical_device();
+        if (physical_device) {
+            physical_devices.push_back(physical_device);
+        }
+    } else {
+        // Ids may repeat, every occurrence gets its own logical device and share of the layers
+        auto available_devices = vulkan_instance.enumeratePhysicalDevices();
+        for (u32 id : requested_device_ids) {
+            if (id >= available_devices.size()) {
+                cerr << "[!] No Vulkan device with id " << id << ", " << available_devices.size() << " available" << endl;
+                return false;
+            }
+            physical_devices.push_back(available_devices.at(id));
+        }
     }
-    if (r == 0) {
-        return std::weak_ordering::equivalent;
+    if (physical_devices.empty()) {
+        cerr << "[*] Cannot find suitable GPU, falling back to the CPU backend" << endl;
+        vulkan_instance.destroy();
+        vulkan_instance = nullptr;
+        return true;
     }
-    return std::weak_ordering::greater;
+
+    for (vk::PhysicalDevice const& physical_device : physical_devices) {
+        auto* device = new llava_device(this, physical_device, devices.size());
+        devices.push_back(device);
+        if (not device->probe(model->mapping_size)) {
+            return false;
+        }
+        if (verbosity) {
+            cout << "Selected device " << device->device_id << ": " << device->get_name() << endl;
+        }
+        if (verbosity >= 2) {
+            cout << "Selected queue: " << device->get_queue_family_index() << endl;
+        }
+    }
+
+    partition_layers();
+    if (gpu_layer_count == 0) {
+        cerr << "[*] Not enough device memory for a single layer, falling back to the CPU backend" << endl;
+        for (llava_device* device : devices) {
+            delete device;
+        }
+        devices.clear();
+        vulkan_instance.destroy();
+        vulkan_instance = nullptr;
+        return true;
+    }
+    // Devices left without layers are not created
+    erase_if(devices, [](llava_device* device) {
+        if (device->layer_count == 0) {
+            delete device;
+            return true;
+        }
+        return false;
+    });
+
+    // Specialization constants are shared by all devices, so the smallest limit applies
+    this->workgroup_size = ~0U;
+    for (llava_device* device : devices) {
+        this->workgroup_size = min(this->workgroup_size, device->get_max_workgroup_size());
+        if (profiling and not device->supports_timestamps()) {
+            cerr << "[*] " << device->get_name() << " does not support timestamps, profiling disabled" << endl;
+            profiling = false;
+        }
+        if (fp16_activations and not device->supports_fp16_activations()) {
+            cerr << "[*] " << device->get_name() << " does not support shaderFloat16, fp16 activations disabled" << endl;
+            fp16_activations = false;
+        }
+    }
+    ulog2(this->workgroup_size); // Assert it is a pow2
+
+    for (llava_device* device : devices) {
+        device->create(fp16_activations);
+    }
+    return true;
 }
 
-llava_pipeline *llava_context::get_pipeline(const string &shader_name, u32 argument_count, specialization_variables_t const& spevars) {
-    lock_guard guard(pipeline_mutex);
-    pair<string, specialization_variables_t> signature(shader_name, spevars);
-    auto it = named_pipelines.find(signature);
-    if (it != named_pipelines.end()) {
-        assert (it->second.argument_count == argument_count);
-        return &it->second;
+void llava_context::partition_layers() {
+    u32 n_layers = model->header.n_layers;
+    size_t total_heap_size = 0;
+    u32 total_budget = 0;
+    vector<u32> budgets;
+    for (llava_device* device : devices) {
+        budgets.push_back((requested_gpu_layers >= 0) ? n_layers : get_layer_budget(device->get_heap_size()));
+        total_heap_size += device->get_heap_size();
+        total_budget += budgets.back();
+    }
+    gpu_layer_count = (requested_gpu_layers >= 0) ? min(u32(requested_gpu_layers), n_layers) : min(total_budget, n_layers);
+    if ((verbosity) and (gpu_layer_count < n_layers)) {
+        cout << "[*] Model does not fit in device memory, offloading " << gpu_layer_count << "/" << n_layers << " layers to GPU" << endl;
+    }
+
+    // Shares follow heap sizes, within what each device can hold, and the remainder is spread in device order
+    vector<u32> shares;
+    u32 assigned = 0;
+    for (u32 i = 0; i < devices.size(); ++i) {
+        shares.push_back(min(budgets.at(i), u32(gpu_layer_count * devices.at(i)->get_heap_size() / total_heap_size)));
+        assigned += shares.back();
+    }
+    for (u32 i = 0; assigned < gpu_layer_count; i = (i + 1) % devices.size()) {
+        if (shares.at(i) < budgets.at(i)) {
+            shares.at(i)++;
+            assigned++;
+        }
     }
 
-    it = named_pipelines.emplace(std::piecewise_construct, std::forward_as_tuple(signature), forward_as_tuple(this, shader_name, spevars, use_prebuilt_shaders, argument_count)).first;
-    return &it->second;
+    u32 first_layer = 0;
+    for (u32 i = 0; i < devices.size(); ++i) {
+        devices.at(i)->first_layer = first_layer;
+        devices.at(i)->layer_count = shares.at(i);
+        first_layer += shares.at(i);
+        if (verbosity and (devices.size() > 1)) {
+            cout << "Device " << devices.at(i)->device_id << " runs layers [" << devices.at(i)->first_layer << ", " << first_layer << ")" << endl;
+        }
+    }
 }
 
-vk::Queue &llava_context::get_queue() {
-    assert(queue);
-    return queue;
+ggml_file const* llava_context::get_model() const {
+    assert(model);
+    return model;
 }
 
 vector<llava_layer>& llava_context::get_layers() {
@@ -548,3 +760,102 @@ pair<u32 *, u32> llava_context::get_shader_spirv_by_name(const string &shader_na
 bool llava_context::signal_debug_on() const {
     return signal_debug;
 }
+
+bool llava_context::fp16_activations_enabled() const {
+    return fp16_activations;
+}
+
+bool llava_context::profiling_enabled() const {
+    return profiling;
+}
+
+llava_profiler& llava_context::get_profiler() {
+    return profiler;
+}
+
+bool llava_context::gpu_enabled() const {
+    return gpu_layer_count > 0;
+}
+
+bool llava_context::layer_on_cpu(u32 layer_id) const {
+    return layer_id >= gpu_layer_count;
+}
+
+llava_device* llava_context::get_layer_device(u32 layer_id) {
+    for (llava_device* device : devices) {
+        if (device->holds_layer(layer_id)) {
+            return device;
+        }
+    }
+    return nullptr;
+}
+
+vector<llava_device*> const& llava_context::get_devices() const {
+    return devices;
+}
+
+bool llava_context::head_on_cpu() const {
+    // The final norm and output matmul follow the last layer
+    return gpu_layer_count < model->header.n_layers;
+}
+
+u32 llava_context::get_layer_budget(size_t heap_size) const {
+    u32 layer_count = model->header.n_layers;
+    if (heap_size > model->mapping_size) {
+        return layer_count;
+    }
+
+    // Keep a tenth of the heap for session buffers and other applications
+    size_t budget = heap_size - heap_size / 10;
+    return min(u32(budget / get_layer_size()), layer_count);
+}
+
+size_t llava_context::get_layer_size() const {
+    // Each GPU layer holds its weights and the f16 K and V caches of a session at full backlog
+    string prefix = "layers.0.";
+    size_t layer_size = 2 * 2 * size_t(max_backlog_size) * model->header.dim;
+    for (const char* table : {"attention.wq", "attention.wk", "attention.wv", "attention.wo", "feed_forward.w1", "feed_forward.w2", "feed_forward.w3", "attention_norm", "ffn_norm"}) {
+        layer_size += model->get_buffer_descriptor(prefix + table).size;
+    }
+    return layer_size;
+}
+
+llava_context* llava_context::get_draft_context() {
+    return draft_context;
+}
+
+u32 llava_context::get_draft_token_count() const {
+    return draft_token_count;
+}
+
+u32 llava_context::get_lookup_ngram_size() const {
+    return lookup_ngram_size;
+}
+
+u32 llava_context::get_context_keep() const {
+    return context_keep;
+}
+
+u32 llava_context::get_attention_window() const {
+    return attention_window;
+}
+
+u32 llava_context::get_prefill_chunk() const {
+    return prefill_chunk;
+}
+
+u32 llava_context::get_server_worker_count() const {
+    // Two per device, so that one session records and submits while another waits for its results
+    if (server_worker_count) {
+        return server_worker_count;
+    }
+    return 2 * max<u32>(1, devices.size());
+}
+
+string const& llava_context::get_unix_socket_path() const {
+    return unix_socket_path;
+}
+
+llava_cpu_backend* llava_context::get_cpu_backend() {
+    return cpu_backend;
+}
@@ -11,12 +11,16 @@
 #include "llava_layer.h"
 #include "llava_buffer.h"
 #include "llava_pipeline.h"
+#include "llava_autotuner.h"
+#include "llava_profiler.h"
+#include "llava_device.h"
 
 class llava_context {
     friend class llava_command_buffer;
     friend class llava_pipeline;
     friend class llava_session;
     friend class llava_layer;
+    friend class llava_device;
 public:
     llava_context();
     ~llava_context();
@@ -24,63 +28,85 @@ public:
     [[nodiscard]] bool signal_debug_on() const;
 
 public:
-    vk::Device& get_device();
-    vk::CommandPool& get_command_pool();
-    vk::Queue& get_queue();
-    vk::DescriptorPool& get_descriptor_pool();
-    vk::PipelineCache& get_pipeline_cache();
-    vk::PhysicalDevice& get_physical_device();
-    [[nodiscard]] uint32_t get_queue_family_index() const;
     [[nodiscard]] ggml_file const* get_model() const;
     [[nodiscard]] vector<llava_layer>& get_layers();
     [[nodiscard]] static string generate_spevar_define_string(specialization_variables_t const* spevars) ;
     [[nodiscard]] pair<u32*, u32> get_shader_spirv_by_name(string const& shader_name);
+    [[nodiscard]] bool fp16_activations_enabled() const;
+    [[nodiscard]] bool profiling_enabled() const;
+    [[nodiscard]] llava_profiler& get_profiler();
+    [[nodiscard]] bool gpu_enabled() const;
+    [[nodiscard]] bool layer_on_cpu(u32 layer_id) const;
+    [[nodiscard]] llava_device* get_layer_device(u32 layer_id);
+    [[nodiscard]] vector<llava_device*> const& get_devices() const;
+    [[nodiscard]] bool head_on_cpu() const;
+    [[nodiscard]] llava_cpu_backend* get_cpu_backend();
+    [[nodiscard]] llava_context* get_draft_context();
+    [[nodiscard]] u32 get_draft_token_count() const;
+    [[nodiscard]] u32 get_lookup_ngram_size() const;
+    [[nodiscard]] u32 get_context_keep() const;
+    [[nodiscard]] u32 get_attention_window() const;
+    [[nodiscard]] u32 get_prefill_chunk() const;
+    [[nodiscard]] u32 get_server_worker_count() const;
+    [[nodiscard]] string const& get_unix_socket_path() const;
 
 public:
-    llava_pipeline* get_pipeline(const string& shader_name, u32 argument_count, specialization_variables_t const& spevars);
     [[nodiscard]] int get_signal_fd() const;
     [[nodiscard]] u32 pop_signal(bool blocking = false) const;
 
 public:
     u32 workgroup_size = 1024;
-    u32 mainMemoryTypeIndex = ~0U;
-    mutex descriptor_pool_mutex;
-    mutex command_pool_mutex;
-    mutex queue_mutex;
+    matmul_tuning_t dim_matmul_tuning;
+    matmul_tuning_t ff_matmul_tuning;
 
 private:
     ggml_file* model = nullptr;
 
     vk::Instance vulkan_instance;
-    vk::PhysicalDevice physical_device;
-    vk::Device device;
-    vk::CommandPool command_pool;
-    vk::DescriptorPool descriptor_pool;
-    vk::PipelineCache pipeline_cache;
-    vk::Queue queue;
+    vector<llava_device*> devices; // In layer order
 
-    u32 queueFamilyIndex = ~0U;
     u32 verbosity = 0;
     bool signal_debug = false;
 
     vector<llava_layer> layers;
+    llava_profiler profiler;
+    llava_cpu_backend* cpu_backend = nullptr;
+    llava_context* draft_context = nullptr; // Small model proposing tokens for speculative decoding
 
 private: // config
     bool use_prebuilt_shaders = false;
+    bool fp16_activations = false;
+    bool profiling = false;
+    int requested_gpu_layers = -1; // Negative for automatic, 0 for CPU only
+    u32 gpu_layer_count = 0; // Layers [0, gpu_layer_count) run on GPU, the others on CPU
+    vector<u32> requested_device_ids; // Indices in enumeratePhysicalDevices, empty to pick one automatically
+    u32 cpu_thread_count = 0;
+    string draft_model_path;
+    u32 draft_token_count = 4; // Tokens proposed by the draft model or prompt lookup per verification batch
+    u32 lookup_ngram_size = 0; // Non-zero to propose what followed the last n tokens earlier in the context
+    u32 context_keep = ~0U; // Tokens kept by context shifting when the backlog is full, ~0 to stop generation instead
+    u32 attention_window = 0; // Sessions attend to this many last tokens only, with ring KV caches, 0 for the whole context
+    u32 prefill_chunk = 512; // Most tokens evaluated in one batch, longer inputs are split
+    u32 beam_width = 0; // Command line generation uses beam search when at least 2
+    u32 server_worker_count = 0; // Threads running server sessions, 0 for two per device
+    string unix_socket_path; // The server also listens there when not empty
 
 private:
     int sigfd = -1;
 
-private: // pipeline storage
-    map<pair<string, specialization_variables_t>, llava_pipeline> named_pipelines;
+private:
     map<string, pair<u32*, u32>> embedded_shaders;
-    mutex pipeline_mutex;
 
 private:
-    u32 find_suitable_memory_type(const vk::PhysicalDevice &_physical_device);
-    u32 find_suitable_queue_index();
+    [[nodiscard]] u32 get_layer_budget(size_t heap_size) const;
+    [[nodiscard]] size_t get_layer_size() const;
+    void partition_layers();
     vk::PhysicalDevice find_suitable_physical_device();
     bool setup_signal_handling();
+    bool setup_vulkan(bool debug_mode);
+    bool setup_backends(bool debug_mode);
+    bool load_layers();
+    bool load_draft(llava_context const* target, string const& draft_path, bool debug_mode, bool autotune);
 };
 
 #endif //VULKAN_LLAMA_CONTEXT_H
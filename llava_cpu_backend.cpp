@@ -0,0 +1,605 @@
+#include "llava_cpu_backend.h"
+#include "llava_buffer.h"
+#include <cmath>
+#include <cstring>
+
+#if defined(__AVX2__) or defined(__AVX512F__) or defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+// Blocks are 32 values with a f32 (model version 1) or f16 (version 3) base followed by the quants, like in the file
+
+// Rows handed to a worker at once by the matmul kernels
+const u32 matmul_row_grain = 16;
+
+static u16 float_to_half(float value) {
+#ifdef __F16C__
+    return _cvtss_sh(value, _MM_FROUND_TO_NEAREST_INT);
+#else
+    u32 bits;
+    memcpy(&bits, &value, 4);
+    u32 sign = (bits >> 16) & 0x8000;
+    int exponent = int((bits >> 23) & 0xff) - 127 + 15;
+    u32 mantissa = bits & 0x7fffff;
+    if (((bits >> 23) & 0xff) == 0xff) {
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    }
+    if (exponent >= 31) {
+        return sign | 0x7c00;
+    }
+    if (exponent <= 0) {
+        if (exponent < -10) {
+            return sign;
+        }
+        mantissa |= 0x800000;
+        u32 shift = 14 - exponent;
+        u32 half_mantissa = mantissa >> shift;
+        u32 remainder = mantissa & ((1U << shift) - 1);
+        u32 halfway = 1U << (shift - 1);
+        if ((remainder > halfway) or ((remainder == halfway) and (half_mantissa & 1))) {
+            half_mantissa++;
+        }
+        return sign | half_mantissa;
+    }
+    u32 half = sign | (exponent << 10) | (mantissa >> 13);
+    u32 remainder = mantissa & 0x1fff;
+    if ((remainder > 0x1000) or ((remainder == 0x1000) and (half & 1))) {
+        half++; // May carry into the exponent, which is the correct rounding
+    }
+    return half;
+#endif
+}
+
+static void half_row_to_float(float* out, u16 const* in, u32 count) {
+    u32 i = 0;
+#ifdef __F16C__
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128((__m128i const*)(in + i))));
+    }
+#endif
+    for (; i < count; ++i) {
+        out[i] = halfToFloat(in[i]);
+    }
+}
+
+static float block_base(u8 const* block, u32 model_version) {
+    if (model_version == 1) {
+        float base;
+        memcpy(&base, block, 4);
+        return base;
+    }
+    u16 base;
+    memcpy(&base, block, 2);
+    return halfToFloat(base);
+}
+
+// Dequantized values of a 32 element block, in column order
+static void dequantize_block(float* out, u8 const* block, ggml_value_type type, u32 model_version) {
+    float base = block_base(block, model_version);
+    u8 const* qs = block + ((model_version == 1) ? 4 : 2);
+    if (type == ggml_value_type::q4_0) {
+        for (u32 j = 0; j < 16; j++) {
+            int low = int(qs[j] & 0xf) - 8;
+            int high = int(qs[j] >> 4) - 8;
+            if (model_version == 1) {
+                out[2 * j] = float(low) * base;
+                out[2 * j + 1] = float(high) * base;
+            } else {
+                out[j] = float(low) * base;
+                out[j + 16] = float(high) * base;
+            }
+        }
+    } else {
+        for (u32 j = 0; j < 32; j++) {
+            out[j] = float(int8_t(qs[j])) * base;
+        }
+    }
+}
+
+#if defined(__AVX512F__)
+
+static inline float hsum(__m512 v) {
+    return _mm512_reduce_add_ps(v);
+}
+
+static float dot_q4_0(u8 const* row, float const* x, u32 block_count, u32 model_version) {
+    __m512 acc = _mm512_setzero_ps();
+    u32 block_size = (model_version == 1) ? 20 : 18;
+    __m128i const mask = _mm_set1_epi8(0xf);
+    __m128i const offset = _mm_set1_epi8(8);
+    for (u32 b = 0; b < block_count; ++b) {
+        u8 const* block = row + b * block_size;
+        __m128i raw = _mm_loadu_si128((__m128i const*)(block + ((model_version == 1) ? 4 : 2)));
+        __m128i low = _mm_sub_epi8(_mm_and_si128(raw, mask), offset);
+        __m128i high = _mm_sub_epi8(_mm_and_si128(_mm_srli_epi16(raw, 4), mask), offset);
+        if (model_version == 1) {
+            __m128i first = _mm_unpacklo_epi8(low, high);
+            high = _mm_unpackhi_epi8(low, high);
+            low = first;
+        }
+        __m512 sum = _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(low)), _mm512_loadu_ps(x + 32 * b));
+        sum = _mm512_fmadd_ps(_mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(high)), _mm512_loadu_ps(x + 32 * b + 16), sum);
+        acc = _mm512_fmadd_ps(_mm512_set1_ps(block_base(block, model_version)), sum, acc);
+    }
+    return hsum(acc);
+}
+
+static float dot_q8_0(u8 const* row, float const* x, u32 block_count, u32 model_version) {
+    __m512 acc = _mm512_setzero_ps();
+    u32 block_size = (model_version == 1) ? 36 : 34;
+    for (u32 b = 0; b < block_count; ++b) {
+        u8 const* block = row + b * block_size;
+        u8 const* qs = block + ((model_version == 1) ? 4 : 2);
+        __m512 sum = _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_loadu_si128((__m128i const*)qs))), _mm512_loadu_ps(x + 32 * b));
+        sum = _mm512_fmadd_ps(_mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_loadu_si128((__m128i const*)(qs + 16)))), _mm512_loadu_ps(x + 32 * b + 16), sum);
+        acc = _mm512_fmadd_ps(_mm512_set1_ps(block_base(block, model_version)), sum, acc);
+    }
+    return hsum(acc);
+}
+
+static float dot_f32(float const* row, float const* x, u32 count) {
+    __m512 acc = _mm512_setzero_ps();
+    u32 i = 0;
+    for (; i + 16 <= count; i += 16) {
+        acc = _mm512_fmadd_ps(_mm512_loadu_ps(row + i), _mm512_loadu_ps(x + i), acc);
+    }
+    float result = hsum(acc);
+    for (; i < count; ++i) {
+        result += row[i] * x[i];
+    }
+    return result;
+}
+
+#elif defined(__AVX2__) and defined(__FMA__)
+
+static inline float hsum(__m256 v) {
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+    return _mm_cvtss_f32(sum);
+}
+
+// 16 signed bytes times 16 floats
+static inline __m256 madd_i8x16(__m128i q, float const* x, __m256 acc) {
+    acc = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(q)), _mm256_loadu_ps(x), acc);
+    return _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(q, 8))), _mm256_loadu_ps(x + 8), acc);
+}
+
+static float dot_q4_0(u8 const* row, float const* x, u32 block_count, u32 model_version) {
+    __m256 acc = _mm256_setzero_ps();
+    u32 block_size = (model_version == 1) ? 20 : 18;
+    __m128i const mask = _mm_set1_epi8(0xf);
+    __m128i const offset = _mm_set1_epi8(8);
+    for (u32 b = 0; b < block_count; ++b) {
+        u8 const* block = row + b * block_size;
+        __m128i raw = _mm_loadu_si128((__m128i const*)(block + ((model_version == 1) ? 4 : 2)));
+        __m128i low = _mm_sub_epi8(_mm_and_si128(raw, mask), offset);
+        __m128i high = _mm_sub_epi8(_mm_and_si128(_mm_srli_epi16(raw, 4), mask), offset);
+        if (model_version == 1) {
+            __m128i first = _mm_unpacklo_epi8(low, high);
+            high = _mm_unpackhi_epi8(low, high);
+            low = first;
+        }
+        __m256 sum = madd_i8x16(low, x + 32 * b, _mm256_setzero_ps());
+        sum = madd_i8x16(high, x + 32 * b + 16, sum);
+        acc = _mm256_fmadd_ps(_mm256_set1_ps(block_base(block, model_version)), sum, acc);
+    }
+    return hsum(acc);
+}
+
+static float dot_q8_0(u8 const* row, float const* x, u32 block_count, u32 model_version) {
+    __m256 acc = _mm256_setzero_ps();
+    u32 block_size = (model_version == 1) ? 36 : 34;
+    for (u32 b = 0; b < block_count; ++b) {
+        u8 const* block = row + b * block_size;
+        u8 const* qs = block + ((model_version == 1) ? 4 : 2);
+        __m256 sum = madd_i8x16(_mm_loadu_si128((__m128i const*)qs), x + 32 * b, _mm256_setzero_ps());
+        sum = madd_i8x16(_mm_loadu_si128((__m128i const*)(qs + 16)), x + 32 * b + 16, sum);
+        acc = _mm256_fmadd_ps(_mm256_set1_ps(block_base(block, model_version)), sum, acc);
+    }
+    return hsum(acc);
+}
+
+static float dot_f32(float const* row, float const* x, u32 count) {
+    __m256 acc = _mm256_setzero_ps();
+    u32 i = 0;
+    for (; i + 8 <= count; i += 8) {
+        acc = _mm256_fmadd_ps(_mm256_loadu_ps(row + i), _mm256_loadu_ps(x + i), acc);
+    }
+    float result = hsum(acc);
+    for (; i < count; ++i) {
+        result += row[i] * x[i];
+    }
+    return result;
+}
+
+#else
+
+static float dot_q4_0(u8 const* row, float const* x, u32 block_count, u32 model_version) {
+    u32 block_size = (model_version == 1) ? 20 : 18;
+    float result = 0;
+    float values[32];
+    for (u32 b = 0; b < block_count; ++b) {
+        dequantize_block(values, row + b * block_size, ggml_value_type::q4_0, model_version);
+        for (u32 j = 0; j < 32; j++) {
+            result += values[j] * x[32 * b + j];
+        }
+    }
+    return result;
+}
+
+static float dot_q8_0(u8 const* row, float const* x, u32 block_count, u32 model_version) {
+    u32 block_size = (model_version == 1) ? 36 : 34;
+    float result = 0;
+    for (u32 b = 0; b < block_count; ++b) {
+        u8 const* block = row + b * block_size;
+        u8 const* qs = block + ((model_version == 1) ? 4 : 2);
+        float sum = 0;
+        for (u32 j = 0; j < 32; j++) {
+            sum += float(int8_t(qs[j])) * x[32 * b + j];
+        }
+        result += sum * block_base(block, model_version);
+    }
+    return result;
+}
+
+static float dot_f32(float const* row, float const* x, u32 count) {
+    float result = 0;
+    for (u32 i = 0; i < count; ++i) {
+        result += row[i] * x[i];
+    }
+    return result;
+}
+
+#endif
+
+static float dot_f16(u16 const* row, float const* x, u32 count) {
+    float values[256];
+    float result = 0;
+    for (u32 i = 0; i < count; i += 256) {
+        u32 n = min(256U, count - i);
+        half_row_to_float(values, row + i, n);
+        result += dot_f32(values, x + i, n);
+    }
+    return result;
+}
+
+static float row_dot(u8 const* row, float const* x, ggml_data_descriptor const& matrix) {
+    u32 column_count = matrix.shape2;
+    switch (matrix.ftype) {
+        case ggml_value_type::q4_0:
+            return dot_q4_0(row, x, column_count / 32, matrix.model_version);
+        case ggml_value_type::q8_0:
+            return dot_q8_0(row, x, column_count / 32, matrix.model_version);
+        case ggml_value_type::f16:
+            return dot_f16((u16 const*) row, x, column_count);
+        case ggml_value_type::f32:
+            return dot_f32((float const*) row, x, column_count);
+        default:
+            assert(false);
+            return 0;
+    }
+}
+
+llava_cpu_backend::llava_cpu_backend(ggml_file const* _model, u32 thread_count) : model(_model) {
+    // The calling thread takes part in every kernel
+    for (u32 i = 1; i < thread_count; ++i) {
+        workers.emplace_back(&llava_cpu_backend::worker_main, this);
+    }
+}
+
+llava_cpu_backend::~llava_cpu_backend() {
+    {
+        lock_guard guard(pool_mutex);
+        stopping = true;
+    }
+    work_available.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+u32 llava_cpu_backend::get_thread_count() const {
+    return workers.size() + 1;
+}
+
+const char* llava_cpu_backend::get_simd_name() {
+#if defined(__AVX512F__)
+    return "AVX-512";
+#elif defined(__AVX2__) and defined(__FMA__)
+    return "AVX2";
+#else
+    return "scalar";
+#endif
+}
+
+void llava_cpu_backend::parallel_for(u32 count, u32 grain, function<void(u32, u32)> const& task) {
+    if (count == 0) {
+        return;
+    }
+    lock_guard dispatch_guard(dispatch_mutex);
+    if (workers.empty() or (count <= grain)) {
+        task(0, count);
+        return;
+    }
+
+    {
+        lock_guard guard(pool_mutex);
+        current_task = &task;
+        current_count = count;
+        current_grain = grain;
+        next_index = 0;
+        busy_workers = workers.size();
+        generation++;
+    }
+    work_available.notify_all();
+    run_current_task();
+
+    unique_lock lock(pool_mutex);
+    work_done.wait(lock, [this]() { return busy_workers == 0; });
+    current_task = nullptr;
+}
+
+void llava_cpu_backend::run_current_task() {
+    while (true) {
+        u32 begin = next_index.fetch_add(current_grain);
+        if (begin >= current_count) {
+            break;
+        }
+        (*current_task)(begin, min(begin + current_grain, current_count));
+    }
+}
+
+void llava_cpu_backend::worker_main() {
+    u64 seen_generation = 0;
+    while (true) {
+        {
+            unique_lock lock(pool_mutex);
+            work_available.wait(lock, [this, seen_generation]() { return stopping or (generation != seen_generation); });
+            if (stopping) {
+                return;
+            }
+            seen_generation = generation;
+        }
+        run_current_task();
+        {
+            lock_guard guard(pool_mutex);
+            if (--busy_workers == 0) {
+                work_done.notify_one();
+            }
+        }
+    }
+}
+
+void llava_cpu_backend::get_row(float *out, ggml_data_descriptor const& table, u32 row) const {
+    u32 column_count = table.shape2;
+    u8 const* raw_row = model->mapping + table.offset + row * (table.size / table.shape1);
+    switch (table.ftype) {
+        case ggml_value_type::f32:
+            memcpy(out, raw_row, 4 * column_count);
+            return;
+        case ggml_value_type::f16:
+            half_row_to_float(out, (u16 const*) raw_row, column_count);
+            return;
+        case ggml_value_type::q4_0:
+        case ggml_value_type::q8_0: {
+            u32 block_size = (table.size / table.shape1) / (column_count / 32);
+            for (u32 b = 0; b < column_count / 32; ++b) {
+                dequantize_block(out + 32 * b, raw_row + b * block_size, table.ftype, table.model_version);
+            }
+            return;
+        }
+        default:
+            assert(false);
+    }
+}
+
+void llava_cpu_backend::normalize_logit(float *out, float const* in, ggml_data_descriptor const& weights, u32 batch_size) {
+    // Same statistics as normalize.comp
+    u32 dim = model->header.dim;
+    assert(weights.ftype == ggml_value_type::f32);
+    assert(weights.shape1 == dim);
+    auto const* w = (float const*) (model->mapping + weights.offset);
+    for (u32 z = 0; z < batch_size; ++z) {
+        float const* x = in + z * dim;
+        float mean = 0;
+        for (u32 i = 0; i < dim; ++i) {
+            mean += x[i];
+        }
+        mean /= float(dim);
+        float variance = 0;
+        for (u32 i = 0; i < dim; ++i) {
+            variance += (x[i] - mean) * (x[i] - mean);
+        }
+        float scale = 1.f / sqrtf(variance / float(dim));
+        for (u32 i = 0; i < dim; ++i) {
+            out[z * dim + i] = x[i] * w[i] * scale;
+        }
+    }
+}
+
+void llava_cpu_backend::matmul_generic(float *out, ggml_data_descriptor const& matrix, float const* in, u32 batch_size, bool accumulate) {
+    u32 row_count = matrix.shape1;
+    u32 column_count = matrix.shape2;
+    size_t row_size = matrix.size / row_count;
+    u8 const* data = model->mapping + matrix.offset;
+    parallel_for(row_count, matmul_row_grain, [=, &matrix](u32 begin, u32 end) {
+        // Each row is reused for the whole batch while it is in cache
+        for (u32 r = begin; r < end; ++r) {
+            for (u32 z = 0; z < batch_size; ++z) {
+                float result = row_dot(data + r * row_size, in + z * column_count, matrix);
+                if (accumulate) {
+                    out[z * row_count + r] += result;
+                } else {
+                    out[z * row_count + r] = result;
+                }
+            }
+        }
+    });
+}
+
+void llava_cpu_backend::matmul(float *out, ggml_data_descriptor const& matrix, float const* in, u32 batch_size) {
+    matmul_generic(out, matrix, in, batch_size, false);
+}
+
+void llava_cpu_backend::matmul_add_inplace(float *out, ggml_data_descriptor const& matrix, float const* in, u32 batch_size) {
+    matmul_generic(out, matrix, in, batch_size, true);
+}
+
+void llava_cpu_backend::matmul_silu_ff(float *out, ggml_data_descriptor const& w3_matrix, ggml_data_descriptor const& w1_matrix, float const* in, u32 batch_size) {
+    assert(w3_matrix.shape1 == w1_matrix.shape1);
+    assert(w3_matrix.shape2 == w1_matrix.shape2);
+    u32 row_count = w3_matrix.shape1;
+    u32 column_count = w3_matrix.shape2;
+    size_t w3_row_size = w3_matrix.size / row_count;
+    size_t w1_row_size = w1_matrix.size / row_count;
+    u8 const* w3_data = model->mapping + w3_matrix.offset;
+    u8 const* w1_data = model->mapping + w1_matrix.offset;
+    parallel_for(row_count, matmul_row_grain, [=, &w3_matrix, &w1_matrix](u32 begin, u32 end) {
+        for (u32 r = begin; r < end; ++r) {
+            for (u32 z = 0; z < batch_size; ++z) {
+                float gate = row_dot(w1_data + r * w1_row_size, in + z * column_count, w1_matrix);
+                float up = row_dot(w3_data + r * w3_row_size, in + z * column_count, w3_matrix);
+                out[z * row_count + r] = up * gate / (expf(-gate) + 1.f);
+            }
+        }
+    });
+}
+
+void llava_cpu_backend::kv_copy(u16 *cache, float const* in, u32 position, u32 batch_size, u32 window) {
+    // In sliding-window mode, the cache is a ring of 2 * window rows
+    u32 dim = model->header.dim;
+    u32 slot_mask = window ? 2 * window - 1 : ~0U;
+    for (u32 z = 0; z < batch_size; ++z) {
+        u16* target = cache + ((position + z) & slot_mask) * dim;
+        for (u32 i = 0; i < dim; ++i) {
+            target[i] = float_to_half(in[z * dim + i]);
+        }
+    }
+}
+
+void llava_cpu_backend::kv_shift(u16 *cache, u32 first_row, u32 row_count, u32 shift) {
+    u32 dim = model->header.dim;
+    memmove(cache + (first_row - shift) * dim, cache + first_row * dim, size_t(row_count) * dim * sizeof(u16));
+}
+
+void llava_cpu_backend::kv_gather(u16 *cache, u32 prefix_size, u32 sequence_count, u32 step_count, u32 const* parents) {
+    // Same as kv_gather.comp, sequence s takes over the rows of sequence parents[s] at every step
+    u32 dim = model->header.dim;
+    vector<u16> step_rows(sequence_count * dim);
+    for (u32 step = 0; step < step_count; ++step) {
+        u16* first_row = cache + (prefix_size + step * sequence_count) * dim;
+        memcpy(step_rows.data(), first_row, step_rows.size() * sizeof(u16));
+        for (u32 s = 0; s < sequence_count; ++s) {
+            memcpy(first_row + s * dim, step_rows.data() + parents[s] * dim, dim * sizeof(u16));
+        }
+    }
+}
+
+// Same slot layout as common.glsl: the shared prefix, then the tokens of the parallel sequences interleaved
+static u32 slot_position(u32 slot, u32 prefix_size, u32 sequence_count) {
+    return (slot < prefix_size) ? slot : prefix_size + (slot - prefix_size) / sequence_count;
+}
+
+static bool slot_visible(u32 slot, u32 query_slot, u32 prefix_size, u32 sequence_count) {
+    return (slot <= query_slot) and ((slot < prefix_size) or (((slot - prefix_size) % sequence_count) == ((query_slot - prefix_size) % sequence_count)));
+}
+
+// Sliding-window mode, also as in common.glsl: slot s of the ring holds the latest position congruent to s
+static u32 ring_distance(u32 slot, u32 query_position, u32 window) {
+    return (query_position - slot) & (2 * window - 1);
+}
+
+static bool ring_visible(u32 slot, u32 query_position, u32 window) {
+    u32 distance = ring_distance(slot, query_position, window);
+    return (distance <= query_position) and (distance < window);
+}
+
+void llava_cpu_backend::multi_head_attention(float *out, u16 const* k_cache, u16 const* v_cache, float const* query, u32 position, u32 batch_size, u32 prefix_size, u32 sequence_count, u32 window) {
+    // Same math as mhsa.comp, softmax.comp and kqv_matching.comp: keys are rotated by the relative position
+    u32 dim = model->header.dim;
+    u32 head_count = model->header.n_heads;
+    u32 rot = model->header.rot;
+    u32 key_count = window ? min(position + batch_size, 2 * window) : position + batch_size;
+    float const scale = 1.f / sqrtf(float(rot));
+    auto visible = [&](u32 t, u32 z) {
+        return window ? ring_visible(t, position + z, window) : slot_visible(t, position + z, prefix_size, sequence_count);
+    };
+
+    vector<float> frequencies(rot / 2);
+    for (u32 i = 0; i < rot / 2; ++i) {
+        frequencies.at(i) = powf(10000.f, -float(i) / float(rot / 2));
+    }
+
+    // [batch][head][key]
+    vector<float> scores(size_t(batch_size) * head_count * key_count, 0.f);
+    parallel_for(key_count, 8, [&](u32 begin, u32 end) {
+        vector<float> key(dim);
+        vector<float> rotation(rot);
+        for (u32 t = begin; t < end; ++t) {
+            half_row_to_float(key.data(), k_cache + t * dim, dim);
+            for (u32 z = 0; z < batch_size; ++z) {
+                if (not visible(t, z)) {
+                    continue;
+                }
+                float distance = window ? float(ring_distance(t, position + z, window)) : float(slot_position(position + z, prefix_size, sequence_count)) - float(slot_position(t, prefix_size, sequence_count));
+                for (u32 i = 0; i < rot / 2; ++i) {
+                    rotation.at(2 * i) = cosf(distance * frequencies.at(i));
+                    rotation.at(2 * i + 1) = sinf(distance * frequencies.at(i));
+                }
+                for (u32 h = 0; h < head_count; ++h) {
+                    float const* q = query + z * dim + h * rot;
+                    float const* k = key.data() + h * rot;
+                    float result = 0;
+                    for (u32 i = 0; i < rot / 2; ++i) {
+                        float ct = rotation[2 * i];
+                        float st = rotation[2 * i + 1];
+                        result += q[2 * i] * (ct * k[2 * i] + st * k[2 * i + 1]) + q[2 * i + 1] * (ct * k[2 * i + 1] - st * k[2 * i]);
+                    }
+                    scores[(z * head_count + h) * key_count + t] = result * scale;
+                }
+            }
+        }
+    });
+
+    for (u32 z = 0; z < batch_size; ++z) {
+        // Slots of other sequences, or out of the window, keep a zero weight
+        u32 written = window ? key_count : position + z + 1;
+        for (u32 h = 0; h < head_count; ++h) {
+            float* s = scores.data() + (z * head_count + h) * key_count;
+            float max_score = -INFINITY;
+            for (u32 t = 0; t < written; ++t) {
+                if (visible(t, z)) {
+                    max_score = max(max_score, s[t]);
+                }
+            }
+            float total = 0;
+            for (u32 t = 0; t < written; ++t) {
+                s[t] = visible(t, z) ? expf(s[t] - max_score) : 0.f;
+                total += s[t];
+            }
+            for (u32 t = 0; t < written; ++t) {
+                s[t] /= total;
+            }
+        }
+    }
+
+    // Output dimensions are split by head so each worker reads contiguous value slices
+    parallel_for(head_count, 1, [&](u32 begin, u32 end) {
+        vector<float> value(rot);
+        for (u32 h = begin; h < end; ++h) {
+            for (u32 z = 0; z < batch_size; ++z) {
+                float* o = out + z * dim + h * rot;
+                memset(o, 0, rot * sizeof(float));
+                float const* s = scores.data() + (z * head_count + h) * key_count;
+                u32 written = window ? key_count : position + z + 1;
+                for (u32 t = 0; t < written; ++t) {
+                    half_row_to_float(value.data(), v_cache + t * dim + h * rot, rot);
+                    for (u32 i = 0; i < rot; ++i) {
+                        o[i] += s[t] * value[i];
+                    }
+                }
+            }
+        }
+    });
+}
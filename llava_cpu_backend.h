@@ -0,0 +1,59 @@
+#ifndef VULKAN_LLAMA_LLAVA_CPU_BACKEND_H
+#define VULKAN_LLAMA_LLAVA_CPU_BACKEND_H
+
+#include "types.h"
+#include "ggml_file.h"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Native implementation of the compute shaders, reading weights straight from the model mapping
+// Activations are f32 [batch][n], KV caches are f16 [backlog][dim] with the same layout as on GPU
+// Rows of every kernel are split across a pool of worker threads, one kernel runs at a time
+class llava_cpu_backend {
+public:
+    llava_cpu_backend(ggml_file const* model, u32 thread_count);
+    llava_cpu_backend(llava_cpu_backend const&) = delete;
+    llava_cpu_backend(llava_cpu_backend&&) = delete;
+    ~llava_cpu_backend();
+
+    [[nodiscard]] u32 get_thread_count() const;
+    [[nodiscard]] static const char* get_simd_name();
+
+    void get_row(float* out, ggml_data_descriptor const& table, u32 row) const;
+    void normalize_logit(float* out, float const* in, ggml_data_descriptor const& weights, u32 batch_size);
+    void matmul(float* out, ggml_data_descriptor const& matrix, float const* in, u32 batch_size);
+    void matmul_add_inplace(float* out, ggml_data_descriptor const& matrix, float const* in, u32 batch_size);
+    void matmul_silu_ff(float* out, ggml_data_descriptor const& w3_matrix, ggml_data_descriptor const& w1_matrix, float const* in, u32 batch_size);
+    void kv_copy(u16* cache, float const* in, u32 position, u32 batch_size, u32 window = 0);
+    void kv_shift(u16* cache, u32 first_row, u32 row_count, u32 shift);
+    void kv_gather(u16* cache, u32 prefix_size, u32 sequence_count, u32 step_count, u32 const* parents);
+    void multi_head_attention(float* out, u16 const* k_cache, u16 const* v_cache, float const* query, u32 position, u32 batch_size, u32 prefix_size = 0, u32 sequence_count = 1, u32 window = 0);
+
+private:
+    ggml_file const* const model;
+    void matmul_generic(float* out, ggml_data_descriptor const& matrix, float const* in, u32 batch_size, bool accumulate);
+
+private: // thread pool
+    void parallel_for(u32 count, u32 grain, function<void(u32 begin, u32 end)> const& task);
+    void run_current_task();
+    void worker_main();
+
+    vector<thread> workers;
+    mutex dispatch_mutex;
+    mutex pool_mutex;
+    condition_variable work_available;
+    condition_variable work_done;
+    u64 generation = 0;
+    bool stopping = false;
+    u32 busy_workers = 0;
+    function<void(u32, u32)> const* current_task = nullptr;
+    u32 current_count = 0;
+    u32 current_grain = 1;
+    atomic<u32> next_index = 0;
+};
+
+#endif //VULKAN_LLAMA_LLAVA_CPU_BACKEND_H
@@ -0,0 +1,206 @@
+#include "llava_device.h"
+#include "llava_context.h"
+#include "llava_session.h"
+#include <iostream>
+#include <list>
+#include <set>
+
+llava_device::llava_device(llava_context *_context, vk::PhysicalDevice _physical_device, u32 _device_id) : context(_context),
+                                                                                                        device_id(_device_id),
+                                                                                                        physical_device(_physical_device) {
+
+}
+
+llava_device::~llava_device() {
+    named_pipelines.clear();
+    if (device) {
+        device.destroy(command_pool);
+        device.destroy(pipeline_cache);
+        command_pool = nullptr;
+        pipeline_cache = nullptr;
+        device.destroy();
+    }
+    queue = nullptr;
+    physical_device = nullptr;
+    device = nullptr;
+}
+
+bool llava_device::probe(size_t model_size) {
+    queueFamilyIndex = find_suitable_queue_index();
+    if (!~queueFamilyIndex) {
+        cerr << "[!] No compute queue family found on " << get_name() << endl;
+        return false;
+    }
+
+    // Heaps holding the whole model are preferred, a smaller one can still take part of the layers
+    mainMemoryTypeIndex = find_suitable_memory_type(physical_device, model_size);
+    if (!~mainMemoryTypeIndex) {
+        mainMemoryTypeIndex = find_suitable_memory_type(physical_device, 0);
+    }
+    if (!~mainMemoryTypeIndex) {
+        cerr << "[!] No suitable memory type found on " << get_name() << endl;
+        return false;
+    }
+
+    u32 timestamp_bits = physical_device.getQueueFamilyProperties().at(queueFamilyIndex).timestampValidBits;
+    if ((timestamp_bits > 0) and (timestamp_bits < 64)) {
+        timestamp_valid_mask = (1UL << timestamp_bits) - 1;
+    }
+    return true;
+}
+
+void llava_device::create(bool fp16_activations) {
+    float queuePriority = 0.0f;
+    vk::DeviceQueueCreateInfo deviceQueueCreateInfo(vk::DeviceQueueCreateFlags(), queueFamilyIndex, 1, &queuePriority);
+    vk::PhysicalDeviceShaderFloat16Int8Features featuresFloat16;
+    featuresFloat16.shaderFloat16 = fp16_activations;
+    featuresFloat16.shaderInt8 = false;
+    vk::PhysicalDevice16BitStorageFeatures features16bit;
+    features16bit.storageInputOutput16 = false;
+    features16bit.uniformAndStorageBuffer16BitAccess = false;
+    features16bit.storageBuffer16BitAccess = true;
+    features16bit.pNext = &featuresFloat16;
+    device = physical_device.createDevice(vk::DeviceCreateInfo(vk::DeviceCreateFlags(), deviceQueueCreateInfo, {}, {}, {}, &features16bit));
+
+    // One-off transfers only, dispatches are recorded from the pools of their llava_command_buffer
+    command_pool = device.createCommandPool({{}, queueFamilyIndex});
+
+    // Queue
+    queue = device.getQueue(queueFamilyIndex, 0);
+
+    // Pipeline cache
+    pipeline_cache = device.createPipelineCache({{}, 0, nullptr});
+}
+
+size_t llava_device::get_heap_size() const {
+    auto memory_properties = physical_device.getMemoryProperties();
+    return memory_properties.memoryHeaps.at(memory_properties.memoryTypes.at(mainMemoryTypeIndex).heapIndex).size;
+}
+
+u32 llava_device::get_max_workgroup_size() const {
+    return physical_device.getProperties().limits.maxComputeWorkGroupInvocations;
+}
+
+bool llava_device::supports_fp16_activations() const {
+    auto features = physical_device.getFeatures2<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceShaderFloat16Int8Features>();
+    return features.get<vk::PhysicalDeviceShaderFloat16Int8Features>().shaderFloat16;
+}
+
+bool llava_device::supports_timestamps() const {
+    return physical_device.getQueueFamilyProperties().at(queueFamilyIndex).timestampValidBits != 0;
+}
+
+bool llava_device::holds_layer(u32 layer_id) const {
+    return (layer_id >= first_layer) and (layer_id < first_layer + layer_count);
+}
+
+string llava_device::get_name() const {
+    return physical_device.getProperties().deviceName.data();
+}
+
+u32 llava_device::find_suitable_memory_type(vk::PhysicalDevice const& _physical_device, size_t min_heap_size) {
+    auto memory_properties = _physical_device.getMemoryProperties();
+    set<u32> accepted_memory_heaps;
+    for(u32 i = 0; i < memory_properties.memoryHeapCount; i++) {
+        if (memory_properties.memoryHeaps.at(i).size > min_heap_size) {
+            accepted_memory_heaps.insert(i);
+        }
+    }
+    auto wanted_flags = vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent;
+    list<u32> device_not_local_types;
+    for(u32 i = 0; i < memory_properties.memoryTypeCount; ++i) {
+        auto& memType = memory_properties.memoryTypes.at(i);
+        if (not accepted_memory_heaps.contains(memType.heapIndex)) {
+            continue;
+        }
+
+        if ((memType.propertyFlags & wanted_flags) != wanted_flags) {
+            continue;
+        }
+
+        if (memType.propertyFlags & vk::MemoryPropertyFlagBits::eDeviceLocal) {
+            return i;
+        } else {
+            device_not_local_types.push_back(i);
+        }
+    }
+
+    if (not device_not_local_types.empty()) {
+        return device_not_local_types.front();
+    }
+
+    return ~0U;
+}
+
+u32 llava_device::find_suitable_queue_index() {
+    vector<vk::QueueFamilyProperties> queueFamilyProperties = physical_device.getQueueFamilyProperties();
+    for (uint32_t i = 0; i < queueFamilyProperties.size(); i++) {
+        if ((queueFamilyProperties.at(i).queueFlags & vk::QueueFlagBits::eCompute) and ((queueFamilyProperties.at(i).queueFlags & vk::QueueFlagBits::eGraphics) != vk::QueueFlagBits::eGraphics)) {
+            return i;
+        }
+    }
+    for (uint32_t i = 0; i < queueFamilyProperties.size(); i++) {
+        if (queueFamilyProperties.at(i).queueFlags & vk::QueueFlagBits::eCompute) {
+            return i;
+        }
+    }
+    return ~0U;
+}
+
+vk::Device& llava_device::get_device() {
+    assert(device);
+    return device;
+}
+
+vk::CommandPool& llava_device::get_command_pool() {
+    assert(command_pool);
+    return command_pool;
+}
+
+vk::Queue &llava_device::get_queue() {
+    assert(queue);
+    return queue;
+}
+
+vk::PipelineCache& llava_device::get_pipeline_cache() {
+    assert(pipeline_cache);
+    return pipeline_cache;
+}
+
+vk::PhysicalDevice& llava_device::get_physical_device() {
+    return physical_device;
+}
+
+uint32_t llava_device::get_queue_family_index() const {
+    return queueFamilyIndex;
+}
+
+using pipeline_signature = pair<string, specialization_variables_t>;
+
+std::weak_ordering operator<=>(const pipeline_signature &lhs, const pipeline_signature &rhs) {
+    auto f = lhs.first <=> rhs.first;
+    if(f != std::weak_ordering::equivalent) {
+        return f;
+    }
+    int r = memcmp(&lhs.second, &rhs.second, sizeof(rhs.second));
+    if (r < 0) {
+        return std::weak_ordering::less;
+    }
+    if (r == 0) {
+        return std::weak_ordering::equivalent;
+    }
+    return std::weak_ordering::greater;
+}
+
+llava_pipeline *llava_device::get_pipeline(const string &shader_name, u32 argument_count, specialization_variables_t const& spevars) {
+    lock_guard guard(pipeline_mutex);
+    pair<string, specialization_variables_t> signature(shader_name, spevars);
+    auto it = named_pipelines.find(signature);
+    if (it != named_pipelines.end()) {
+        assert (it->second.argument_count == argument_count);
+        return &it->second;
+    }
+
+    it = named_pipelines.emplace(std::piecewise_construct, std::forward_as_tuple(signature), forward_as_tuple(this, shader_name, spevars, context->use_prebuilt_shaders, argument_count)).first;
+    return &it->second;
+}
@@ -0,0 +1,65 @@
+#ifndef VULKAN_LLAMA_LLAVA_DEVICE_H
+#define VULKAN_LLAMA_LLAVA_DEVICE_H
+
+#include "types.h"
+#include "llava_pipeline.h"
+#include <map>
+#include <mutex>
+#include <vulkan/vulkan.hpp>
+
+// One Vulkan device taking part in the model, with its own logical device, queue, pools and pipelines
+// It stores and runs layers [first_layer, first_layer + layer_count), the residual is handed over to the next device
+class llava_device {
+    friend class llava_context;
+public:
+    llava_device(llava_context* context, vk::PhysicalDevice physical_device, u32 device_id);
+    llava_device(llava_device const&) = delete;
+    llava_device(llava_device&&) = delete;
+    ~llava_device();
+
+    [[nodiscard]] bool probe(size_t model_size);
+    void create(bool fp16_activations);
+    [[nodiscard]] size_t get_heap_size() const;
+    [[nodiscard]] u32 get_max_workgroup_size() const;
+    [[nodiscard]] bool supports_fp16_activations() const;
+    [[nodiscard]] bool supports_timestamps() const;
+    [[nodiscard]] bool holds_layer(u32 layer_id) const;
+    [[nodiscard]] string get_name() const;
+    static u32 find_suitable_memory_type(vk::PhysicalDevice const& physical_device, size_t min_heap_size);
+
+public:
+    vk::Device& get_device();
+    vk::CommandPool& get_command_pool();
+    vk::Queue& get_queue();
+    vk::PipelineCache& get_pipeline_cache();
+    vk::PhysicalDevice& get_physical_device();
+    [[nodiscard]] uint32_t get_queue_family_index() const;
+    llava_pipeline* get_pipeline(const string& shader_name, u32 argument_count, specialization_variables_t const& spevars);
+
+public:
+    llava_context* const context;
+    u32 const device_id;
+    u32 first_layer = 0;
+    u32 layer_count = 0;
+    u32 mainMemoryTypeIndex = ~0U;
+    u64 timestamp_valid_mask = ~0UL;
+    mutex command_pool_mutex;
+    mutex queue_mutex;
+
+private:
+    vk::PhysicalDevice physical_device;
+    vk::Device device;
+    vk::CommandPool command_pool;
+    vk::PipelineCache pipeline_cache;
+    vk::Queue queue;
+    u32 queueFamilyIndex = ~0U;
+
+private: // pipeline storage, pipelines belong to a logical device
+    map<pair<string, specialization_variables_t>, llava_pipeline> named_pipelines;
+    mutex pipeline_mutex;
+
+private:
+    u32 find_suitable_queue_index();
+};
+
+#endif //VULKAN_LLAMA_LLAVA_DEVICE_H
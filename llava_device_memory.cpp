@@ -1,16 +1,17 @@
 #include "llava_device_memory.h"
 #include "llava_context.h"
+#include "llava_device.h"
 #include <iostream>
 #include <vulkan/vulkan.hpp>
 
-llava_device_memory::llava_device_memory(llava_context* _context) : context(_context), device_memory(nullptr) {
+llava_device_memory::llava_device_memory(llava_device* _device) : context(_device->context), device(_device), device_memory(nullptr) {
 
 }
 
 llava_device_memory::~llava_device_memory() {
     assert(buffers.empty());
     if (device_memory) {
-        context->get_device().freeMemory(*device_memory);
+        device->get_device().freeMemory(*device_memory);
         delete device_memory;
         device_memory = nullptr;
     }
@@ -23,7 +24,7 @@ bool llava_device_memory::is_frozen() const {
 void llava_device_memory::freeze() {
     assert(not is_frozen());
     device_memory = new vk::DeviceMemory();
-    *device_memory = context->get_device().allocateMemory({cursor, context->mainMemoryTypeIndex});
+    *device_memory = device->get_device().allocateMemory({cursor, device->mainMemoryTypeIndex});
     for (llava_buffer* buffer : buffers) {
         buffer->on_memory_freeze();
     }
@@ -59,17 +60,17 @@ vk::DeviceMemory const *llava_device_memory::get_device_memory() const {
 
 void* llava_device_memory::map() const {
     // TODO some checks
-    return context->get_device().mapMemory(*get_device_memory(), 0, cursor);
+    return device->get_device().mapMemory(*get_device_memory(), 0, cursor);
 }
 
 void* llava_device_memory::map(size_t offset, size_t size) const {
     // TODO some checks
-    return context->get_device().mapMemory(*get_device_memory(), offset, size);
+    return device->get_device().mapMemory(*get_device_memory(), offset, size);
 }
 
 void llava_device_memory::unmap() const {
     // TODO some checks
-    context->get_device().unmapMemory(*get_device_memory());
+    device->get_device().unmapMemory(*get_device_memory());
 }
 
 size_t llava_device_memory::get_size() const {
@@ -13,7 +13,7 @@ namespace vk {
 
 class llava_device_memory {
 public:
-    explicit llava_device_memory(llava_context* context);
+    explicit llava_device_memory(llava_device* device);
     ~llava_device_memory();
     [[nodiscard]] bool is_frozen() const;
     void freeze();
@@ -21,6 +21,7 @@ public:
     void forget_llava_buffer(llava_buffer* buffer);
     size_t register_buffer(size_t alignment, size_t buffer_size);
     llava_context* const context;
+    llava_device* const device;
     [[nodiscard]] vk::DeviceMemory const* get_device_memory() const;
     [[nodiscard]] void* map() const;
     [[nodiscard]] void* map(size_t offset, size_t size) const;
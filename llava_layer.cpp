@@ -5,27 +5,40 @@
 #include "llava_device_memory.h"
 #include "llava_command_buffer.h"
 #include "llava_context.h"
+#include "llava_device.h"
 #include "llava_session.h"
+#include "llava_cpu_backend.h"
 
-llava_layer::llava_layer(llava_context *_context, u32 _layer_id) : layer_id(_layer_id), context(_context) {
-    layer_allocation = new llava_device_memory(context);
+llava_layer::llava_layer(llava_context *_context, u32 _layer_id) : layer_id(_layer_id), context(_context), device(_context->get_layer_device(_layer_id)), on_cpu(_context->layer_on_cpu(_layer_id)) {
     auto* model = context->get_model();
     string prefix = "layers." + to_string(layer_id) + ".";
-    attention_wq = new llava_buffer(context, model->get_buffer_descriptor(prefix + "attention.wq"), layer_allocation);
-    attention_wk = new llava_buffer(context, model->get_buffer_descriptor(prefix + "attention.wk"), layer_allocation);
-    attention_wv = new llava_buffer(context, model->get_buffer_descriptor(prefix + "attention.wv"), layer_allocation);
-    attention_wo = new llava_buffer(context, model->get_buffer_descriptor(prefix + "attention.wo"), layer_allocation);
-    feed_forward_w1 = new llava_buffer(context, model->get_buffer_descriptor(prefix + "feed_forward.w1"), layer_allocation);
-    feed_forward_w2 = new llava_buffer(context, model->get_buffer_descriptor(prefix + "feed_forward.w2"), layer_allocation);
-    feed_forward_w3 = new llava_buffer(context, model->get_buffer_descriptor(prefix + "feed_forward.w3"), layer_allocation);
-    attention_norm = new llava_buffer(context, model->get_buffer_descriptor(prefix + "attention_norm"), layer_allocation);
-    ffn_norm = new llava_buffer(context, model->get_buffer_descriptor(prefix + "ffn_norm"), layer_allocation);
+    if (on_cpu) {
+        cpu_wq = &model->get_buffer_descriptor(prefix + "attention.wq");
+        cpu_wk = &model->get_buffer_descriptor(prefix + "attention.wk");
+        cpu_wv = &model->get_buffer_descriptor(prefix + "attention.wv");
+        cpu_wo = &model->get_buffer_descriptor(prefix + "attention.wo");
+        cpu_w1 = &model->get_buffer_descriptor(prefix + "feed_forward.w1");
+        cpu_w2 = &model->get_buffer_descriptor(prefix + "feed_forward.w2");
+        cpu_w3 = &model->get_buffer_descriptor(prefix + "feed_forward.w3");
+        cpu_attention_norm = &model->get_buffer_descriptor(prefix + "attention_norm");
+        cpu_ffn_norm = &model->get_buffer_descriptor(prefix + "ffn_norm");
+        return;
+    }
+
+    layer_allocation = new llava_device_memory(device);
+    attention_wqkv = new llava_buffer(device, {&model->get_buffer_descriptor(prefix + "attention.wq"),
+                                                &model->get_buffer_descriptor(prefix + "attention.wk"),
+                                                &model->get_buffer_descriptor(prefix + "attention.wv")}, layer_allocation);
+    attention_wo = new llava_buffer(device, model->get_buffer_descriptor(prefix + "attention.wo"), layer_allocation);
+    feed_forward_w1 = new llava_buffer(device, model->get_buffer_descriptor(prefix + "feed_forward.w1"), layer_allocation);
+    feed_forward_w2 = new llava_buffer(device, model->get_buffer_descriptor(prefix + "feed_forward.w2"), layer_allocation);
+    feed_forward_w3 = new llava_buffer(device, model->get_buffer_descriptor(prefix + "feed_forward.w3"), layer_allocation);
+    attention_norm = new llava_buffer(device, model->get_buffer_descriptor(prefix + "attention_norm"), layer_allocation);
+    ffn_norm = new llava_buffer(device, model->get_buffer_descriptor(prefix + "ffn_norm"), layer_allocation);
 }
 
 llava_layer::~llava_layer() {
-    delete attention_wq;
-    delete attention_wk;
-    delete attention_wv;
+    delete attention_wqkv;
     delete attention_wo;
     delete feed_forward_w1;
     delete feed_forward_w2;
@@ -38,35 +51,40 @@ llava_layer::~llava_layer() {
 
 llava_buffer* llava_layer::execute(llava_command_buffer *cmd_buf, llava_layer_session_data* layer_data, llava_buffer* raw_input_logit) const {
     // if raw_input_logit is null, not recorded
-    llava_session *session = layer_data->session;
+    session_partition_t *partition = cmd_buf->partition;
 
     bool record = (layer_data->attn_result != nullptr);
 
-    llava_buffer* c_input_logit = record ? raw_input_logit : session->current_thought;
-    llava_buffer* c_input_norm_logit = record ? layer_data->normalized_input_logit : session->current_thought_sublayer;
-    llava_buffer* c_post_attn_logit = record ? layer_data->post_attn_logit : session->current_thought;
-    llava_buffer* c_post_attn_norm_logit = record ? layer_data->post_attn_norm_logit : session->current_thought_middle_normd;
-    llava_buffer* c_output_logit = record ? layer_data->output_logit : session->current_thought;
-    llava_buffer* c_attn_result = record ? layer_data->attn_result : session->main_attn_result;
-    llava_buffer* c_ff_result = record ? layer_data->ff_result : session->main_ff_result;
-
-    cmd_buf->normalize_logit(c_input_norm_logit, c_input_logit, attention_norm);
-    cmd_buf->matmul(session->current_K, attention_wk, c_input_norm_logit);
-    cmd_buf->matmul(session->current_Q, attention_wq, c_input_norm_logit);
-    cmd_buf->matmul(session->current_V, attention_wv, c_input_norm_logit);
-
-    cmd_buf->kv_copy(layer_data->k_cache, session->current_K);
-    cmd_buf->kv_copy(layer_data->v_cache, session->current_V);
-    cmd_buf->multi_head_attention(c_attn_result, layer_data->k_cache, session->current_Q);
+    llava_buffer* c_input_logit = record ? raw_input_logit : partition->current_thought;
+    llava_buffer* c_post_attn_logit = record ? layer_data->post_attn_logit : partition->current_thought;
+    llava_buffer* c_output_logit = record ? layer_data->output_logit : partition->current_thought;
+    llava_buffer* c_attn_result = record ? layer_data->attn_result : partition->main_attn_result;
+    llava_buffer* c_ff_result = record ? layer_data->ff_result : partition->main_ff_result;
+
+    // Norms are fused into the following matmul, unless tracing needs the normalized logits
+    if (record) {
+        cmd_buf->normalize_logit(layer_data->normalized_input_logit, c_input_logit, attention_norm);
+        cmd_buf->matmul_qkv(partition->current_Q, partition->current_K, partition->current_V, attention_wqkv, layer_data->normalized_input_logit);
+    } else {
+        cmd_buf->matmul_qkv(partition->current_Q, partition->current_K, partition->current_V, attention_wqkv, c_input_logit, attention_norm);
+    }
+
+    cmd_buf->kv_copy(layer_data->k_cache, partition->current_K);
+    cmd_buf->kv_copy(layer_data->v_cache, partition->current_V);
+    cmd_buf->multi_head_attention(c_attn_result, layer_data->k_cache, partition->current_Q);
     cmd_buf->inplace_softmax(c_attn_result);
 
-    cmd_buf->perform_kqv_matching(session->current_Vout, layer_data->v_cache, c_attn_result);
+    cmd_buf->perform_kqv_matching(partition->current_Vout, layer_data->v_cache, c_attn_result);
     if (c_post_attn_logit != raw_input_logit) {
         cmd_buf->copy_logit(c_post_attn_logit, raw_input_logit);
     }
-    cmd_buf->matmul_add_inplace(c_post_attn_logit, attention_wo, session->current_Vout);
-    cmd_buf->normalize_logit(c_post_attn_norm_logit, c_post_attn_logit, ffn_norm);
-    cmd_buf->matmul_silu_ff(c_ff_result, feed_forward_w3, feed_forward_w1, c_post_attn_norm_logit);
+    cmd_buf->matmul_add_inplace(c_post_attn_logit, attention_wo, partition->current_Vout);
+    if (record) {
+        cmd_buf->normalize_logit(layer_data->post_attn_norm_logit, c_post_attn_logit, ffn_norm);
+        cmd_buf->matmul_silu_ff(c_ff_result, feed_forward_w3, feed_forward_w1, layer_data->post_attn_norm_logit);
+    } else {
+        cmd_buf->matmul_silu_ff(c_ff_result, feed_forward_w3, feed_forward_w1, c_post_attn_logit, ffn_norm);
+    }
     if (c_post_attn_logit != c_output_logit) {
         cmd_buf->copy_logit(c_output_logit, c_post_attn_logit);
     }
@@ -74,19 +92,44 @@ llava_buffer* llava_layer::execute(llava_command_buffer *cmd_buf, llava_layer_se
     return c_output_logit;
 }
 
+void llava_layer::execute_cpu(llava_cpu_backend *backend, llava_layer_session_data* layer_data, float* residual, u32 position) const {
+    // Same sequence as execute, on the session's CPU scratch buffers
+    assert(on_cpu);
+    llava_session *session = layer_data->session;
+    u32 batch_size = session->batch_size;
+
+    backend->normalize_logit(session->cpu_normalized.data(), residual, *cpu_attention_norm, batch_size);
+    backend->matmul(session->cpu_Q.data(), *cpu_wq, session->cpu_normalized.data(), batch_size);
+    backend->matmul(session->cpu_K.data(), *cpu_wk, session->cpu_normalized.data(), batch_size);
+    backend->matmul(session->cpu_V.data(), *cpu_wv, session->cpu_normalized.data(), batch_size);
+
+    backend->kv_copy(layer_data->cpu_k_cache.data(), session->cpu_K.data(), position, batch_size, session->attention_window);
+    backend->kv_copy(layer_data->cpu_v_cache.data(), session->cpu_V.data(), position, batch_size, session->attention_window);
+    backend->multi_head_attention(session->cpu_Vout.data(), layer_data->cpu_k_cache.data(), layer_data->cpu_v_cache.data(), session->cpu_Q.data(), position, batch_size, session->shared_prefix_size, session->sequence_count, session->attention_window);
+    backend->matmul_add_inplace(residual, *cpu_wo, session->cpu_Vout.data(), batch_size);
+
+    backend->normalize_logit(session->cpu_normalized.data(), residual, *cpu_ffn_norm, batch_size);
+    backend->matmul_silu_ff(session->cpu_ff_result.data(), *cpu_w3, *cpu_w1, session->cpu_normalized.data(), batch_size);
+    backend->matmul_add_inplace(residual, *cpu_w2, session->cpu_ff_result.data(), batch_size);
+}
+
 void llava_layer::freeze_storage() {
+    if (on_cpu) {
+        return;
+    }
     layer_allocation->freeze();
 }
 
 
 void llava_layer::load_to_gpu() {
+    if (on_cpu) {
+        return;
+    }
     void* mapping = layer_allocation->map();
     if (raw_layer) {
         ::memcpy(mapping, raw_layer, layer_allocation->get_size());
     } else {
-        attention_wq->load_from_disk(mapping);
-        attention_wk->load_from_disk(mapping);
-        attention_wv->load_from_disk(mapping);
+        attention_wqkv->load_from_disk(mapping);
         attention_wo->load_from_disk(mapping);
         feed_forward_w1->load_from_disk(mapping);
         feed_forward_w2->load_from_disk(mapping);
@@ -98,12 +141,12 @@ void llava_layer::load_to_gpu() {
 }
 
 llava_layer::llava_layer(llava_layer && other) noexcept : context(other.context),
-                                                          layer_id(other.layer_id)
+                                                          device(other.device),
+                                                          layer_id(other.layer_id),
+                                                          on_cpu(other.on_cpu)
                                                           {
     layer_allocation = other.layer_allocation;
-    attention_wq = other.attention_wq;
-    attention_wk = other.attention_wk;
-    attention_wv = other.attention_wv;
+    attention_wqkv = other.attention_wqkv;
     attention_wo = other.attention_wo;
     feed_forward_w1 = other.feed_forward_w1;
     feed_forward_w2 = other.feed_forward_w2;
@@ -111,10 +154,17 @@ llava_layer::llava_layer(llava_layer && other) noexcept : context(other.context)
     attention_norm = other.attention_norm;
     ffn_norm = other.ffn_norm;
     raw_layer = other.raw_layer;
+    cpu_wq = other.cpu_wq;
+    cpu_wk = other.cpu_wk;
+    cpu_wv = other.cpu_wv;
+    cpu_wo = other.cpu_wo;
+    cpu_w1 = other.cpu_w1;
+    cpu_w2 = other.cpu_w2;
+    cpu_w3 = other.cpu_w3;
+    cpu_attention_norm = other.cpu_attention_norm;
+    cpu_ffn_norm = other.cpu_ffn_norm;
     other.layer_allocation = nullptr;
-    other.attention_wq = nullptr;
-    other.attention_wk = nullptr;
-    other.attention_wv = nullptr;
+    other.attention_wqkv = nullptr;
     other.attention_wo = nullptr;
     other.feed_forward_w1 = nullptr;
     other.feed_forward_w2 = nullptr;
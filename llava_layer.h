@@ -4,6 +4,7 @@
 #include "types.h"
 
 class llava_layer {
+    friend class llava_autotuner;
 public:
     llava_layer(llava_context* context, u32 layer_id);
     llava_layer(llava_layer const&) = delete;
@@ -11,24 +12,36 @@ public:
     llava_layer(llava_layer&&) noexcept;
     ~llava_layer();
     llava_buffer* execute(llava_command_buffer *cmd_buf, llava_layer_session_data* layer_data, llava_buffer* raw_input_logit) const;
+    void execute_cpu(llava_cpu_backend* backend, llava_layer_session_data* layer_data, float* residual, u32 position) const;
     void freeze_storage();
     void load_to_gpu();
 
 public:
     u32 const layer_id;
     llava_context* const context;
+    llava_device* const device; // Null when on_cpu
+    bool const on_cpu;
 
 private:
-    llava_device_memory* layer_allocation;
-    llava_buffer* attention_wq;
-    llava_buffer* attention_wk;
-    llava_buffer* attention_wv;
-    llava_buffer* attention_wo;
-    llava_buffer* feed_forward_w1;
-    llava_buffer* feed_forward_w2;
-    llava_buffer* feed_forward_w3;
-    llava_buffer* attention_norm;
-    llava_buffer* ffn_norm;
+    llava_device_memory* layer_allocation = nullptr;
+    llava_buffer* attention_wqkv = nullptr; // wq, wk and wv rows concatenated
+    llava_buffer* attention_wo = nullptr;
+    llava_buffer* feed_forward_w1 = nullptr;
+    llava_buffer* feed_forward_w2 = nullptr;
+    llava_buffer* feed_forward_w3 = nullptr;
+    llava_buffer* attention_norm = nullptr;
+    llava_buffer* ffn_norm = nullptr;
+
+private: // weights read from the model mapping when on_cpu
+    ggml_data_descriptor const* cpu_wq = nullptr;
+    ggml_data_descriptor const* cpu_wk = nullptr;
+    ggml_data_descriptor const* cpu_wv = nullptr;
+    ggml_data_descriptor const* cpu_wo = nullptr;
+    ggml_data_descriptor const* cpu_w1 = nullptr;
+    ggml_data_descriptor const* cpu_w2 = nullptr;
+    ggml_data_descriptor const* cpu_w3 = nullptr;
+    ggml_data_descriptor const* cpu_attention_norm = nullptr;
+    ggml_data_descriptor const* cpu_ffn_norm = nullptr;
 
 private:
     u8* raw_layer = nullptr;
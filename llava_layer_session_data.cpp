@@ -1,18 +1,22 @@
 #include "llava_layer_session_data.h"
 #include "llava_session.h"
 #include "llava_context.h"
+#include "llava_device.h"
 #include "llava_buffer.h"
 #include "llava_device_memory.h"
 #include "utils.h"
 #include "llava_command_buffer.h"
 #include "ggml_file.h"
+#include "llava_cpu_backend.h"
 #include <set>
 
-llava_layer_session_data::llava_layer_session_data(llava_session* _session) : session(_session) {
+llava_layer_session_data::llava_layer_session_data(llava_session* _session, llava_layer const* _layer) : session(_session), layer(_layer) {
     flush_buffers_on_gpu();
 }
 
-llava_layer_session_data::llava_layer_session_data(llava_layer_session_data && other) noexcept : session(other.session) {
+llava_layer_session_data::llava_layer_session_data(llava_layer_session_data && other) noexcept : session(other.session), layer(other.layer) {
+    cpu_k_cache = std::move(other.cpu_k_cache);
+    cpu_v_cache = std::move(other.cpu_v_cache);
     layer_cache_allocation = other.layer_cache_allocation;
     other.layer_cache_allocation = nullptr;
     k_cache = other.k_cache;
@@ -34,6 +38,9 @@ llava_layer_session_data::llava_layer_session_data(llava_layer_session_data && o
 }
 
 void llava_layer_session_data::dump_tracing_layers(int out_fd, const string& layer_name) {
+    if (layer->on_cpu) {
+        return; // Intermediate buffers are only recorded on GPU
+    }
     this->layer_cache_allocation->dump_buffers(out_fd, layer_name);
 }
 
@@ -50,8 +57,14 @@ llava_layer_session_data::~llava_layer_session_data() {
 }
 
 void llava_layer_session_data::flush_buffers_on_gpu() {
-    llava_context* context = session->ctx;
+    llava_device* device = layer->device;
     ggml_file const* model = session->model;
+    if (layer->on_cpu) {
+        // Rows are positions, so resizing keeps the cached prefix and zero fills the rest
+        cpu_k_cache.resize(size_t(session->backlog_size) * model->header.dim, 0);
+        cpu_v_cache.resize(size_t(session->backlog_size) * model->header.dim, 0);
+        return;
+    }
     bool tracing_was_enabled = (attn_result != nullptr);
     bool tracing_enabled = this->session->is_tracing_enabled();
     u32 old_size = k_cache ? k_cache->shape.first : 0;
@@ -66,9 +79,9 @@ void llava_layer_session_data::flush_buffers_on_gpu() {
     u32 n_heads = model->header.n_heads;
     u32 ff_size = model->ff_size;
 
-    auto *next_layer_cache_allocation = new llava_device_memory(context);
-    auto *next_k_cache = new llava_buffer(context, ggml_value_type::f16, session->backlog_size, dim, next_layer_cache_allocation, "k_cache");
-    auto *next_v_cache = new llava_buffer(context, ggml_value_type::f16, session->backlog_size, dim, next_layer_cache_allocation, "v_cache");
+    auto *next_layer_cache_allocation = new llava_device_memory(device);
+    auto *next_k_cache = new llava_buffer(device, ggml_value_type::f16, session->backlog_size, dim, next_layer_cache_allocation, "k_cache");
+    auto *next_v_cache = new llava_buffer(device, ggml_value_type::f16, session->backlog_size, dim, next_layer_cache_allocation, "v_cache");
     llava_buffer *next_attn_result = nullptr;
     llava_buffer *next_ff_result = nullptr;
     llava_buffer *next_normalized_input_logit = nullptr;
@@ -77,12 +90,12 @@ void llava_layer_session_data::flush_buffers_on_gpu() {
     llava_buffer *next_post_attn_norm_logit = nullptr;
 
     if (tracing_enabled and session->batch_size) {
-        next_attn_result = new llava_buffer(context, ggml_value_type::f32, session->backlog_size, n_heads * session->batch_size, next_layer_cache_allocation, "attn_result");
-        next_ff_result = new llava_buffer(context, ggml_value_type::f32, ff_size, session->batch_size, next_layer_cache_allocation, "ff_result");
-        next_normalized_input_logit = new llava_buffer(context, ggml_value_type::f32, dim, session->batch_size, next_layer_cache_allocation, "normalized_input_logit");
-        next_post_attn_logit = new llava_buffer(context, ggml_value_type::f32, dim, session->batch_size, next_layer_cache_allocation, "post_attn_logit");
-        next_post_attn_norm_logit = new llava_buffer(context, ggml_value_type::f32, dim, session->batch_size, next_layer_cache_allocation, "post_attn_norm_logit");
-        next_output_logit = new llava_buffer(context, ggml_value_type::f32, dim, session->batch_size, next_layer_cache_allocation, "output_logit");
+        next_attn_result = new llava_buffer(device, ggml_value_type::f32, session->backlog_size, n_heads * session->batch_size, next_layer_cache_allocation, "attn_result");
+        next_ff_result = new llava_buffer(device, ggml_value_type::f32, ff_size, session->batch_size, next_layer_cache_allocation, "ff_result");
+        next_normalized_input_logit = new llava_buffer(device, ggml_value_type::f32, dim, session->batch_size, next_layer_cache_allocation, "normalized_input_logit");
+        next_post_attn_logit = new llava_buffer(device, ggml_value_type::f32, dim, session->batch_size, next_layer_cache_allocation, "post_attn_logit");
+        next_post_attn_norm_logit = new llava_buffer(device, ggml_value_type::f32, dim, session->batch_size, next_layer_cache_allocation, "post_attn_norm_logit");
+        next_output_logit = new llava_buffer(device, ggml_value_type::f32, dim, session->batch_size, next_layer_cache_allocation, "output_logit");
     }
 
     u32 batch_size_to_copy = min(old_batch_size, session->batch_size);
@@ -93,8 +106,8 @@ void llava_layer_session_data::flush_buffers_on_gpu() {
 
     vector<vk::CommandBuffer> commandBuffers;
     {
-        lock_guard guard(context->command_pool_mutex);
-        commandBuffers = context->get_device().allocateCommandBuffers({context->get_command_pool(), vk::CommandBufferLevel::ePrimary, 1});
+        lock_guard guard(device->command_pool_mutex);
+        commandBuffers = device->get_device().allocateCommandBuffers({device->get_command_pool(), vk::CommandBufferLevel::ePrimary, 1});
     }
     commandBuffers.front().begin(vk::CommandBufferBeginInfo());
     if (layer_cache_allocation != nullptr) {
@@ -130,14 +143,14 @@ void llava_layer_session_data::flush_buffers_on_gpu() {
     commandBuffers.front().end();
 
     {
-        lock_guard guard(context->queue_mutex);
+        lock_guard guard(device->queue_mutex);
         vk::SubmitInfo submitInfo({}, {}, commandBuffers, {});
-        session->ctx->get_queue().submit(submitInfo);
-        session->ctx->get_queue().waitIdle();
+        device->get_queue().submit(submitInfo);
+        device->get_queue().waitIdle();
     }
 
     {
-        lock_guard guard(context->command_pool_mutex);
+        lock_guard guard(device->command_pool_mutex);
         commandBuffers.clear();
     }
 
@@ -163,6 +176,11 @@ void llava_layer_session_data::flush_buffers_on_gpu() {
 }
 
 void llava_layer_session_data::dump_kv_cache(u8 *dst, u32 token_count) {
+    if (layer->on_cpu) {
+        memcpy(dst, cpu_k_cache.data(), 2 * session->model->header.dim * token_count);
+        memcpy(dst + 2 * session->model->header.dim * token_count, cpu_v_cache.data(), 2 * session->model->header.dim * token_count);
+        return;
+    }
     void* k_cache_mapping = k_cache->map(0, 0, token_count * 2 * session->model->header.dim);
     memcpy(dst, k_cache_mapping, 2 * session->model->header.dim * token_count);
     k_cache->unmap();
@@ -172,6 +190,11 @@ void llava_layer_session_data::dump_kv_cache(u8 *dst, u32 token_count) {
 }
 
 void llava_layer_session_data::restore_kv_cache(u8 const* src, u32 token_count) {
+    if (layer->on_cpu) {
+        memcpy(cpu_k_cache.data(), src, 2 * session->model->header.dim * token_count);
+        memcpy(cpu_v_cache.data(), src + 2 * session->model->header.dim * token_count, 2 * session->model->header.dim * token_count);
+        return;
+    }
     void* k_cache_mapping = k_cache->map(0, 0, token_count * 2 * session->model->header.dim);
     memcpy(k_cache_mapping, src, 2 * session->model->header.dim * token_count);
     k_cache->unmap();
@@ -179,3 +202,27 @@ void llava_layer_session_data::restore_kv_cache(u8 const* src, u32 token_count)
     memcpy(v_cache_mapping, src + 2 * session->model->header.dim * token_count, 2 * session->model->header.dim * token_count);
     v_cache->unmap();
 }
+
+void llava_layer_session_data::shift_kv_cache(llava_command_buffer* cmd_buf, u32 first_row, u32 row_count, u32 shift) {
+    // Moves rows down in the cache, the GPU version is recorded in cmd_buf and reads its arguments from its partition
+    if (layer->on_cpu) {
+        llava_cpu_backend* backend = session->ctx->get_cpu_backend();
+        backend->kv_shift(cpu_k_cache.data(), first_row, row_count, shift);
+        backend->kv_shift(cpu_v_cache.data(), first_row, row_count, shift);
+        return;
+    }
+    cmd_buf->kv_shift(k_cache);
+    cmd_buf->kv_shift(v_cache);
+}
+
+void llava_layer_session_data::gather_kv_cache(llava_command_buffer* cmd_buf, u32 step_count, u32 const* parents) {
+    // Reorders the rows of the parallel sequences, the GPU version is recorded in cmd_buf and reads parents from its partition
+    if (layer->on_cpu) {
+        llava_cpu_backend* backend = session->ctx->get_cpu_backend();
+        backend->kv_gather(cpu_k_cache.data(), session->shared_prefix_size, session->sequence_count, step_count, parents);
+        backend->kv_gather(cpu_v_cache.data(), session->shared_prefix_size, session->sequence_count, step_count, parents);
+        return;
+    }
+    cmd_buf->kv_gather(k_cache, step_count);
+    cmd_buf->kv_gather(v_cache, step_count);
+}
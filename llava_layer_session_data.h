@@ -17,7 +17,7 @@ class llava_session;
 class llava_layer_session_data {
     friend class llava_layer;
 public:
-    explicit llava_layer_session_data(llava_session* session);
+    llava_layer_session_data(llava_session* session, llava_layer const* layer);
     llava_layer_session_data(llava_layer_session_data const&) = delete;
     llava_layer_session_data(llava_layer_session_data&) = delete;
     llava_layer_session_data(llava_layer_session_data&&) noexcept;
@@ -26,15 +26,22 @@ public:
     void flush_buffers_on_gpu();
     void dump_kv_cache(u8 *dst, u32 token_count);
     void restore_kv_cache(const u8 *src, u32 token_count);
+    void shift_kv_cache(llava_command_buffer* cmd_buf, u32 first_row, u32 row_count, u32 shift);
+    void gather_kv_cache(llava_command_buffer* cmd_buf, u32 step_count, u32 const* parents);
 
 public:
     llava_session* const session;
+    llava_layer const* const layer;
 
 private:
     llava_device_memory* layer_cache_allocation = nullptr;
     llava_buffer* k_cache = nullptr;
     llava_buffer* v_cache = nullptr;
 
+private: // KV cache of layers on CPU, f16 [backlog][dim] like k_cache and v_cache
+    vector<u16> cpu_k_cache;
+    vector<u16> cpu_v_cache;
+
 private: // Record buffers
     llava_buffer* attn_result = nullptr;
     llava_buffer* ff_result = nullptr;
@@ -1,5 +1,6 @@
 #include "llava_pipeline.h"
 #include "llava_context.h"
+#include "llava_device.h"
 #include "llava_session.h"
 #include "utils.h"
 #include <utility>
@@ -70,9 +71,9 @@ private:
     const string _const_val;
 };
 
-static TBuiltInResource default_resources(llava_context* ctx)
+static TBuiltInResource default_resources(llava_device* device)
 {
-    vk::PhysicalDevice& physical_device = ctx->get_physical_device();
+    vk::PhysicalDevice& physical_device = device->get_physical_device();
     vk::PhysicalDeviceProperties props = physical_device.getProperties();
     auto& limits = props.limits;
 
@@ -183,12 +184,13 @@ static TBuiltInResource default_resources(llava_context* ctx)
 }
 #endif
 
-llava_pipeline::llava_pipeline(llava_context* ctx,
+llava_pipeline::llava_pipeline(llava_device* _device,
                                string _shader_name,
                                specialization_variables_t const& spevar,
                                bool use_prebuilt_shaders,
                                uint32_t argument_count) : argument_count(argument_count),
-                                                          context(ctx),
+                                                          context(_device->context),
+                                                          device(_device),
                                                           shader_name(std::move(_shader_name)) {
     vector<vk::DescriptorSetLayoutBinding> bindings;
     bindings.reserve(argument_count);
@@ -196,8 +198,8 @@ llava_pipeline::llava_pipeline(llava_context* ctx,
         bindings.emplace_back(bindings.size(), vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
     }
 
-    descriptorSetLayout = ctx->get_device().createDescriptorSetLayout({{}, argument_count, bindings.data()});
-    pipelineLayout = ctx->get_device().createPipelineLayout({{}, 1, &descriptorSetLayout});
+    descriptorSetLayout = device->get_device().createDescriptorSetLayout({{}, argument_count, bindings.data()});
+    pipelineLayout = device->get_device().createPipelineLayout({{}, 1, &descriptorSetLayout});
 
     if (use_prebuilt_shaders) {
         string spirv_path = string("prebuilt_shaders/") + shader_name + ".spv";
@@ -206,7 +208,7 @@ llava_pipeline::llava_pipeline(llava_context* ctx,
         u32* data_ptr = (uint32_t *)spirv.data();
 
         if (data_size == 0) {
-            auto position = ctx->get_shader_spirv_by_name(shader_name);
+            auto position = context->get_shader_spirv_by_name(shader_name);
             if (position.first) {
                 data_ptr = position.first;
                 data_size = position.second;
@@ -222,19 +224,27 @@ llava_pipeline::llava_pipeline(llava_context* ctx,
             exit(1);
         }
 
-        shaderModule = ctx->get_device().createShaderModule({{}, data_size, data_ptr});
+        shaderModule = device->get_device().createShaderModule({{}, data_size, data_ptr});
 
         vector<vk::SpecializationMapEntry> entries;
         for (u32 i = 0; i * 4 < sizeof (specialization_variables_t); ++i) {
             entries.emplace_back(i, i * 4, 4);
         }
         vk::SpecializationInfo speInfo(entries.size(), entries.data(), sizeof(specialization_variables_t), &spevar);
-        pipeline = ctx->get_device().createComputePipeline(ctx->get_pipeline_cache(),
+        pipeline = device->get_device().createComputePipeline(device->get_pipeline_cache(),
                                                            {{}, {{}, vk::ShaderStageFlagBits::eCompute, shaderModule, "main", &speInfo}, pipelineLayout}).value;
     } else {
 #ifdef RUNTIME_BUILD_ENABLED
+        // "_f16act" variants are the same source compiled with fp16 activation buffers
+        string source_name = shader_name;
+        string preamble;
+        if (source_name.ends_with(f16act_suffix)) {
+            source_name.resize(source_name.size() - f16act_suffix.size());
+            preamble = "#define USE_FP16_ACTIVATIONS 1\n";
+        }
+
         vector<string> little_source_paths;
-        little_source_paths.emplace_back(shader_name + ".comp");
+        little_source_paths.emplace_back(source_name + ".comp");
 
         vector<vector<char>> shader_sources;
         shader_sources.reserve(little_source_paths.size());
@@ -254,6 +264,7 @@ llava_pipeline::llava_pipeline(llava_context* ctx,
 
         glslang::TShader shader(EShLangCompute);
         shader.setStringsWithLengthsAndNames(c_source.data(), c_source_sizes.data(), c_names.data(), static_cast<int>(c_names.size()));
+        shader.setPreamble(preamble.c_str());
         shader.setEntryPoint("main");
         shader.setSourceEntryPoint("main");
         shader.setAutoMapBindings(true);
@@ -262,8 +273,8 @@ llava_pipeline::llava_pipeline(llava_context* ctx,
         shader.setEnvClient(glslang::EShClientVulkan, glslang::EShTargetVulkan_1_2);
         shader.setEnvTarget(glslang::EShTargetSpv, glslang::EShTargetSpv_1_4);
 
-        CustomIncluder includer(ctx->generate_spevar_define_string(&spevar));
-        TBuiltInResource resources = default_resources(ctx);
+        CustomIncluder includer(context->generate_spevar_define_string(&spevar));
+        TBuiltInResource resources = default_resources(device);
 
         auto messages = (EShMessages)(EShMsgSpvRules | EShMsgVulkanRules);
         string preprocessedSource;
@@ -294,9 +305,9 @@ llava_pipeline::llava_pipeline(llava_context* ctx,
         }
         vector<uint32_t> spirv;
         glslang::GlslangToSpv(*program.getIntermediate(EShLanguage::EShLangCompute), spirv);
-        shaderModule = ctx->get_device().createShaderModule({{}, spirv.size() * sizeof(uint32_t), spirv.data()});
+        shaderModule = device->get_device().createShaderModule({{}, spirv.size() * sizeof(uint32_t), spirv.data()});
 
-        pipeline = ctx->get_device().createComputePipeline(ctx->get_pipeline_cache(),
+        pipeline = device->get_device().createComputePipeline(device->get_pipeline_cache(),
                                                            {{}, {{}, vk::ShaderStageFlagBits::eCompute, shaderModule, "main", nullptr}, pipelineLayout}).value;
 #else
         cerr << "[!] Runtime shader compilation is not enabled!" << endl;
@@ -306,8 +317,8 @@ llava_pipeline::llava_pipeline(llava_context* ctx,
 }
 
 llava_pipeline::~llava_pipeline() {
-    context->get_device().destroy(pipeline);
-    context->get_device().destroy(pipelineLayout);
-    context->get_device().destroy(descriptorSetLayout);
-    context->get_device().destroy(shaderModule);
+    device->get_device().destroy(pipeline);
+    device->get_device().destroy(pipelineLayout);
+    device->get_device().destroy(descriptorSetLayout);
+    device->get_device().destroy(shaderModule);
 }
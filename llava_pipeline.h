@@ -3,18 +3,23 @@
 
 #include "types.h"
 #include <vector>
+#include <string_view>
 #include <vulkan/vulkan.hpp>
 
+// Suffix of shader variants storing activations as float16, see USE_FP16_ACTIVATIONS
+constexpr string_view f16act_suffix = "_f16act";
+
 // A dumb wrapper around vulkan nightmarish Pipeline/PipelineLayout/DescriptorSet/whatever
 class llava_pipeline {
     friend class llava_command_buffer;
 public:
-    llava_pipeline(llava_context* ctx, string shader_name, specialization_variables_t const& spevar, bool use_prebuilt_shader, uint32_t argument_count);
+    llava_pipeline(llava_device* device, string shader_name, specialization_variables_t const& spevar, bool use_prebuilt_shader, uint32_t argument_count);
     ~llava_pipeline();
 
 public:
     const u32 argument_count;
     llava_context* const context;
+    llava_device* const device;
     const string shader_name;
 
 private:
@@ -0,0 +1,100 @@
+#include "llava_profiler.h"
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+
+void kernel_stats_t::add(double duration_us) {
+    count++;
+    total_us += duration_us;
+    max_us = max(max_us, duration_us);
+
+    u32 bucket = 0;
+    if (duration_us >= 1.) {
+        bucket = min<u32>(u32(log2(duration_us)) + 1, profiler_histogram_bucket_count - 1);
+    }
+    histogram.at(bucket)++;
+}
+
+void llava_profiler::record(string const& pipeline_name, u32 layer_id, double duration_us) {
+    lock_guard guard(stats_mutex);
+    per_pipeline[pipeline_name].add(duration_us);
+    per_layer[layer_id].add(duration_us);
+}
+
+void llava_profiler::reset() {
+    lock_guard guard(stats_mutex);
+    per_pipeline.clear();
+    per_layer.clear();
+}
+
+static void print_stats_line(ostream& out, string const& name, kernel_stats_t const& stats, double grand_total_us) {
+    out << "  " << left << setw(32) << name << right
+        << setw(10) << stats.count
+        << setw(14) << stats.total_us / 1000.
+        << setw(12) << stats.total_us / double(stats.count)
+        << setw(12) << stats.max_us
+        << setw(8) << (grand_total_us > 0 ? 100. * stats.total_us / grand_total_us : 0.) << "%" << endl;
+}
+
+void llava_profiler::print_report(ostream &out) const {
+    lock_guard guard(stats_mutex);
+    if (per_pipeline.empty()) {
+        out << "[*] No dispatch profiled" << endl;
+        return;
+    }
+
+    double grand_total_us = 0;
+    for (auto& [name, stats] : per_pipeline) {
+        grand_total_us += stats.total_us;
+    }
+
+    auto flags = out.flags();
+    out << fixed << setprecision(1);
+    out << "[*] GPU time per pipeline" << endl;
+    out << "  " << left << setw(32) << "pipeline" << right << setw(10) << "count" << setw(14) << "total (ms)" << setw(12) << "mean (us)" << setw(12) << "max (us)" << setw(9) << "share" << endl;
+    for (auto& [name, stats] : per_pipeline) {
+        print_stats_line(out, name, stats, grand_total_us);
+    }
+
+    out << "[*] GPU time per layer" << endl;
+    for (auto& [layer_id, stats] : per_layer) {
+        print_stats_line(out, (layer_id == head_layer_id) ? string("output") : "layer " + to_string(layer_id), stats, grand_total_us);
+    }
+    out.flags(flags);
+}
+
+static void append_stats(vector<u8>& message, kernel_stats_t const& stats) {
+    u32 cursor = message.size();
+    message.resize(cursor + 3 * 8 + profiler_histogram_bucket_count * 8);
+    memcpy(message.data() + cursor, &stats.count, 8);
+    memcpy(message.data() + cursor + 8, &stats.total_us, 8);
+    memcpy(message.data() + cursor + 16, &stats.max_us, 8);
+    memcpy(message.data() + cursor + 24, stats.histogram.data(), profiler_histogram_bucket_count * 8);
+}
+
+vector<u8> llava_profiler::serialize() const {
+    // {bucket_count, pipeline_count, layer_count}
+    // then per pipeline {name_length, [chars], count, total_us, max_us, [histogram]}
+    // then per layer {layer_id, count, total_us, max_us, [histogram]}
+    lock_guard guard(stats_mutex);
+    vector<u8> message(12);
+    u32 header[3] = {profiler_histogram_bucket_count, u32(per_pipeline.size()), u32(per_layer.size())};
+    memcpy(message.data(), header, 12);
+
+    for (auto& [name, stats] : per_pipeline) {
+        u32 cursor = message.size();
+        u32 sz = name.size();
+        message.resize(cursor + 4 + sz);
+        memcpy(message.data() + cursor, &sz, 4);
+        memcpy(message.data() + cursor + 4, name.data(), sz);
+        append_stats(message, stats);
+    }
+
+    for (auto& [layer_id, stats] : per_layer) {
+        u32 cursor = message.size();
+        message.resize(cursor + 4);
+        memcpy(message.data() + cursor, &layer_id, 4);
+        append_stats(message, stats);
+    }
+    return message;
+}
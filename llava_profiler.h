@@ -0,0 +1,40 @@
+#ifndef VULKAN_LLAMA_LLAVA_PROFILER_H
+#define VULKAN_LLAMA_LLAVA_PROFILER_H
+
+#include "types.h"
+#include <array>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// Bucket i counts dispatches lasting [2^(i-1), 2^i) microseconds, bucket 0 is below 1us
+const u32 profiler_histogram_bucket_count = 24;
+
+struct kernel_stats_t {
+    u64 count = 0;
+    double total_us = 0;
+    double max_us = 0;
+    array<u64, profiler_histogram_bucket_count> histogram{};
+
+    void add(double duration_us);
+};
+
+// Aggregates GPU durations of dispatches, measured with timestamp queries, per pipeline name and per layer
+class llava_profiler {
+public:
+    // Layer id used for dispatches outside of the transformer layers (final norm and output matmul)
+    static const u32 head_layer_id = ~0U;
+
+    void record(string const& pipeline_name, u32 layer_id, double duration_us);
+    void reset();
+    void print_report(ostream& out) const;
+    [[nodiscard]] vector<u8> serialize() const;
+
+private:
+    mutable mutex stats_mutex;
+    map<string, kernel_stats_t> per_pipeline;
+    map<u32, kernel_stats_t> per_layer;
+};
+
+#endif //VULKAN_LLAMA_LLAVA_PROFILER_H
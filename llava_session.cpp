@@ -5,11 +5,14 @@
 #include "llava_device_memory.h"
 #include "utils.h"
 #include "llava_command_buffer.h"
+#include "llava_device.h"
+#include "llava_cpu_backend.h"
 #include <chrono>
 #include "ggml_file.h"
 #include <cmath>
 #include <iostream>
 #include <set>
+#include <numeric>
 
 #include <fcntl.h>
 #include <sys/mman.h>
@@ -21,18 +24,24 @@
 #endif
 
 const u32 min_backlog_size = 128;
-const u32 max_backlog_size = 2048;
 
 llava_session::llava_session(llava_context* _ctx) : rng(time(nullptr)), mirostat_mu(2 * mirostat_tau), ctx(_ctx), model(_ctx->get_model()), backlog_size(min_backlog_size) { // NOLINT(cert-msc51-cpp)
-
+    context_keep = ctx->get_context_keep();
+    prefill_chunk = ctx->get_prefill_chunk();
+    if (ctx->get_attention_window()) {
+        (void) set_attention_window(ctx->get_attention_window());
+    }
+    if (ctx->get_draft_context()) {
+        draft_session = new llava_session(ctx->get_draft_context());
+    }
 }
 
 llava_session::~llava_session() {
+    delete draft_session;
     for (auto& x : layer_data) {
         delete x;
     }
-    delete command_buffer;
-    command_buffer = nullptr;
+    reset_command_buffers();
     reset_main_buffers();
 }
 
@@ -42,7 +51,7 @@ void llava_session::ensure_buffers_created() {
     }
     layer_data.reserve(ctx->layers.size());
     for (u32 i = 0; i < ctx->layers.size(); ++i) {
-        layer_data.push_back(new llava_layer_session_data(this));
+        layer_data.push_back(new llava_layer_session_data(this, &ctx->layers.at(i)));
     }
 }
 
@@ -57,89 +66,118 @@ void llava_session::recreate_buffers() {
     u32 n_heads =  model->header.n_heads;
     u32 vocab_size = model->header.vocab_size;
 
-    // Create main buffers
-    main_buffer_memory = new llava_device_memory(ctx);
-    current_thought = new llava_buffer(ctx, ggml_value_type::f32, dim, batch_size, main_buffer_memory);
-    current_thought_sublayer = new llava_buffer(ctx, ggml_value_type::f32, dim, batch_size, main_buffer_memory);
-    current_thought_middle_normd = new llava_buffer(ctx, ggml_value_type::f32, dim, batch_size, main_buffer_memory);
-    properties_mask = new llava_buffer(ctx, ggml_value_type::f32, ff_size, batch_size, main_buffer_memory);
-    main_ff_result = new llava_buffer(ctx, ggml_value_type::f32, ff_size, batch_size, main_buffer_memory);
-    current_Q = new llava_buffer(ctx, ggml_value_type::f32, dim, batch_size, main_buffer_memory);
-    current_K = new llava_buffer(ctx, ggml_value_type::f32, dim, batch_size, main_buffer_memory);
-    main_attn_result = new llava_buffer(ctx, ggml_value_type::f32, backlog_size, n_heads * batch_size, main_buffer_memory);
-    config_buffer = new llava_buffer(ctx, ggml_value_type::f32, 4, 1, main_buffer_memory);
-    current_V = new llava_buffer(ctx, ggml_value_type::f32, dim, batch_size, main_buffer_memory);
-    current_Vout = new llava_buffer(ctx, ggml_value_type::f32, dim, batch_size, main_buffer_memory);
-    norm_w = new llava_buffer(ctx, model->get_buffer_descriptor("norm"), main_buffer_memory);
-    output_w = new llava_buffer(ctx, model->get_buffer_descriptor("output"), main_buffer_memory);
-    output_probs = new llava_buffer(ctx, ggml_value_type::f32, vocab_size, batch_size, main_buffer_memory);
-    main_buffer_memory->freeze();
-    norm_w->load_to_gpu();
-    output_w->load_to_gpu();
+    if (ctx->head_on_cpu()) {
+        cpu_thought.resize(dim * batch_size);
+        cpu_normalized.resize(dim * batch_size);
+        cpu_Q.resize(dim * batch_size);
+        cpu_K.resize(dim * batch_size);
+        cpu_V.resize(dim * batch_size);
+        cpu_Vout.resize(dim * batch_size);
+        cpu_ff_result.resize(ff_size * batch_size);
+        cpu_logits.resize(vocab_size);
+    }
+    if (not ctx->gpu_enabled()) {
+        return;
+    }
+
+    // Create main buffers, every device gets its own set
+    // current_thought accumulates the residual stream and stays f32, intermediates follow the activation type
+    ggml_value_type act_type = get_activation_type();
+    for (llava_device* device : ctx->get_devices()) {
+        session_partition_t& partition = partitions.emplace_back();
+        partition.device = device;
+        partition.main_buffer_memory = new llava_device_memory(device);
+        partition.current_thought = new llava_buffer(device, ggml_value_type::f32, dim, batch_size, partition.main_buffer_memory);
+        partition.properties_mask = new llava_buffer(device, act_type, ff_size, batch_size, partition.main_buffer_memory);
+        partition.main_ff_result = new llava_buffer(device, act_type, ff_size, batch_size, partition.main_buffer_memory);
+        partition.current_Q = new llava_buffer(device, act_type, dim, batch_size, partition.main_buffer_memory);
+        partition.current_K = new llava_buffer(device, act_type, dim, batch_size, partition.main_buffer_memory);
+        partition.main_attn_result = new llava_buffer(device, ggml_value_type::f32, backlog_size, n_heads * batch_size, partition.main_buffer_memory);
+        partition.config_buffer = new llava_buffer(device, ggml_value_type::f32, 4, 1, partition.main_buffer_memory);
+        partition.beam_parents = new llava_buffer(device, ggml_value_type::f32, 4 + max_beam_width, 1, partition.main_buffer_memory);
+        partition.shift_config = new llava_buffer(device, ggml_value_type::f32, 4, 1, partition.main_buffer_memory);
+        partition.current_V = new llava_buffer(device, act_type, dim, batch_size, partition.main_buffer_memory);
+        partition.current_Vout = new llava_buffer(device, act_type, dim, batch_size, partition.main_buffer_memory);
+    }
+
+    session_partition_t& last_partition = partitions.back();
+    if (not ctx->head_on_cpu()) {
+        final_norm_logit = new llava_buffer(last_partition.device, ggml_value_type::f32, dim, batch_size, last_partition.main_buffer_memory);
+        norm_w = new llava_buffer(last_partition.device, model->get_buffer_descriptor("norm"), last_partition.main_buffer_memory);
+        output_w = new llava_buffer(last_partition.device, model->get_buffer_descriptor("output"), last_partition.main_buffer_memory);
+        output_probs = new llava_buffer(last_partition.device, ggml_value_type::f32, vocab_size, batch_size, last_partition.main_buffer_memory);
+    }
+    for (session_partition_t& partition : partitions) {
+        partition.main_buffer_memory->freeze();
+    }
+    if (not ctx->head_on_cpu()) {
+        norm_w->load_to_gpu();
+        output_w->load_to_gpu();
+    }
 }
 
 void llava_session::reset_main_buffers() {
-    delete current_thought;
-    delete current_thought_sublayer;
-    delete current_Q;
-    delete current_thought_middle_normd;
-    delete current_K;
-    delete current_V;
-    delete current_Vout;
-    delete main_attn_result;
-    delete config_buffer;
     delete norm_w;
     delete output_w;
     delete output_probs;
-    delete properties_mask;
-    delete main_ff_result;
-    delete main_buffer_memory;
-    current_thought = nullptr;
-    current_thought_sublayer = nullptr;
-    current_thought_middle_normd = nullptr;
-    current_Q = nullptr;
-    current_K = nullptr;
-    current_V = nullptr;
-    current_Vout = nullptr;
-    main_attn_result = nullptr;
-    config_buffer = nullptr;
+    delete final_norm_logit;
     norm_w = nullptr;
     output_w = nullptr;
     output_probs = nullptr;
-    properties_mask = nullptr;
-    main_ff_result = nullptr;
-    main_buffer_memory = nullptr;
+    final_norm_logit = nullptr;
+    for (session_partition_t& partition : partitions) {
+        assert(partition.command_buffer == nullptr);
+        delete partition.current_thought;
+        delete partition.current_Q;
+        delete partition.current_K;
+        delete partition.current_V;
+        delete partition.current_Vout;
+        delete partition.main_attn_result;
+        delete partition.config_buffer;
+        delete partition.beam_parents;
+        delete partition.shift_config;
+        delete partition.properties_mask;
+        delete partition.main_ff_result;
+        delete partition.main_buffer_memory;
+    }
+    partitions.clear();
+}
+
+void llava_session::reset_command_buffers() {
+    for (session_partition_t& partition : partitions) {
+        delete partition.command_buffer;
+        partition.command_buffer = nullptr;
+    }
+    partitions_pending = 0;
 }
 
 u32 llava_session::get_last_predicted_token(bool deterministic) {
+    return get_predicted_token(deterministic, batch_size - 1);
+}
+
+u32 llava_session::get_predicted_token(bool deterministic, u32 batch_row, u32 sequence) {
     // based on llama_sample_token_mirostat_v2 from llama.cpp
     auto n_vocab = model->header.vocab_size;
+    assert(batch_row < batch_size);
+    float& mu = sequence_mirostat_mu.empty() ? mirostat_mu : sequence_mirostat_mu.at(sequence);
 
+    // Only the tokens up to the sampled row, of its own sequence, count as history
     map<u32, u32> last_token_count;
     if (not deterministic) {
-        for (u32 i = (repeat_last_n > token_buffer.size()) ? 0 : (token_buffer.size() - repeat_last_n); i < token_buffer.size(); ++i) {
-            last_token_count[token_buffer.at(i)]++;
+        u32 slot = current_tokens_in_gpu - batch_size + batch_row;
+        for (u32 i = 0; i < repeat_last_n; ++i) {
+            last_token_count[token_buffer.at(slot)]++;
+            if (slot == 0) {
+                break;
+            }
+            slot = previous_slot(slot);
         }
     }
 
-    if (command_buffer) {
-        command_buffer->wait_idle();
-    }
+    run_pending_partitions();
 
     vector<float> pulled_data;
-    pulled_data.resize(model->header.vocab_size);
-    {
-        auto* res = static_cast<float *>(output_probs->map(0, (batch_size - 1) * model->header.vocab_size * sizeof(float), model->header.vocab_size * sizeof(float)));
-        memcpy(pulled_data.data(), res, model->header.vocab_size * sizeof(float));
-        output_probs->unmap();
-    }
-
-    for (float& x : pulled_data) {
-        if (isnan(x) or isinf(x)) {
-            cerr << "NaN in output buffer" << endl;
-            break;
-        }
-    }
+    pull_logits(batch_row, pulled_data);
 
     if (deterministic) {
         u32 m = 0;
@@ -174,7 +212,7 @@ u32 llava_session::get_last_predicted_token(bool deterministic) {
 
     u32 j_w = 0;
     float new_sum = 0.;
-    float cut = powf(0.5, mirostat_mu);
+    float cut = powf(0.5, mu);
     for (u32 i = 0; i < n_vocab; ++i) {
         pulled_data.at(i) /= total;
         if (pulled_data.at(i) >= cut) {
@@ -190,49 +228,629 @@ u32 llava_session::get_last_predicted_token(bool deterministic) {
     std::discrete_distribution<> dist(pulled_data.begin(), pulled_data.begin() + j_w);
     int idx = dist(rng);
 
-    mirostat_mu += mirostat_eta * (mirostat_tau + log2f(pulled_data.at(idx) / new_sum));
+    mu += mirostat_eta * (mirostat_tau + log2f(pulled_data.at(idx) / new_sum));
     return back_id.at(idx);
 }
 
+void llava_session::pull_logits(u32 batch_row, vector<float>& logits) {
+    auto n_vocab = model->header.vocab_size;
+    logits.resize(n_vocab);
+    if (ctx->head_on_cpu()) {
+        u32 cpu_rows = cpu_logits.size() / n_vocab;
+        assert(batch_row + cpu_rows >= batch_size);
+        memcpy(logits.data(), cpu_logits.data() + (batch_row + cpu_rows - batch_size) * n_vocab, n_vocab * sizeof(float));
+    } else {
+        auto* res = static_cast<float *>(output_probs->map(0, batch_row * n_vocab * sizeof(float), n_vocab * sizeof(float)));
+        memcpy(logits.data(), res, n_vocab * sizeof(float));
+        output_probs->unmap();
+    }
+
+    for (float& x : logits) {
+        if (isnan(x) or isinf(x)) {
+            cerr << "NaN in output buffer" << endl;
+            break;
+        }
+    }
+}
+
 bool llava_session::start_next_token_prediction() {
     ensure_buffers_created();
-    u32 const to_process = token_buffer.size() - current_tokens_in_gpu;
+    u32 to_process = token_buffer.size() - current_tokens_in_gpu;
     if (to_process == 0) {
         cerr << "GPU is already in sync" << endl;
         return false;
     }
+    // Long inputs go by chunks, the last one carrying the rows to sample, all of them even past a chunk
+    u32 last_batch = min(to_process, max(get_prefill_chunk(), logit_rows));
+    while (to_process > last_batch) {
+        u32 batch = get_next_batch_size(to_process - last_batch);
+        if (not submit_tokens(batch)) {
+            return false;
+        }
+        wait_for_prediction();
+        to_process -= batch;
+    }
+    return submit_tokens(to_process);
+}
+
+u32 llava_session::get_pending_token_count() const {
+    // Tokens of the single sequence not evaluated yet
+    return (sequence_count == 1) ? token_buffer.size() - current_tokens_in_gpu : 0;
+}
+
+u32 llava_session::get_prefill_chunk() const {
+    // A batch must not overwrite the ring slots its earlier tokens attend to, so chunks are at most one window
+    return (attention_window != 0) ? min(prefill_chunk, attention_window) : prefill_chunk;
+}
+
+u32 llava_session::get_next_batch_size(u32 pending) const {
+    // The odd-sized part goes first, so that the full chunks after it reuse the same buffers and command buffers, and
+    // the last batch, which holds the rows to sample, always has a whole chunk of them
+    u32 chunk = get_prefill_chunk();
+    if (pending <= chunk) {
+        return pending;
+    }
+    u32 remainder = pending % chunk;
+    return (remainder != 0) ? remainder : chunk;
+}
+
+bool llava_session::prefill() {
+    // Evaluates one chunk of the pending input without sampling, the last chunk is left to the next prediction
+    u32 pending = get_pending_token_count();
+    if (pending <= get_prefill_chunk()) {
+        return true;
+    }
+    ensure_buffers_created();
+    if (not submit_tokens(get_next_batch_size(pending))) {
+        return false;
+    }
+    wait_for_prediction();
+    return true;
+}
+
+bool llava_session::submit_tokens(u32 to_process) {
     set_batch_size(to_process);
-    if (command_buffer == nullptr) {
+
+    if (not ctx->gpu_enabled()) {
+        if ((attention_window == 0) and (token_buffer.size() > backlog_size)) {
+            cerr << "Token buffer overflow" << endl;
+            return false;
+        }
+        embed_on_cpu(to_process);
+        run_on_cpu(current_tokens_in_gpu, to_process);
+        current_tokens_in_gpu += to_process;
+        return true;
+    }
+
+    if (partitions.front().command_buffer == nullptr) {
         recreate_spevars();
-        command_buffer = new llava_command_buffer(this);
-        command_buffer->record_execution();
+        for (session_partition_t& partition : partitions) {
+            partition.command_buffer = new llava_command_buffer(this, partition.device, &partition);
+            partition.command_buffer->record_execution();
+        }
     }
 
     ggml_data_descriptor const& descriptor = model->get_buffer_descriptor("tok_embeddings");
     assert((descriptor.size % model->tokens.size()) == 0);
 
-    if(token_buffer.size() > backlog_size) {
+    if ((attention_window == 0) and (token_buffer.size() > backlog_size)) {
         cerr << "Token buffer overflow" << endl;
         return false;
     }
 
+    llava_buffer* first_thought = partitions.front().current_thought;
     for (u32 i = 0; i < to_process; i++) {
         u32 token_id = token_buffer.at(i + current_tokens_in_gpu);
         assert(token_id < model->tokens.size());
-        current_thought->write_f32(model->mapping + (descriptor.offset + token_id * (descriptor.size / model->tokens.size())), descriptor.ftype, descriptor.model_version, i * model->header.dim, model->header.dim);
+        first_thought->write_f32(model->mapping + (descriptor.offset + token_id * (descriptor.size / model->tokens.size())), descriptor.ftype, descriptor.model_version, i * model->header.dim, model->header.dim);
+    }
+    u32 config[4] = {current_tokens_in_gpu, attention_window, shared_prefix_size, sequence_count};
+    for (session_partition_t& partition : partitions) {
+        partition.config_buffer->write_f32(&(config[0]), ggml_value_type::f32, 1, 0, 4);
+    }
+    partitions.front().command_buffer->run();
+    partitions_pending = partitions.size() - 1;
+    if (ctx->head_on_cpu()) {
+        cpu_pending_tokens = to_process;
     }
-    u32 config[4] = {current_tokens_in_gpu, current_tokens_in_gpu, current_tokens_in_gpu, current_tokens_in_gpu};
-    config_buffer->write_f32(&(config[0]), ggml_value_type::f32, 1, 0, 4);
-    command_buffer->run();
     current_tokens_in_gpu += to_process;
     return true;
 }
 
+void llava_session::run_pending_partitions() {
+    // Each device waits for the previous one, meanwhile the devices already done can serve other sessions
+    while (partitions_pending) {
+        session_partition_t& previous = partitions.at(partitions.size() - 1 - partitions_pending);
+        session_partition_t& next = partitions.at(partitions.size() - partitions_pending);
+        previous.command_buffer->wait_idle();
+        void* residual = previous.current_thought->map();
+        next.current_thought->write_f32(residual, ggml_value_type::f32, 1, 0, batch_size * model->header.dim);
+        previous.current_thought->unmap();
+        next.command_buffer->run();
+        partitions_pending--;
+    }
+    if (not partitions.empty() and partitions.back().command_buffer) {
+        partitions.back().command_buffer->wait_idle();
+    }
+}
+
 u32 llava_session::finish_next_token_prediction() {
-    command_buffer->wait_idle();
+    wait_for_prediction();
     return get_last_predicted_token(false);
 }
 
+void llava_session::wait_for_prediction() {
+    run_pending_partitions();
+    if (cpu_pending_tokens) {
+        // The GPU layers left the residual in current_thought, the remaining layers continue from it
+        llava_buffer* last_thought = partitions.back().current_thought;
+        auto* residual = static_cast<float *>(last_thought->map());
+        memcpy(cpu_thought.data(), residual, cpu_pending_tokens * model->header.dim * sizeof(float));
+        last_thought->unmap();
+        run_on_cpu(current_tokens_in_gpu - cpu_pending_tokens, cpu_pending_tokens);
+        cpu_pending_tokens = 0;
+    }
+}
+
+u32 llava_session::previous_slot(u32 slot) const {
+    if (slot >= shared_prefix_size + sequence_count) {
+        return slot - sequence_count;
+    }
+    return (slot >= shared_prefix_size) ? shared_prefix_size - 1 : slot - 1;
+}
+
+bool llava_session::fork_sequences(u32 count, vector<u32>& first_tokens) {
+    // The prompt is evaluated once, every sequence samples its first token from the prompt's last row
+    if ((sequence_count != 1) or (attention_window != 0) or (count < 2) or token_buffer.empty()) {
+        return false;
+    }
+    if (current_tokens_in_gpu == token_buffer.size()) {
+        current_tokens_in_gpu--; // Logits of the last token are needed again
+    }
+    if (not start_next_token_prediction()) {
+        return false;
+    }
+    wait_for_prediction();
+
+    sequence_mirostat_mu.assign(count, mirostat_mu);
+    for (u32 sequence = 0; sequence < count; ++sequence) {
+        first_tokens.push_back(get_predicted_token(false, batch_size - 1, sequence));
+    }
+    shared_prefix_size = token_buffer.size();
+    sequence_count = count;
+    logit_rows = count;
+    for (u32 token : first_tokens) {
+        if (not push_token(token)) {
+            select_sequence(0);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool llava_session::predict_sequence_tokens(vector<u32>& new_tokens) {
+    // One batch row per sequence, each one evaluates its last token and samples its next one
+    if ((sequence_count == 1) or not beam_scores.empty()) {
+        return false;
+    }
+    if (not start_next_token_prediction()) {
+        return false;
+    }
+    wait_for_prediction();
+    assert(batch_size == sequence_count);
+    assert((current_tokens_in_gpu - shared_prefix_size) % sequence_count == 0);
+
+    for (u32 sequence = 0; sequence < sequence_count; ++sequence) {
+        new_tokens.push_back(get_predicted_token(false, sequence, sequence));
+    }
+    for (u32 token : new_tokens) {
+        if (not push_token(token)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+u32 llava_session::get_sequence_count() const {
+    return sequence_count;
+}
+
+vector<u32> llava_session::get_sequence_tokens(u32 sequence) const {
+    if (sequence_count == 1) {
+        return token_buffer;
+    }
+    vector<u32> tokens(token_buffer.begin(), token_buffer.begin() + shared_prefix_size);
+    for (u32 slot = shared_prefix_size + sequence; slot < token_buffer.size(); slot += sequence_count) {
+        tokens.push_back(token_buffer.at(slot));
+    }
+    return tokens;
+}
+
+void llava_session::select_sequence(u32 sequence) {
+    // Back to a single sequence, whose own tokens are evaluated again from the end of the prompt
+    if (sequence_count == 1) {
+        return;
+    }
+    assert(sequence < sequence_count);
+    beam_scores.clear();
+    vector<u32> tokens = get_sequence_tokens(sequence);
+    mirostat_mu = sequence_mirostat_mu.at(sequence);
+    sequence_mirostat_mu.clear();
+    current_tokens_in_gpu = min(current_tokens_in_gpu, shared_prefix_size);
+    token_buffer = std::move(tokens);
+    shared_prefix_size = 0;
+    sequence_count = 1;
+    logit_rows = 1;
+}
+
+static void log_softmax(vector<float>& logits) {
+    float max_logit = *max_element(logits.begin(), logits.end());
+    float total = 0;
+    for (float x : logits) {
+        total += expf(x - max_logit);
+    }
+    float offset = max_logit + logf(total);
+    for (float& x : logits) {
+        x -= offset;
+    }
+}
+
+bool llava_session::start_beam_search(u32 width) {
+    // The prompt is evaluated once, the beams start from its width most likely continuations
+    if ((sequence_count != 1) or (attention_window != 0) or (width < 2) or (width > max_beam_width) or token_buffer.empty()) {
+        return false;
+    }
+    if (current_tokens_in_gpu == token_buffer.size()) {
+        current_tokens_in_gpu--; // Logits of the last token are needed again
+    }
+    if (not start_next_token_prediction()) {
+        return false;
+    }
+    wait_for_prediction();
+
+    // One more candidate than beams, so that one ending the stream still leaves enough
+    vector<float> logits;
+    pull_logits(batch_size - 1, logits);
+    vector<beam_candidate_t> candidates;
+    add_beam_candidates(candidates, logits, 0, 0, width + 1);
+
+    best_finished_beam.clear();
+    best_finished_score = -INFINITY;
+    shared_prefix_size = token_buffer.size();
+    sequence_count = width;
+    logit_rows = width;
+    sequence_mirostat_mu.assign(width, mirostat_mu);
+    if (not select_beams(candidates)) {
+        select_sequence(0);
+        return false;
+    }
+    return true;
+}
+
+bool llava_session::advance_beams() {
+    // All beams are evaluated in one batch, each one offers its width best continuations
+    if (beam_scores.empty()) {
+        return false;
+    }
+    if (not start_next_token_prediction()) {
+        return false;
+    }
+    wait_for_prediction();
+    assert(batch_size == sequence_count);
+
+    vector<float> logits;
+    vector<beam_candidate_t> candidates;
+    for (u32 beam = 0; beam < sequence_count; ++beam) {
+        pull_logits(beam, logits);
+        add_beam_candidates(candidates, logits, beam_scores.at(beam), beam, sequence_count);
+    }
+    return select_beams(candidates);
+}
+
+bool llava_session::beam_search_done() const {
+    // Scores only decrease, no live beam can overtake a better finished hypothesis
+    return beam_scores.empty() or (best_finished_score >= beam_scores.front());
+}
+
+bool llava_session::end_beam_search(vector<u32>& best_tokens) {
+    // The best hypothesis, finished or not, stays in the session as its only sequence
+    if (beam_scores.empty()) {
+        return false;
+    }
+    vector<u32> tokens;
+    if (best_finished_score >= beam_scores.front()) {
+        tokens.assign(token_buffer.begin(), token_buffer.begin() + shared_prefix_size);
+        tokens.insert(tokens.end(), best_finished_beam.begin(), best_finished_beam.end());
+    } else {
+        tokens = get_sequence_tokens(0);
+    }
+    best_tokens.assign(tokens.begin() + shared_prefix_size, tokens.end());
+    select_sequence(0);
+    return set_tokens(tokens);
+}
+
+void llava_session::add_beam_candidates(vector<beam_candidate_t>& candidates, vector<float>& logits, float score, u32 parent, u32 count) {
+    log_softmax(logits);
+    vector<u32> token_ids(logits.size());
+    iota(token_ids.begin(), token_ids.end(), 0);
+    partial_sort(token_ids.begin(), token_ids.begin() + count, token_ids.end(), [&logits](u32 a, u32 b) { return logits.at(a) > logits.at(b); });
+    for (u32 i = 0; i < count; ++i) {
+        candidates.push_back({score + logits.at(token_ids.at(i)), parent, token_ids.at(i)});
+    }
+}
+
+bool llava_session::select_beams(vector<beam_candidate_t>& candidates) {
+    // Hypotheses ending the stream are set aside, the best other ones become the new beams
+    sort(candidates.begin(), candidates.end(), [](beam_candidate_t const& a, beam_candidate_t const& b) { return a.score > b.score; });
+    vector<u32> parents;
+    vector<u32> tokens;
+    beam_scores.clear();
+    for (beam_candidate_t const& candidate : candidates) {
+        if (parents.size() == sequence_count) {
+            break;
+        }
+        if (candidate.token == eos_token_id) {
+            if (candidate.score > best_finished_score) {
+                vector<u32> beam = get_sequence_tokens(candidate.parent);
+                best_finished_beam.assign(beam.begin() + shared_prefix_size, beam.end());
+                best_finished_score = candidate.score;
+            }
+            continue;
+        }
+        parents.push_back(candidate.parent);
+        tokens.push_back(candidate.token);
+        beam_scores.push_back(candidate.score);
+    }
+    assert(parents.size() == sequence_count);
+
+    // Evaluated steps follow their beam, in the token buffer and in the KV caches
+    assert(current_tokens_in_gpu == token_buffer.size());
+    u32 step_count = (token_buffer.size() - shared_prefix_size) / sequence_count;
+    bool reordered = false;
+    for (u32 beam = 0; beam < sequence_count; ++beam) {
+        reordered |= (parents.at(beam) != beam);
+    }
+    if (reordered and (step_count != 0)) {
+        vector<u32> step_tokens(sequence_count);
+        for (u32 step = 0; step < step_count; ++step) {
+            auto first = token_buffer.begin() + (shared_prefix_size + step * sequence_count);
+            copy(first, first + sequence_count, step_tokens.begin());
+            for (u32 beam = 0; beam < sequence_count; ++beam) {
+                *(first + beam) = step_tokens.at(parents.at(beam));
+            }
+        }
+        gather_kv_caches(parents, step_count);
+    }
+
+    for (u32 token : tokens) {
+        if (not push_token(token)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void llava_session::gather_kv_caches(vector<u32> const& parents, u32 step_count) {
+    // Cache rows are moved on the device holding them rather than evaluated again
+    u32 beam_config[4 + max_beam_width] = {shared_prefix_size, sequence_count, 0, 0};
+    copy(parents.begin(), parents.end(), beam_config + 4);
+    for (session_partition_t& partition : partitions) {
+        partition.beam_parents->write_f32(&(beam_config[0]), ggml_value_type::f32, 1, 0, 4 + max_beam_width);
+    }
+    update_kv_caches([&parents, step_count](llava_layer_session_data* data, llava_command_buffer* cmd_buf) {
+        data->gather_kv_cache(cmd_buf, step_count, parents.data());
+    });
+}
+
+void llava_session::update_kv_caches(function<void(llava_layer_session_data*, llava_command_buffer*)> const& task) {
+    // One command buffer per device for the layers it holds, CPU layers run meanwhile with a null command buffer
+    vector<llava_command_buffer*> update_command_buffers;
+    for (session_partition_t& partition : partitions) {
+        auto* update_command_buffer = new llava_command_buffer(this, partition.device, &partition);
+        for (u32 i = 0; i < ctx->layers.size(); ++i) {
+            if (ctx->layers.at(i).device == partition.device) {
+                update_command_buffer->current_layer = i;
+                task(layer_data.at(i), update_command_buffer);
+            }
+        }
+        update_command_buffer->end_recording();
+        update_command_buffer->run();
+        update_command_buffers.push_back(update_command_buffer);
+    }
+    for (u32 i = 0; i < ctx->layers.size(); ++i) {
+        if (ctx->layers.at(i).on_cpu) {
+            task(layer_data.at(i), nullptr);
+        }
+    }
+    for (llava_command_buffer* update_command_buffer : update_command_buffers) {
+        delete update_command_buffer; // Waits for it
+    }
+}
+
+void llava_session::set_context_shift(u32 keep) {
+    context_keep = keep;
+    if (draft_session) {
+        draft_session->set_context_shift(keep);
+    }
+}
+
+bool llava_session::shift_context() {
+    // Drops the oldest half of the tokens after the kept ones, the cache rows after them move down
+    // RoPE is applied at attention time from relative positions, so the moved rows need no update
+    if ((context_keep == ~0U) or (sequence_count != 1) or (token_buffer.size() < 2)) {
+        return false;
+    }
+    u32 keep = min<u32>(context_keep, token_buffer.size() - 2);
+    u32 discard = (token_buffer.size() - keep) / 2;
+    u32 first_moved = keep + discard;
+    run_pending_partitions();
+    if (current_tokens_in_gpu > first_moved) {
+        u32 shift_args[4] = {first_moved, current_tokens_in_gpu - first_moved, discard, 0};
+        for (session_partition_t& partition : partitions) {
+            partition.shift_config->write_f32(&(shift_args[0]), ggml_value_type::f32, 1, 0, 4);
+        }
+        update_kv_caches([&shift_args](llava_layer_session_data* data, llava_command_buffer* cmd_buf) {
+            data->shift_kv_cache(cmd_buf, shift_args[0], shift_args[1], shift_args[2]);
+        });
+        current_tokens_in_gpu -= discard;
+    } else {
+        current_tokens_in_gpu = min(current_tokens_in_gpu, keep);
+    }
+    token_buffer.erase(token_buffer.begin() + keep, token_buffer.begin() + first_moved);
+    if (ctx->verbosity) {
+        cerr << "[*] Context shifted, dropped " << discard << " tokens after the first " << keep << endl;
+    }
+    return true;
+}
+
+bool llava_session::speculation_enabled() const {
+    return (draft_session != nullptr) or (ctx->get_lookup_ngram_size() != 0);
+}
+
+pair<u32, u32> llava_session::get_speculation_stats() const {
+    return {accepted_token_count, proposed_token_count};
+}
+
+bool llava_session::predict_next_tokens(vector<u32>& new_tokens) {
+    // Pushes the accepted part of the proposal then a token of our own, at least one token per call
+    if (sequence_count != 1) {
+        return false; // Proposals extend a single sequence
+    }
+
+    // Prompt lookup is free, the draft model only runs when it finds nothing
+    vector<u32> proposal;
+    lookup_tokens(ctx->get_draft_token_count(), proposal);
+    if (proposal.empty() and draft_session and draft_session->set_tokens(token_buffer)) {
+        draft_session->propose_tokens(ctx->get_draft_token_count(), proposal);
+    }
+
+    // The buffer may only shift before base_size is taken, the proposal and our own token must fit after it
+    if (attention_window == 0) {
+        if ((token_buffer.size() + proposal.size() + 1 > max_backlog_size) and (context_keep != ~0U) and not shift_context()) {
+            proposal.clear(); // No room made, only our own token is evaluated
+        }
+        u32 free_rows = max_backlog_size - min<u32>(max_backlog_size, token_buffer.size() + 1);
+        if (proposal.size() > free_rows) {
+            proposal.resize(free_rows);
+        }
+    } else if (proposal.size() >= attention_window) {
+        proposal.resize(attention_window - 1); // The sampled rows must fit in one window-sized batch
+    }
+
+    u32 base_size = token_buffer.size();
+    for (u32 token : proposal) {
+        if (not push_token(token)) {
+            break;
+        }
+    }
+    proposal.resize(token_buffer.size() - base_size);
+
+    // The rows of the pending token and of each proposed one predict the token after it, in one weight pass
+    logit_rows = proposal.size() + 1;
+    if (not start_next_token_prediction()) {
+        logit_rows = 1;
+        rewind(base_size);
+        return false;
+    }
+    wait_for_prediction();
+
+    // Each row is sampled as usual, a proposed token is kept only if it is what we sampled
+    u32 first_row = batch_size - logit_rows;
+    u32 accepted = 0;
+    u32 token = get_predicted_token(false, first_row);
+    while ((accepted < proposal.size()) and (token == proposal.at(accepted))) {
+        new_tokens.push_back(token);
+        accepted++;
+        token = get_predicted_token(false, first_row + accepted);
+    }
+    logit_rows = 1;
+    proposed_token_count += proposal.size();
+    accepted_token_count += accepted;
+
+    // Rejected tokens were evaluated but are overwritten by the next batch
+    rewind(base_size + accepted);
+    if (not push_token(token)) {
+        return accepted != 0;
+    }
+    new_tokens.push_back(token);
+    return true;
+}
+
+void llava_session::propose_tokens(u32 count, vector<u32>& proposal) {
+    // Greedy continuation, left in the token buffer until the next set_tokens
+    for (u32 i = 0; i < count; ++i) {
+        if (not start_next_token_prediction()) {
+            return;
+        }
+        wait_for_prediction();
+        u32 token = get_last_predicted_token(true);
+        proposal.push_back(token);
+        if (not push_token(token)) {
+            return;
+        }
+    }
+}
+
+void llava_session::lookup_tokens(u32 count, vector<u32>& proposal) const {
+    // Proposes what followed the most recent earlier occurrence of the last n tokens, outputs often copy their context
+    u32 n = ctx->get_lookup_ngram_size();
+    u32 size = token_buffer.size();
+    if ((n == 0) or (size <= n)) {
+        return;
+    }
+    auto suffix = token_buffer.begin() + (size - n);
+    for (u32 i = size - n; i-- > 0;) {
+        if (equal(suffix, token_buffer.end(), token_buffer.begin() + i)) {
+            proposal.assign(token_buffer.begin() + (i + n), token_buffer.begin() + min(i + n + count, size));
+            return;
+        }
+    }
+}
+
+bool llava_session::set_tokens(vector<u32> const& tokens) {
+    // Keeps the common prefix, and what was evaluated of it
+    u32 prefix = 0;
+    while ((prefix < tokens.size()) and (prefix < token_buffer.size()) and (tokens.at(prefix) == token_buffer.at(prefix))) {
+        prefix++;
+    }
+    rewind(prefix);
+    for (u32 i = prefix; i < tokens.size(); ++i) {
+        if (not push_token(tokens.at(i))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void llava_session::embed_on_cpu(u32 to_process) {
+    llava_cpu_backend* backend = ctx->get_cpu_backend();
+    u32 dim = model->header.dim;
+    ggml_data_descriptor const& embeddings = model->get_buffer_descriptor("tok_embeddings");
+    for (u32 i = 0; i < to_process; i++) {
+        u32 token_id = token_buffer.at(i + current_tokens_in_gpu);
+        assert(token_id < model->tokens.size());
+        backend->get_row(cpu_thought.data() + i * dim, embeddings, token_id);
+    }
+}
+
+void llava_session::run_on_cpu(u32 position, u32 to_process) {
+    // Runs the layers assigned to the CPU and the output head, synchronously
+    llava_cpu_backend* backend = ctx->get_cpu_backend();
+    u32 dim = model->header.dim;
+    for (u32 i = 0; i < ctx->layers.size(); ++i) {
+        if (ctx->layers.at(i).on_cpu) {
+            ctx->layers.at(i).execute_cpu(backend, layer_data.at(i), cpu_thought.data(), position);
+        }
+    }
+
+    // Only the last logit_rows tokens are sampled
+    u32 rows = min(logit_rows, to_process);
+    float const* first_logit = cpu_thought.data() + (to_process - rows) * dim;
+    cpu_logits.resize(size_t(rows) * model->header.vocab_size);
+    backend->normalize_logit(cpu_normalized.data(), first_logit, model->get_buffer_descriptor("norm"), rows);
+    backend->matmul(cpu_logits.data(), model->get_buffer_descriptor("output"), cpu_normalized.data(), rows);
+}
+
 u32 llava_session::predict_next_token() {
     if (not start_next_token_prediction()) {
         return ~0U;
@@ -245,8 +863,7 @@ void llava_session::set_batch_size(u32 _batch_size) {
         return;
     }
 
-    delete command_buffer;
-    command_buffer = nullptr;
+    reset_command_buffers();
     batch_size = _batch_size;
 
     recreate_buffers();
@@ -255,10 +872,11 @@ void llava_session::set_batch_size(u32 _batch_size) {
 }
 
 bool llava_session::set_text(const string& new_text) {
+    select_sequence(0);
     vector<u32> dec_tokens;
     model->tokenize(dec_tokens, new_text, true);
     u32 next_backlog_size = backlog_size;
-    while (dec_tokens.size() > next_backlog_size) {
+    while ((attention_window == 0) and (dec_tokens.size() > next_backlog_size)) {
         next_backlog_size <<= 1;
     }
     if (next_backlog_size > max_backlog_size) {
@@ -272,20 +890,23 @@ bool llava_session::set_text(const string& new_text) {
         max_prefix++;
     }
     token_buffer = dec_tokens;
-    current_tokens_in_gpu = max_prefix;
+    rewind_evaluated_tokens(max_prefix);
     return true;
 }
 
 bool llava_session::add_text(const string &s) {
+    select_sequence(0);
     string full_text = model->tokens_to_text(token_buffer.data(), token_buffer.size()) + s;
     return set_text(full_text);
 }
 
 bool llava_session::push_token(u32 new_token) {
     assert(new_token < model->tokens.size());
-    if (token_buffer.size() == backlog_size) {
+    if ((attention_window == 0) and (token_buffer.size() == backlog_size)) {
         if (backlog_size == max_backlog_size) {
-            return false;
+            if (not shift_context()) {
+                return false;
+            }
         } else {
             if (not set_backlog_size(backlog_size * 2)) {
                 return false;
@@ -314,8 +935,7 @@ bool llava_session::set_backlog_size(u32 new_size) {
         return false;
     }
 
-    delete command_buffer;
-    command_buffer = nullptr;
+    reset_command_buffers();
 
     backlog_size = new_size;
     recreate_buffers();
@@ -337,6 +957,9 @@ specialization_variables_t const &llava_session::get_spevar_struct() const {
 }
 
 void llava_session::recreate_spevars() {
+    if (not ctx->gpu_enabled()) {
+        return;
+    }
     auto& spevar = specialization_variables;
 
     // Compute specialization variables
@@ -349,37 +972,27 @@ void llava_session::recreate_spevars() {
     spevar.head_count = n_heads;
     spevar.rot = rot;
     spevar.quarterrot = rot / 4;
-    spevar.rot_bits = ulog2(rot);
+    spevar.rot_bits = ((rot & (rot - 1)) == 0) ? ulog2(rot) : 0; // Unused by shaders, only meaningful for powers of 2
     spevar.max_wgs = workgroup_size;
     spevar.max_wgs_bits = ulog2(workgroup_size);
     spevar.ff_size = ff_size;
 
-    if (dim == 4096) {
-        spevar.matmul_dim_row_worker_count = 128;
-    } else if (dim == 5120) {
-        spevar.matmul_dim_row_worker_count = 32;
-    } else {
-        assert(false);
-    }
-
-    assert((workgroup_size % spevar.matmul_dim_row_worker_count) == 0);
-    spevar.matmul_dim_row_per_wavefront = workgroup_size / spevar.matmul_dim_row_worker_count;
+    // Workgroup shapes come from the auto-tuner, see llava_autotuner
+    auto const& dim_tuning = ctx->dim_matmul_tuning;
+    assert(dim_tuning.row_per_wavefront * dim_tuning.row_worker_count <= workgroup_size);
+    spevar.matmul_dim_row_worker_count = dim_tuning.row_worker_count;
+    spevar.matmul_dim_row_per_wavefront = dim_tuning.row_per_wavefront;
     spevar.matmul_dim_row_worker_count_log2 = ulog2(spevar.matmul_dim_row_worker_count);
     spevar.matmul_dim_q4_blocks_per_row = dim / 32;
     spevar.matmul_dim_q4_block_count_per_worker = updiv(spevar.matmul_dim_q4_blocks_per_row, spevar.matmul_dim_row_worker_count);
 
-    if ((ff_size == 11008) or (ff_size == 13824)) {
-        spevar.matmul_ff_row_worker_count = 128;
-    } else {
-        assert(false);
-    }
-
-    assert((workgroup_size % spevar.matmul_ff_row_worker_count) == 0);
-
-    spevar.matmul_ff_row_per_wavefront = workgroup_size / spevar.matmul_ff_row_worker_count;
+    auto const& ff_tuning = ctx->ff_matmul_tuning;
+    assert(ff_tuning.row_per_wavefront * ff_tuning.row_worker_count <= workgroup_size);
+    spevar.matmul_ff_row_worker_count = ff_tuning.row_worker_count;
+    spevar.matmul_ff_row_per_wavefront = ff_tuning.row_per_wavefront;
     spevar.matmul_ff_row_worker_count_log2 = ulog2(spevar.matmul_ff_row_worker_count);
     spevar.matmul_ff_q4_blocks_per_row = ff_size / 32;
-    spevar.matmul_ff_q4_block_count_per_worker = updiv(spevar.matmul_ff_q4_blocks_per_row, spevar.matmul_dim_row_worker_count);
+    spevar.matmul_ff_q4_block_count_per_worker = updiv(spevar.matmul_ff_q4_blocks_per_row, spevar.matmul_ff_row_worker_count);
 
     spevar.backlog = backlog_size;
     spevar.softmax_head_per_wavefront = workgroup_size / backlog_size;
@@ -388,10 +1001,51 @@ void llava_session::recreate_spevars() {
 }
 
 void llava_session::rewind(u32 n) {
+    if (sequence_count != 1) {
+        select_sequence(0);
+    }
     if (n < token_buffer.size()) {
         token_buffer.resize(n);
-        current_tokens_in_gpu = min(n, current_tokens_in_gpu);
+        rewind_evaluated_tokens(n);
+    }
+}
+
+void llava_session::rewind_evaluated_tokens(u32 n) {
+    // Rows dropped from a ring overwrote older ones, further back than a window the ones still needed are gone
+    if ((attention_window != 0) and (current_tokens_in_gpu > n + attention_window)) {
+        n = 0;
     }
+    current_tokens_in_gpu = min(n, current_tokens_in_gpu);
+}
+
+ReturnCode llava_session::set_attention_window(u32 window) {
+    // The ring holds two windows, so that a batch of up to window tokens never overwrites what its earlier tokens attend to
+    if (window == attention_window) {
+        return ReturnCode::ok;
+    }
+    if ((window != 0) and (((window & (window - 1)) != 0) or (2 * window < min_backlog_size) or (2 * window > max_backlog_size))) {
+        return ReturnCode::bad_arguments;
+    }
+    u32 next_backlog_size = min_backlog_size;
+    if (window != 0) {
+        next_backlog_size = 2 * window;
+    } else {
+        while (token_buffer.size() > next_backlog_size) {
+            next_backlog_size <<= 1;
+        }
+        if (next_backlog_size > max_backlog_size) {
+            return ReturnCode::nok;
+        }
+    }
+    select_sequence(0);
+
+    // Rows are laid out differently, the context is evaluated again
+    current_tokens_in_gpu = 0;
+    attention_window = window;
+    if (not set_backlog_size(next_backlog_size)) {
+        return ReturnCode::nok;
+    }
+    return ReturnCode::ok;
 }
 
 u32 llava_session::get_token_count() const {
@@ -407,8 +1061,7 @@ ReturnCode llava_session::set_options(u32 new_options) {
 
     options = new_options;
 
-    delete command_buffer;
-    command_buffer = nullptr;
+    reset_command_buffers();
 
     flush_layers_data_buffers();
 
@@ -421,10 +1074,21 @@ bool llava_session::is_tracing_enabled() const {
     return options != 0;
 }
 
+ggml_value_type llava_session::get_activation_type() const {
+    // Tracing dumps the per-layer f32 buffers, so keep the whole pipeline in f32 then
+    if (ctx->fp16_activations_enabled() and not is_tracing_enabled()) {
+        return ggml_value_type::f16;
+    }
+    return ggml_value_type::f32;
+}
+
 ReturnCode llava_session::save_frame(const string &path) {
     if (not is_tracing_enabled()) {
         return ReturnCode::not_tracing;
     }
+    if (not ctx->gpu_enabled()) {
+        return ReturnCode::nok; // Intermediate buffers are only recorded on GPU
+    }
 
     int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
 
@@ -445,6 +1109,9 @@ ReturnCode llava_session::save_frame(const string &path) {
 }
 
 ReturnCode llava_session::snapshot(const string &path) {
+    if ((sequence_count != 1) or (attention_window != 0)) {
+        return ReturnCode::nok; // KV slots of parallel sequences are interleaved, a ring does not hold the whole context
+    }
     size_t total_size = layer_data.size() * 2 * current_tokens_in_gpu * model->header.dim * 2 + 4 * current_tokens_in_gpu + 4;
     assert(current_tokens_in_gpu <= token_buffer.size());
 
@@ -496,6 +1163,9 @@ ReturnCode llava_session::snapshot(const string &path) {
 
 ReturnCode llava_session::restore(const string &path) {
     assert(current_tokens_in_gpu <= token_buffer.size());
+    if (attention_window != 0) {
+        return ReturnCode::nok;
+    }
 
     int fd = open(path.c_str(), O_RDONLY);
 
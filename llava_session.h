@@ -8,10 +8,16 @@
 #include <map>
 #include <list>
 #include <random>
+#include <functional>
 #include "llava_layer.h"
 #include "llava_buffer.h"
 #include "llava_pipeline.h"
 
+// KV caches grow with the context up to this many tokens
+const u32 max_backlog_size = 2048;
+// Beams of a beam search, bounded by the kv_gather shader
+const u32 max_beam_width = 16;
+
 struct specialization_variables_t {
     u32 head_count; // = 32;
     u32 quarterrot; // = 32;
@@ -36,10 +42,29 @@ struct specialization_variables_t {
     u32 batch_enabled; // = 1;
 };
 
+// Scratch buffers of a session on one device, shared by the layers this device holds
+struct session_partition_t {
+    llava_device* device = nullptr;
+    llava_device_memory* main_buffer_memory = nullptr;
+    llava_buffer* current_thought = nullptr; // Residual stream, handed over between devices
+    llava_buffer* current_Q = nullptr;
+    llava_buffer* current_K = nullptr;
+    llava_buffer* current_V = nullptr;
+    llava_buffer* current_Vout = nullptr;
+    llava_buffer* main_attn_result = nullptr;
+    llava_buffer* config_buffer = nullptr;
+    llava_buffer* properties_mask = nullptr;
+    llava_buffer* main_ff_result = nullptr;
+    llava_buffer* beam_parents = nullptr; // {prefix_size, sequence_count, pad, pad, parents[max_beam_width]}
+    llava_buffer* shift_config = nullptr; // {first_row, row_count, shift, pad}
+    llava_command_buffer* command_buffer = nullptr;
+};
+
 class llava_session {
     friend class llava_layer;
     friend class llava_layer_session_data;
     friend class llava_command_buffer;
+    friend class llava_autotuner;
 public:
     explicit llava_session(llava_context* ctx);
     ~llava_session();
@@ -50,16 +75,35 @@ public:
     ND bool push_token(u32);
     ND u32 predict_next_token();
     ND bool start_next_token_prediction();
+    ND u32 get_pending_token_count() const;
+    ND u32 get_prefill_chunk() const;
+    ND bool prefill();
     ND u32 finish_next_token_prediction();
+    ND bool predict_next_tokens(vector<u32>& new_tokens);
+    ND bool speculation_enabled() const;
+    ND pair<u32, u32> get_speculation_stats() const;
+    ND bool fork_sequences(u32 count, vector<u32>& first_tokens);
+    ND bool predict_sequence_tokens(vector<u32>& new_tokens);
+    ND u32 get_sequence_count() const;
+    ND vector<u32> get_sequence_tokens(u32 sequence) const;
+    void select_sequence(u32 sequence);
+    ND bool start_beam_search(u32 width);
+    ND bool advance_beams();
+    ND bool beam_search_done() const;
+    ND bool end_beam_search(vector<u32>& best_tokens);
     ND specialization_variables_t const& get_spevar_struct() const;
     ND bool is_tracing_enabled() const;
+    ND ggml_value_type get_activation_type() const;
 
     void rewind(u32);
+    ND bool set_tokens(vector<u32> const& tokens);
     ReturnCode set_options(u32);
     ReturnCode save_frame(const string& path);
     ReturnCode snapshot(const string &path);
     ReturnCode restore(const string &path);
     ND bool add_text(const string& s);
+    void set_context_shift(u32 keep);
+    ReturnCode set_attention_window(u32 window);
 
 public:
     llava_context* const ctx;
@@ -77,27 +121,77 @@ private:
     float mirostat_mu;
 
 private: // buffers
-    llava_device_memory* main_buffer_memory = nullptr;
-    llava_buffer* current_thought = nullptr;
-    llava_buffer* current_thought_sublayer = nullptr;
-    llava_buffer* current_thought_middle_normd = nullptr;
-    llava_buffer* current_Q = nullptr;
-    llava_buffer* current_K = nullptr;
-    llava_buffer* current_V = nullptr;
-    llava_buffer* current_Vout = nullptr;
-    llava_buffer* main_attn_result = nullptr;
-    llava_buffer* config_buffer = nullptr;
-    llava_buffer* norm_w = nullptr;
+    vector<session_partition_t> partitions; // One per device, in layer order
+    llava_buffer* norm_w = nullptr; // Output head, on the last device
     llava_buffer* output_w = nullptr;
     llava_buffer* output_probs = nullptr;
-    llava_buffer* properties_mask = nullptr;
-    llava_buffer* main_ff_result = nullptr;
+    llava_buffer* final_norm_logit = nullptr;
     vector<llava_layer_session_data*> layer_data;
+    u32 partitions_pending = 0; // Partitions after the first one still to run for the submitted tokens
+    void run_pending_partitions();
+    void reset_command_buffers();
+
+private: // parallel sequences, KV slots [0, shared_prefix_size) hold the prompt, then one token of each sequence per step
+    u32 shared_prefix_size = 0;
+    u32 sequence_count = 1;
+    vector<float> sequence_mirostat_mu; // One per sequence, empty without parallel sequences
+    [[nodiscard]] u32 previous_slot(u32 slot) const;
+
+private: // beam search, sequences are the live beams, sorted by decreasing log-probability
+    struct beam_candidate_t {
+        float score;
+        u32 parent;
+        u32 token;
+    };
+    vector<float> beam_scores; // Empty when no beam search runs
+    vector<u32> best_finished_beam; // Generated tokens of the best hypothesis which reached end of stream
+    float best_finished_score = 0;
+    [[nodiscard]] bool select_beams(vector<beam_candidate_t>& candidates);
+    static void add_beam_candidates(vector<beam_candidate_t>& candidates, vector<float>& logits, float score, u32 parent, u32 count);
+    void gather_kv_caches(vector<u32> const& parents, u32 step_count);
+
+private: // context shifting, the first context_keep tokens stay when the oldest ones are dropped, ~0 when disabled
+    u32 context_keep = ~0U;
+    [[nodiscard]] bool shift_context();
+
+private: // chunked prefill, inputs are evaluated in batches of at most prefill_chunk tokens
+    u32 prefill_chunk = 512;
+    ND u32 get_next_batch_size(u32 pending) const;
+
+private: // sliding-window mode, the KV caches are a ring of 2 * attention_window rows indexed by position, 0 when disabled
+    u32 attention_window = 0;
+    void rewind_evaluated_tokens(u32 n);
+    void update_kv_caches(function<void(llava_layer_session_data*, llava_command_buffer*)> const& task);
+
+private: // CPU backend scratch, f32 [batch][n]
+    vector<float> cpu_thought;
+    vector<float> cpu_normalized;
+    vector<float> cpu_Q;
+    vector<float> cpu_K;
+    vector<float> cpu_V;
+    vector<float> cpu_Vout;
+    vector<float> cpu_ff_result;
+    vector<float> cpu_logits; // Last token only
+    u32 cpu_pending_tokens = 0; // Tokens processed by the GPU layers, still to go through the CPU ones
+    void embed_on_cpu(u32 to_process);
+    void run_on_cpu(u32 position, u32 to_process);
 
 private:
     u32 batch_size = 0;
     u32 backlog_size;
+    u32 logit_rows = 1; // Trailing rows of the batch that get sampled, the CPU head skips the others
+    void wait_for_prediction();
+    [[nodiscard]] bool submit_tokens(u32 to_process);
     [[nodiscard]] u32 get_last_predicted_token(bool deterministic);
+    [[nodiscard]] u32 get_predicted_token(bool deterministic, u32 batch_row, u32 sequence = 0);
+    void pull_logits(u32 batch_row, vector<float>& logits);
+
+private: // speculative decoding, prompt lookup or the draft session propose tokens verified here in one batch
+    llava_session* draft_session = nullptr;
+    u32 proposed_token_count = 0;
+    u32 accepted_token_count = 0;
+    void propose_tokens(u32 count, vector<u32>& proposal);
+    void lookup_tokens(u32 count, vector<u32>& proposal) const;
 
 private:
     void reset_main_buffers();
@@ -106,7 +200,6 @@ private:
     [[nodiscard]] bool set_backlog_size(u32 new_size);
 
 private:
-    llava_command_buffer* command_buffer = nullptr;
     specialization_variables_t specialization_variables{};
 
 private: // Token buffer management
@@ -9,6 +9,10 @@ import subprocess as sp
 # File struct : [name offset, content offset, size]
 # Shader are consecutive in data
 
+# Shaders touching activation buffers get an extra "_f16act" variant storing activations as float16
+F16ACT_SUFFIX = "_f16act"
+F16ACT_PREFIXES = ("matmul", "normalize", "mhsa", "kqv_matching", "copy_to_cache")
+
 
 def main():
     if not os.path.exists("prebuilt_shaders"):
@@ -20,10 +24,16 @@ def main():
                 os.unlink("prebuilt_shaders/" + x)
 
     shader_sources = [x.removesuffix(".comp") for x in os.listdir("shaders") if x.endswith(".comp")]
+    shader_sources += [x + F16ACT_SUFFIX for x in shader_sources if x.startswith(F16ACT_PREFIXES)]
 
     for shader_source in shader_sources:
-        ret = sp.call(["glslangValidator", "--target-env", "vulkan1.2", "-DUSE_SPEVAR=1", "-e", "main", "--quiet",
-                       f"shaders/{shader_source}.comp", "-o", f"prebuilt_shaders/{shader_source}.spv"])
+        extra_defines = []
+        source_name = shader_source
+        if shader_source.endswith(F16ACT_SUFFIX):
+            extra_defines.append("-DUSE_FP16_ACTIVATIONS=1")
+            source_name = shader_source.removesuffix(F16ACT_SUFFIX)
+        ret = sp.call(["glslangValidator", "--target-env", "vulkan1.2", "-DUSE_SPEVAR=1", *extra_defines, "-e", "main", "--quiet",
+                       f"shaders/{source_name}.comp", "-o", f"prebuilt_shaders/{shader_source}.spv"])
         if ret != 0:
             return ret
 
@@ -5,7 +5,10 @@
 #include "../llava_session.h"
 #include "../utils.h"
 #include <sys/socket.h>
-#include <sys/poll.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <cstdio>
 #include <cerrno>
@@ -19,71 +22,110 @@ using namespace lsrv;
 
 u32 client::ticker = 1U;
 
+// Queued packets sent by a single sendmsg, two iovecs each
+static const u32 max_packets_per_send = 64;
+
+// Largest accepted message and size of the input buffer, which always fits a pending message after compaction
+static const u32 max_message_size = sizeof(tlv_header) + 0x10000;
+static const u32 input_buffer_size = 4 * max_message_size;
+
+// Broadcasts are dropped past the first budget, the client is disconnected past the second one
+// Lagging sessions are resynced once the output is back under a quarter of the broadcast budget
+static const size_t max_queued_broadcast_bytes = 1U << 20;
+static const size_t max_queued_bytes = 64U << 20;
+
+// Data bytes of the shared memory ring, a power of two
+static const u32 shared_ring_size = 4U << 20;
+
 void client::ack(u32 request_code, ReturnCode res) {
     vector<u8> nb(4);
     memcpy(nb.data(), &res, 4);
-    add_out_packet(outCmdAck, request_code, nb);
+    add_out_packet(outCmdAck, request_code, std::move(nb));
 }
 
 void client::add_new_session_to_queue(u32 request_code, u32 session_id) {
     // Main thread
     vector<u8> nb(4);
     memcpy(nb.data(), &session_id, 4);
-    add_out_packet(outCmdNewSession, request_code, nb);
+    add_out_packet(outCmdNewSession, request_code, std::move(nb));
 }
 
-client::client(llava_server *_server, int _fd, u32 pos) : client_id(ticker++), server(_server), fd(_fd), position(pos) {
+client::client(llava_server *_server, int _fd, bool _local) : client_id(ticker++), server(_server), fd(_fd), local(_local), input_buffer(input_buffer_size) {
 
 }
 
 client::~client() {
     close(fd);
-    server->remove_client_at_position(position);
+    if (ring) {
+        munmap(ring, sizeof(shared_ring_header) + shared_ring_size);
+    }
+    for (int ring_related_fd : {ring_fd, doorbell_fd, space_fd}) {
+        if (ring_related_fd != -1) {
+            close(ring_related_fd);
+        }
+    }
+}
+
+int client::get_ring_space_fd() const {
+    return space_fd;
 }
 
-bool client::on_polled(short revents) {
-    // sync
-    if (revents & (POLLERR | POLLHUP)) {
+void client::open_shared_ring(u32 request_id) {
+    // Main thread. The descriptors can only be passed over an AF_UNIX socket
+    if ((not local) or (ring_fd != -1)) {
+        ack(request_id, ReturnCode::nok);
+        return;
+    }
+    size_t mapping_size = sizeof(shared_ring_header) + shared_ring_size;
+    ring_fd = memfd_create("llava_ring", MFD_CLOEXEC);
+    if ((ring_fd < 0) or (ftruncate(ring_fd, (off_t) mapping_size) < 0)) {
+        perror("memfd_create");
+        ack(request_id, ReturnCode::nok);
+        return;
+    }
+    void* mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+    doorbell_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ((mapping == MAP_FAILED) or (doorbell_fd < 0) or (space_fd < 0) or not server->watch_ring_space(this)) {
+        perror("open_shared_ring");
+        if (mapping != MAP_FAILED) {
+            munmap(mapping, mapping_size);
+        }
+        ack(request_id, ReturnCode::nok);
+        return;
+    }
+    ring = new (mapping) shared_ring_header {shared_ring_size, 0, {0}, {0}};
+
+    vector<u8> nb(4);
+    memcpy(nb.data(), &shared_ring_size, 4);
+    add_out_packet(outCmdSharedRing, request_id, std::move(nb));
+    outbound_buffer.back().attached_fds = {ring_fd, doorbell_fd, space_fd};
+}
+
+bool client::on_polled(u32 events) {
+    // sync, the socket is edge-triggered so it is drained until EAGAIN
+    if (events & (EPOLLERR | EPOLLHUP)) {
         return false;
     }
 
-    if (revents & POLLOUT) {
-        bool first_send = true;
-        while (not outbound_buffer.empty()) {
-            vector<u8> &to_send = outbound_buffer.front();
-            long r = send(fd, to_send.data(), to_send.size(), MSG_DONTWAIT);
-            if (r < 0) {
-                if (errno == EAGAIN or errno == EWOULDBLOCK) {
-                    break;
-                } else {
-                    perror("send");
-                    return false;
-                }
-            }
-            if (first_send and (r == 0)) {
-                cerr << "Short write of client socket" << endl;
-                return false;
-            }
-            first_send = false;
-            if (r != to_send.size()) {
-                memmove(to_send.data(), to_send.data() + r, to_send.size() - r);
-                to_send.resize(to_send.size() - r);
-                outbound_buffer.emplace_front(std::move(to_send));
-                break;
-            } else {
-                outbound_buffer.pop_front();
-            }
-        }
-        if (outbound_buffer.empty()) {
-            server->clear_write_bit_at(position);
-        }
+    if ((events & EPOLLOUT) and not flush()) {
+        return false;
     }
 
-    if (revents & POLLIN) {
-        char buf[1024];
-        while (input_buffer.size() < 0x20000) {
+    if (events & (EPOLLIN | EPOLLRDHUP)) {
+        while (not is_failed) {
+            // Unparsed bytes are moved back to the start only when a whole message may no longer fit after them,
+            // at most one partial message is moved so the cost does not depend on how many were pipelined
+            if (input_begin == input_end) {
+                input_begin = input_end = 0;
+            } else if (input_buffer.size() - input_end < max_message_size) {
+                memmove(input_buffer.data(), input_buffer.data() + input_begin, input_end - input_begin);
+                input_end -= input_begin;
+                input_begin = 0;
+            }
+
             errno = 0;
-            long r = recv(fd, buf, 1024, MSG_DONTWAIT);
+            long r = recv(fd, input_buffer.data() + input_end, input_buffer.size() - input_end, MSG_DONTWAIT);
             if (r < 0) {
                 if (errno == EAGAIN or errno == EWOULDBLOCK) {
                     break;
@@ -97,33 +139,174 @@ bool client::on_polled(short revents) {
                     cerr << "Short recv of client socket " << strerror(errsv) << endl;
                 }
                 return false;
-            } else {
-                u32 current_size = input_buffer.size();
-                input_buffer.resize(current_size + r);
-                memcpy(input_buffer.data() + current_size, buf, r);
             }
-            if (r != 1024) {
-                break;
+            input_end += r;
+
+            // Every complete message of the chunk is handled in place before reading again
+            while (not is_failed) {
+                if (not pop_message()) {
+                    break;
+                }
             }
         }
+    }
 
-        while (not is_failed) {
-            if (not pop_message()) {
+    return not is_failed;
+}
+
+bool client::on_ring_space() {
+    // Main thread, the client consumed packets from the ring
+    u64 counter;
+    (void) read(space_fd, &counter, sizeof(counter));
+    return flush();
+}
+
+bool client::flush() {
+    // Main thread
+    flush_requested = false;
+    if (is_failed) {
+        return false;
+    }
+    if (not (ring_active ? flush_to_ring() : flush_to_socket())) {
+        return false;
+    }
+    if (not lagging_sessions.empty() and (queued_bytes <= max_queued_broadcast_bytes / 4)) {
+        resync_lagging_sessions();
+    }
+    return true;
+}
+
+void client::resync_lagging_sessions() {
+    // Each session sends its current tokens, which supersede whatever was dropped
+    for (u32 session_id : lagging_sessions) {
+        session_wrapper* session = server->get_session_by_id(session_id);
+        if (session) {
+            session->push_order(client_id, 0, cmdGetSessionTokens, 1);
+        }
+    }
+    lagging_sessions.clear();
+}
+
+bool client::flush_to_socket() {
+    // Sends until the socket is full, the next EPOLLOUT edge resumes
+    while (not outbound_buffer.empty()) {
+        // Headers and payloads of as many packets as fit go out in one call, straight from where they are stored
+        // A packet carrying descriptors is sent on its own, they go with its first byte and the packets after it may
+        // belong to the ring it announces
+        iovec chunks[2 * max_packets_per_send];
+        u32 chunk_count = 0;
+        // A packet takes up to two entries, checked before adding any so that an odd count cannot overflow
+        for (auto it = outbound_buffer.begin(); (it != outbound_buffer.end()) and (chunk_count + 2 <= 2 * max_packets_per_send); ++it) {
+            bool carries_fds = not it->attached_fds.empty();
+            if (carries_fds and (it != outbound_buffer.begin())) {
+                break;
+            }
+            if (it->sent < sizeof(it->header)) {
+                chunks[chunk_count++] = {it->header + it->sent, sizeof(it->header) - it->sent};
+            }
+            u32 payload_sent = max<u32>(it->sent, sizeof(it->header)) - sizeof(it->header);
+            if (payload_sent < it->payload->size()) {
+                chunks[chunk_count++] = {(void *) (it->payload->data() + payload_sent), it->payload->size() - payload_sent};
+            }
+            if (carries_fds) {
+                break;
+            }
+        }
+        msghdr message {};
+        message.msg_iov = chunks;
+        message.msg_iovlen = chunk_count;
+        vector<int> const& attached_fds = outbound_buffer.front().attached_fds;
+        vector<u8> control;
+        if (not attached_fds.empty() and (outbound_buffer.front().sent == 0)) {
+            control.resize(CMSG_SPACE(sizeof(int) * attached_fds.size()));
+            message.msg_control = control.data();
+            message.msg_controllen = control.size();
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * attached_fds.size());
+            memcpy(CMSG_DATA(cmsg), attached_fds.data(), sizeof(int) * attached_fds.size());
+        }
+        long r = sendmsg(fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (r < 0) {
+            if (errno == EAGAIN or errno == EWOULDBLOCK) {
+                break;
+            } else {
+                perror("send");
+                return false;
+            }
+        }
+        if (r == 0) {
+            cerr << "Short write of client socket" << endl;
+            return false;
+        }
+        queued_bytes -= r;
+        for (size_t remaining = r; remaining != 0;) {
+            outbound_packet_t& packet = outbound_buffer.front();
+            size_t left = sizeof(packet.header) + packet.payload->size() - packet.sent;
+            if (remaining < left) {
+                packet.sent += remaining;
                 break;
             }
+            remaining -= left;
+            if (not packet.attached_fds.empty()) {
+                // Once sharedRing is out, the following packets go to the ring
+                ring_active = true;
+            }
+            outbound_buffer.pop_front();
+        }
+        if (ring_active) {
+            return flush_to_ring();
         }
     }
+    return true;
+}
 
+bool client::flush_to_ring() {
+    // Writes whole packets while they fit, the space eventfd resumes
+    u8* data = (u8*) (ring + 1);
+    bool written = false;
+    while (not outbound_buffer.empty()) {
+        outbound_packet_t& packet = outbound_buffer.front();
+        assert(packet.sent == 0);
+        u64 size = sizeof(packet.header) + packet.payload->size();
+        if (size > shared_ring_size) {
+            cerr << "[!] Packet larger than the shared ring" << endl;
+            return false;
+        }
+        u64 write_position = ring->write_position.load(memory_order_relaxed);
+        if (shared_ring_size - (write_position - ring->read_position.load(memory_order_acquire)) < size) {
+            break;
+        }
+        for (auto [source, length] : {pair<u8 const*, u64>(packet.header, sizeof(packet.header)), pair<u8 const*, u64>(packet.payload->data(), packet.payload->size())}) {
+            u64 offset = write_position % shared_ring_size;
+            u64 first_part = min<u64>(length, shared_ring_size - offset);
+            memcpy(data + offset, source, first_part);
+            memcpy(data, source + first_part, length - first_part);
+            write_position += length;
+        }
+        ring->write_position.store(write_position, memory_order_release);
+        queued_bytes -= size;
+        outbound_buffer.pop_front();
+        written = true;
+    }
+    if (written) {
+        u64 one = 1;
+        if (write(doorbell_fd, &one, sizeof(one)) != sizeof(one)) {
+            perror("doorbell");
+            return false;
+        }
+    }
     return true;
 }
 
 bool client::pop_message() {
     // Main thread
-    if (input_buffer.size() < sizeof(tlv_header)) {
+    if (input_end - input_begin < sizeof(tlv_header)) {
         return false;
     }
 
-    auto *header = (tlv_header *) (input_buffer.data());
+    auto *header = (tlv_header *) (input_buffer.data() + input_begin);
 
     if (header->length > 0x10000) {
         cerr << "[!] Packet too large" << endl;
@@ -131,23 +314,21 @@ bool client::pop_message() {
         return false;
     }
 
-    if (sizeof(tlv_header) + header->length > input_buffer.size()) {
+    if (sizeof(tlv_header) + header->length > input_end - input_begin) {
         return false;
     }
 
-    void *packet_ptr = input_buffer.data() + sizeof(tlv_header);
+    void *packet_ptr = input_buffer.data() + input_begin + sizeof(tlv_header);
 
+    input_begin += sizeof(tlv_header) + header->length;
     process_message(header, packet_ptr);
-    memmove(input_buffer.data(), input_buffer.data() + header->length + sizeof(tlv_header), input_buffer.size() - (header->length + sizeof(tlv_header)));
-    input_buffer.resize(input_buffer.size() - header->length - sizeof(tlv_header));
     return true;
 }
 
 void client::process_message(tlv_header *header, void *packet_ptr) {
     if (header->command < 16) {
         if (header->command == cmdGetTokenMap) {
-            vector<u8> new_buf(server->get_token_map_message());
-            add_out_packet(outCmdTokenMap, header->request_id, new_buf);
+            add_out_packet(outCmdTokenMap, header->request_id, server->get_token_map_message());
         } else if (header->command == cmdNewSession) { // newSession
             server->create_session(this, header->request_id);
         } else if (header->command == cmdListSessions) { // listSessions
@@ -156,7 +337,16 @@ void client::process_message(tlv_header *header, void *packet_ptr) {
             for (auto &[k, v]: server->get_sessions()) {
                 memcpy(nb.data() + (i++) * 4, &k, 4);
             }
-            add_out_packet(outCmdSessionList, header->request_id, nb);
+            add_out_packet(outCmdSessionList, header->request_id, std::move(nb));
+        } else if (header->command == cmdOpenSharedRing) {
+            open_shared_ring(header->request_id);
+        } else if (header->command == cmdGetProfile) {
+            if (not server->ctx->profiling_enabled()) {
+                ack(header->request_id, ReturnCode::not_profiling);
+                return;
+            }
+            vector<u8> nb(server->ctx->get_profiler().serialize());
+            add_out_packet(outCmdProfile, header->request_id, std::move(nb));
         } else {
             ack(header->request_id, ReturnCode::unknown_command);
         }
@@ -182,6 +372,7 @@ void client::process_message(tlv_header *header, void *packet_ptr) {
                 ack(header->request_id, ReturnCode::ok);
                 break;
             case cmdUnsubscribe:
+                lagging_sessions.erase(session);
                 server->drop_subscription(client_id, session);
                 ack(header->request_id, ReturnCode::ok);
                 break;
@@ -231,6 +422,39 @@ void client::process_message(tlv_header *header, void *packet_ptr) {
         return;
     }
 
+    if ((header->command == cmdForkSession) or (header->command == cmdSelectSequence) or (header->command == cmdBeamSearch) or (header->command == cmdSetContextShift)
+        or (header->command == cmdSetAttentionWindow) or (header->command == cmdSetTokenCoalescing)) {
+        if (header->length != sizeof(cmdSessionArgument_data)) {
+            ack(header->request_id, ReturnCode::bad_arguments);
+            return;
+        }
+        auto *data = (cmdSessionArgument_data *) packet_ptr;
+
+        session_wrapper *sessionHandler = server->get_session_by_id(data->session);
+        if (sessionHandler) {
+            sessionHandler->push_order(client_id, header->request_id, header->command, data->argument);
+        } else {
+            ack(header->request_id, ReturnCode::no_such_session);
+        }
+        return;
+    }
+
+    if (header->command == cmdSetSessionPriority) {
+        if (header->length != sizeof(cmdSetSessionPriority_data)) {
+            ack(header->request_id, ReturnCode::bad_arguments);
+            return;
+        }
+        auto *data = (cmdSetSessionPriority_data *) packet_ptr;
+
+        session_wrapper *sessionHandler = server->get_session_by_id(data->session);
+        if (sessionHandler) {
+            ack(header->request_id, server->set_session_priority(sessionHandler, data->priority, data->weight));
+        } else {
+            ack(header->request_id, ReturnCode::no_such_session);
+        }
+        return;
+    }
+
     if (header->command == cmdAddToken) {
         if (header->length != sizeof(cmdAddToken_data)) {
             ack(header->request_id, ReturnCode::bad_arguments);
@@ -299,15 +523,38 @@ void client::process_message(tlv_header *header, void *packet_ptr) {
     ack(header->request_id, ReturnCode::unknown_command);
 }
 
-void client::add_out_packet(OutCommands packet_type, u32 reply_code, vector<u8> const &packet) {
-    // Synchronized or not !
-    u32 sz = packet.size();
-    vector<u8> output(12 + packet.size());
-    memcpy(output.data(), &packet_type, 4);
-    memcpy(output.data() + 4, &reply_code, 4);
-    memcpy(output.data() + 8, &sz, 4);
-    memcpy(output.data() + 12, packet.data(), sz);
-
-    outbound_buffer.emplace_back(std::move(output));
-    server->set_write_bit_at(position);
+void client::add_out_packet(OutCommands packet_type, u32 reply_code, vector<u8> packet) {
+    add_out_packet(packet_type, reply_code, make_shared<vector<u8> const>(std::move(packet)));
+}
+
+void client::add_broadcast(u32 session_id, OutCommands packet_type, shared_payload const& payload) {
+    // Main thread. A subscriber which does not keep up misses broadcasts instead of buffering them
+    if (lagging_sessions.contains(session_id)) {
+        return;
+    }
+    if (queued_bytes + sizeof(outbound_packet_t::header) + payload->size() > max_queued_broadcast_bytes) {
+        lagging_sessions.insert(session_id);
+        return;
+    }
+    add_out_packet(packet_type, 0, payload);
+}
+
+void client::add_out_packet(OutCommands packet_type, u32 reply_code, shared_payload const& payload) {
+    // Main thread, only the header is written here
+    outbound_packet_t& packet = outbound_buffer.emplace_back();
+    u32 sz = payload->size();
+    memcpy(packet.header, &packet_type, 4);
+    memcpy(packet.header + 4, &reply_code, 4);
+    memcpy(packet.header + 8, &sz, 4);
+    packet.payload = payload;
+    queued_bytes += sizeof(packet.header) + payload->size();
+    if (queued_bytes > max_queued_bytes) {
+        // The client does not read its responses, it is dropped after the next events
+        cerr << "[!] Client " << client_id << " exceeded its output budget" << endl;
+        is_failed = true;
+    }
+    if (not flush_requested) {
+        flush_requested = true;
+        server->request_flush(this);
+    }
 }
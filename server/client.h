@@ -7,33 +7,67 @@
 #include <string>
 #include <thread>
 #include <list>
+#include <deque>
+#include <memory>
 #include <vector>
 #include <map>
-#include <sys/poll.h>
 #include <condition_variable>
 
 namespace lsrv {
+// Payloads are shared by all the clients they are sent to, broadcasts are not copied per subscriber
+using shared_payload = shared_ptr<vector<u8> const>;
+
+struct outbound_packet_t {
+    u8 header[12]; // {type, reply code, payload size}
+    shared_payload payload;
+    u32 sent = 0; // Bytes already sent, header first
+    vector<int> attached_fds; // Passed with SCM_RIGHTS along with the first byte
+};
+
 class client {
 public:
-    client(llava_server* server, int fd, u32 pos);
+    client(llava_server* server, int fd, bool local);
     ~client();
-    bool on_polled(short revents);
+    bool on_polled(u32 events);
+    bool on_ring_space();
+    bool flush();
     const u32 client_id;
     llava_server* const server;
     const int fd;
-    u32 position;
+    const bool local; // AF_UNIX peer, may use the shared memory ring
+    [[nodiscard]] int get_ring_space_fd() const;
     set<u32> subscriptions;
 
-    void add_out_packet(OutCommands packet_type, u32 reply_code, vector<u8> const &vector);
+    void add_out_packet(OutCommands packet_type, u32 reply_code, vector<u8> packet);
+    void add_out_packet(OutCommands packet_type, u32 reply_code, shared_payload const& payload);
+    void add_broadcast(u32 session_id, OutCommands packet_type, shared_payload const& payload);
     void add_new_session_to_queue(u32 request_code, u32 session_id);
 
 private:
-    vector<u8> input_buffer;
-    list<vector<u8>> outbound_buffer;
+    vector<u8> input_buffer; // Bytes [input_begin, input_end) are received and not parsed yet
+    u32 input_begin = 0;
+    u32 input_end = 0;
+    deque<outbound_packet_t> outbound_buffer;
+    bool flush_requested = false;
     bool pop_message();
     bool is_failed = false;
     void ack(u32 req_id, ReturnCode result);
 
+private: // shared memory ring, outbound packets queued after the sharedRing response are written there
+    int ring_fd = -1;
+    int doorbell_fd = -1;
+    int space_fd = -1;
+    shared_ring_header* ring = nullptr;
+    bool ring_active = false;
+    void open_shared_ring(u32 request_id);
+    bool flush_to_socket();
+    bool flush_to_ring();
+
+private: // backpressure
+    size_t queued_bytes = 0;
+    set<u32> lagging_sessions; // Broadcasts of these sessions are dropped until the output drains, then resynced
+    void resync_lagging_sessions();
+
 private:
     static u32 ticker;
     void process_message(tlv_header *header, void *packet_ptr);
@@ -0,0 +1,148 @@
+#include "scheduler.h"
+#include "server.h"
+#include "session_wrapper.h"
+#include "../llava_context.h"
+#include <csignal>
+#include <cassert>
+
+using namespace lsrv;
+
+session_scheduler::session_scheduler(llava_server *_server) : server(_server) {
+
+}
+
+session_scheduler::~session_scheduler() {
+    stop();
+}
+
+void session_scheduler::start(u32 worker_count) {
+    // SYNC
+    assert(workers.empty());
+    stopping = false;
+    for (u32 i = 0; i < max(1U, worker_count); ++i) {
+        workers.emplace_back([this](){this->worker_main();});
+    }
+}
+
+void session_scheduler::stop() {
+    // SYNC, sessions still queued are dropped
+    {
+        lock_guard guard(ready_mutex);
+        stopping = true;
+    }
+    work_available.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+}
+
+void session_scheduler::schedule(session_wrapper *target) {
+    // Any thread. A session being stepped is queued again by its worker once done
+    {
+        lock_guard guard(ready_mutex);
+        if (target->finished or target->queued) {
+            return;
+        }
+        if (target->running) {
+            target->woken = true;
+            return;
+        }
+        enqueue(target);
+    }
+    work_available.notify_one();
+}
+
+ReturnCode session_scheduler::set_priority(session_wrapper *target, u32 priority, u32 weight) {
+    // Main thread, a queued session moves to its new place
+    if ((priority >= session_priority_count) or (weight == 0) or (weight > max_session_weight)) {
+        return ReturnCode::bad_arguments;
+    }
+    lock_guard guard(ready_mutex);
+    if (target->queued) {
+        ready_sessions.at(target->priority).erase(target->queue_position);
+    }
+    target->priority = priority;
+    target->weight = weight;
+    if (target->queued) {
+        enqueue(target);
+    }
+    return ReturnCode::ok;
+}
+
+void session_scheduler::enqueue(session_wrapper *target) {
+    // ready_mutex held. A session coming back from idle starts at the current virtual time, it has no credit left
+    target->virtual_time = max(target->virtual_time, virtual_clocks.at(target->priority));
+    target->queue_position = ready_sessions.at(target->priority).emplace(target->virtual_time, target);
+    target->queued = true;
+}
+
+session_wrapper *session_scheduler::dequeue() {
+    // ready_mutex held, at least one session ready
+    for (u32 priority = session_priority_count; priority-- > 0;) {
+        auto& queue = ready_sessions.at(priority);
+        if (not queue.empty()) {
+            session_wrapper* target = queue.begin()->second;
+            virtual_clocks.at(priority) = queue.begin()->first;
+            queue.erase(queue.begin());
+            target->queued = false;
+            return target;
+        }
+    }
+    assert(false);
+    return nullptr;
+}
+
+bool session_scheduler::has_ready_sessions() const {
+    for (auto& queue : ready_sessions) {
+        if (not queue.empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void session_scheduler::worker_main() {
+    // ASYNC
+    setup_exceptions();
+    unique_lock lock(ready_mutex);
+    while (true) {
+        work_available.wait(lock, [this](){return this->stopping or this->has_ready_sessions();});
+        if (stopping) {
+            break;
+        }
+        session_wrapper* target = dequeue();
+        target->running = true;
+        lock.unlock();
+
+        session_wrapper::step_result result = target->step();
+
+        lock.lock();
+        target->running = false;
+        target->virtual_time += (u64) max(1U, target->step_cost) * max_session_weight / target->weight;
+        if (result == session_wrapper::step_result::finished) {
+            // The main thread deletes the session once notified, nothing may touch it afterwards
+            target->finished = true;
+            u32 session_id = target->session_id;
+            lock.unlock();
+            server->notify_session_death(session_id);
+            lock.lock();
+        } else if ((result == session_wrapper::step_result::ready) or target->woken) {
+            target->woken = false;
+            enqueue(target);
+        }
+    }
+}
+
+void session_scheduler::setup_exceptions() const {
+    if (server->ctx->signal_debug_on()) {
+        return;
+    }
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGQUIT);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, nullptr);
+}
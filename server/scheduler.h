@@ -0,0 +1,49 @@
+#ifndef VULKAN_LLAMA_SERVER_SCHEDULER_H
+#define VULKAN_LLAMA_SERVER_SCHEDULER_H
+
+#include "types.h"
+#include <map>
+#include <array>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+namespace lsrv {
+const u32 session_priority_count = 3; // Batch, normal, interactive
+const u32 default_session_priority = 1;
+const u32 max_session_weight = 1024;
+
+// Fixed pool of workers running sessions, which are state machines advanced one step at a time
+// Ready sessions of the highest priority go first, within a priority they share the workers in proportion to their
+// weight: each one has a virtual time advanced by the tokens it evaluated divided by its weight, the lowest goes next
+// Idle sessions only cost their memory whatever their number
+class session_scheduler {
+public:
+    explicit session_scheduler(llava_server* server);
+    session_scheduler(session_scheduler const&) = delete;
+    session_scheduler(session_scheduler&&) = delete;
+    ~session_scheduler();
+
+    void start(u32 worker_count);
+    void stop();
+    void schedule(session_wrapper* target);
+    ReturnCode set_priority(session_wrapper* target, u32 priority, u32 weight);
+
+private:
+    llava_server* const server;
+    void worker_main();
+    void setup_exceptions() const;
+    void enqueue(session_wrapper* target);
+    [[nodiscard]] session_wrapper* dequeue();
+    [[nodiscard]] bool has_ready_sessions() const;
+
+    vector<thread> workers;
+    mutex ready_mutex;
+    condition_variable work_available;
+    array<multimap<u64, session_wrapper*>, session_priority_count> ready_sessions; // By virtual time
+    array<u64, session_priority_count> virtual_clocks {}; // Virtual time of the last session started, per priority
+    bool stopping = false;
+};
+}
+
+#endif
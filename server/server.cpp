@@ -6,7 +6,9 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
-#include <sys/poll.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 #include <cstdio>
 #include <cerrno>
@@ -19,26 +21,38 @@
 
 using namespace lsrv;
 
-pair<int, int> mk_pipes() {
-    int pipes[2];
-    assert (pipe(pipes) >= 0);
-    return {pipes[0], pipes[1]};
+// epoll_event.data holds the client pointer for client sockets, and one of these tags for the server's own fds
+static const u64 listen_tag = 1;
+static const u64 signal_tag = 2;
+static const u64 stdin_tag = 3;
+static const u64 wakeup_tag = 4;
+static const u64 unix_listen_tag = 5;
+static const u64 last_tag = unix_listen_tag;
+// Clients are at least 8-byte aligned, the low bit tells the space eventfd of their shared ring from their socket
+static const u64 ring_space_bit = 1;
+static const int max_events_per_wakeup = 256;
+
+static int make_wakeup_fd() {
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    assert(fd >= 0);
+    return fd;
 }
 
-llava_server::llava_server(llava_context *context) : ctx(context), ping_pipes(mk_pipes()) {
+llava_server::llava_server(llava_context *context) : ctx(context), wakeup_fd(make_wakeup_fd()), scheduler(this) {
     u32 finalSize = 0;
     for (auto& token : ctx->get_model()->get_tokens()) {
         finalSize += 4 + token.text.size();
     }
-    tokenMapMessage.resize(finalSize);
+    vector<u8> message(finalSize);
     u32 cursor = 0;
     for (auto& token : ctx->get_model()->get_tokens()) {
         u32 sz = token.text.size();
-        memcpy(tokenMapMessage.data() + cursor, &sz, 4);
+        memcpy(message.data() + cursor, &sz, 4);
         cursor += 4;
-        memcpy(tokenMapMessage.data() + cursor, token.text.data(), token.text.size());
+        memcpy(message.data() + cursor, token.text.data(), token.text.size());
         cursor += token.text.size();
     }
+    tokenMapMessage = make_shared<vector<u8> const>(std::move(message));
 }
 
 void llava_server::serve_forever() {
@@ -81,90 +95,98 @@ void llava_server::serve_forever() {
         return;
     }
 
-    int sigfd = ctx->get_signal_fd();
+    // Local clients may also connect through an AF_UNIX socket, which allows the shared memory ring
+    int unix_socket = -1;
+    string const& unix_socket_path = ctx->get_unix_socket_path();
+    if (not unix_socket_path.empty()) {
+        sockaddr_un unix_addr {};
+        unix_addr.sun_family = AF_UNIX;
+        if (unix_socket_path.size() >= sizeof(unix_addr.sun_path)) {
+            cerr << "[!] Unix socket path too long" << endl;
+            close(server_socket);
+            return;
+        }
+        strcpy(unix_addr.sun_path, unix_socket_path.c_str());
+        unlink(unix_socket_path.c_str());
+        unix_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if ((unix_socket < 0) or (bind(unix_socket, (sockaddr*)&unix_addr, sizeof(unix_addr)) < 0) or (listen(unix_socket, 5) < 0)) {
+            perror("unix socket");
+            if (unix_socket >= 0) {
+                close(unix_socket);
+            }
+            close(server_socket);
+            return;
+        }
+        cout << "[*] Listening on " << unix_socket_path << endl;
+    }
 
-    cout << "[*] Started server on 0.0.0.0:1337" << endl;
+    int sigfd = ctx->get_signal_fd();
 
-    pollfdArray.emplace_back() = {
-            .fd = server_socket,
-            .events = POLLIN,
-            .revents = 0
-    };
+    u32 worker_count = ctx->get_server_worker_count();
+    scheduler.start(worker_count);
+    cout << "[*] Started server on 0.0.0.0:1337 with " << worker_count << " session workers" << endl;
 
-    if (sigfd != -1) {
-        pollfdArray.emplace_back() = {
-                .fd = sigfd,
-                .events = POLLIN,
-                .revents = 0
-        };
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        close(server_socket);
+        if (unix_socket != -1) {
+            close(unix_socket);
+        }
+        return;
+    }
+    bool watching = watch_fd(server_socket, EPOLLIN, listen_tag) and watch_fd(STDIN_FILENO, EPOLLIN, stdin_tag) and watch_fd(wakeup_fd, EPOLLIN, wakeup_tag);
+    if (watching and (sigfd != -1)) {
+        watching = watch_fd(sigfd, EPOLLIN, signal_tag);
+    }
+    if (watching and (unix_socket != -1)) {
+        watching = watch_fd(unix_socket, EPOLLIN, unix_listen_tag);
+    }
+    if (not watching) {
+        perror("epoll_ctl");
+        close(epoll_fd);
+        close(server_socket);
+        if (unix_socket != -1) {
+            close(unix_socket);
+        }
+        return;
     }
-    pollfdArray.emplace_back() = {
-            .fd = STDIN_FILENO,
-            .events = POLLIN,
-            .revents = 0
-    };
-
-
-    pollfdArray.emplace_back() = {
-            .fd = ping_pipes.first,
-            .events = POLLIN,
-            .revents = 0
-    };
 
     bool should_die = false;
-    list<int> to_drop;
+    set<u32> to_drop;
+    epoll_event events[max_events_per_wakeup];
     while((not should_die) or (not sessions.empty())) {
-        int pollret = poll(pollfdArray.data(), pollfdArray.size(), 1000);
-        if(pollret < 0)
+        int event_count = epoll_wait(epoll_fd, events, max_events_per_wakeup, 1000);
+        if(event_count < 0)
 		{
 			if(errno == EINTR)
 			{
                 continue;
 			}
             cerr << "[?] Error while polling " << strerror(errno) << endl;
-            return;
+            break;
 		}
-        if (pollret == 0) {
-            continue;
-        }
 
-        u32 dead_session_id = 0;
-        u32 pollfdArraySize = pollfdArray.size();
-        for(u32 i = 0; (i < pollfdArraySize) and pollret; ++i)
-        {
-            if(not pollfdArray.at(i).revents) {
+        list<u32> dead_session_ids;
+        for (int i = 0; i < event_count; ++i) {
+            u64 tag = events[i].data.u64;
+            if (tag > last_tag) {
+                // Client event
+                auto* target = reinterpret_cast<client *>(tag & ~ring_space_bit);
+                bool alive = (tag & ring_space_bit) ? target->on_ring_space() : target->on_polled(events[i].events);
+                if (not alive) {
+                    to_drop.insert(target->client_id);
+                }
                 continue;
             }
-            --pollret;
-            short revents = pollfdArray.at(i).revents;
-            pollfdArray.at(i).revents = 0;
-            if (pollfdArray.at(i).fd == server_socket)
+
+            if ((tag == listen_tag) or (tag == unix_listen_tag))
             {
-                // New client
-                sockaddr_in new_peer_addr {};
-                socklen_t len = sizeof(sockaddr_in);
-
-                int new_fd = accept(server_socket, (sockaddr*)&new_peer_addr, &len);
-                char address[INET_ADDRSTRLEN + 1];
-                cout << "[*] New client from " << inet_ntop(new_peer_addr.sin_family, &new_peer_addr.sin_addr, address, len) << ":" << new_peer_addr.sin_port << endl;
-
-                if (new_fd >= 0) {
-                    // Add client to the structure
-                    pollfdArray.emplace_back() = {
-                        .fd = new_fd,
-                        .events = POLLIN,
-                        .revents = 0
-                    };
-                    auto* new_obj = new client(this, new_fd, pollfdArray.size() - 1);
-                    assert(clients.emplace(new_fd, new_obj).second);
-                    assert(client_by_client_id.emplace(new_obj->client_id, new_obj).second);
-                } else {
-                    perror("accept");
-                }
+                accept_client((tag == listen_tag) ? server_socket : unix_socket, tag == unix_listen_tag);
                 continue;
             }
 
-            if (pollfdArray.at(i).fd == sigfd) {
+            if (tag == signal_tag) {
                 // Signal handler
                 u32 sig = ctx->pop_signal(false);
                 // cout << "[*] Signal caught (" << sig << ")" << endl;
@@ -175,56 +197,58 @@ void llava_server::serve_forever() {
                 continue;
             }
 
-            if (pollfdArray.at(i).fd == STDIN_FILENO) {
+            if (tag == stdin_tag) {
                 should_die = true;
                 for (auto& [_, session] : sessions) {
                     session->push_order(0, 0, cmdKillSession);
                 }
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, nullptr); // Stays readable at end of file
                 continue;
             }
 
-            if (pollfdArray.at(i).fd == ping_pipes.first) {
-                // This is meant to flush session messages
-                assert(read(ping_pipes.first, &dead_session_id, 4) == 4); // Dismiss it
+            if (tag == wakeup_tag) {
+                // Sessions queued messages, everything pending is taken at once
+                u64 counter;
+                (void) read(wakeup_fd, &counter, sizeof(counter));
                 lock_guard guard(session_messages_mutex);
-                for ( ; not broadcast_messages.empty(); broadcast_messages.pop_front()) {
-                    auto& [session_id, packet_type, packet_content] = broadcast_messages.front();
-                    for (auto client_id : clients_subscriptions[session_id]) {
-                        auto it = client_by_client_id.find(client_id);
-                        if (it == client_by_client_id.end()) {
-                            cerr << "Leftover subscriber???" << endl;
-                        } else {
-                            it->second->add_out_packet(packet_type, 0, packet_content);
+                wakeup_pending = false;
+                dead_session_ids.splice(dead_session_ids.end(), dead_sessions);
+                for ( ; not session_messages.empty(); session_messages.pop_front()) {
+                    session_message& message = session_messages.front();
+                    if (message.client_id == 0) {
+                        shared_payload payload = make_shared<vector<u8> const>(std::move(message.content));
+                        for (auto client_id : sessions_subscribers[message.session_id]) {
+                            auto it = client_by_client_id.find(client_id);
+                            if (it == client_by_client_id.end()) {
+                                cerr << "Leftover subscriber???" << endl;
+                            } else {
+                                it->second->add_broadcast(message.session_id, message.packet_type, payload);
+                            }
                         }
+                        continue;
                     }
-                }
-                for ( ; not session_messages.empty(); session_messages.pop_front()) {
-                    auto& [client_id, packet_type, reply_code, packet_content] = session_messages.front();
-                    auto it = client_by_client_id.find(client_id);
+                    auto it = client_by_client_id.find(message.client_id);
                     if (it == client_by_client_id.end()) {
                         cerr << "Message from session to an unknown client???" << endl;
                     } else {
-                        it->second->add_out_packet(packet_type, reply_code, packet_content);
+                        it->second->add_out_packet(message.packet_type, message.reply_code, std::move(message.content));
                     }
                 }
                 continue;
             }
+        }
 
-            if (auto it = clients.find(pollfdArray.at(i).fd); it != clients.end()) {
-                // Client event
-                if (not it->second->on_polled(revents)) {
-                    to_drop.emplace_back(it->second->client_id);
-                }
-                continue;
+        // Only clients which queued output are visited, idle subscribers cost nothing
+        for (client* target : clients_to_flush) {
+            if (not target->flush()) {
+                to_drop.insert(target->client_id);
             }
-
-            cerr << "[?] Unknown fd received an event " << pollfdArray.at(i).fd << endl;
         }
+        clients_to_flush.clear();
 
-        if (dead_session_id) {
+        for (u32 dead_session_id : dead_session_ids) {
             auto it = sessions.find(dead_session_id);
             assert(it != sessions.end());
-            it->second->join();
             for (auto subscriber_id : sessions_subscribers[dead_session_id]) {
                 clients_subscriptions[subscriber_id].erase(dead_session_id);
             }
@@ -234,32 +258,97 @@ void llava_server::serve_forever() {
         }
 
         for (auto client_id : to_drop) {
-            auto it = client_by_client_id.find(client_id);
-            assert(it != client_by_client_id.end());
-            for (auto session_id : sessions_subscribers[client_id]) {
-                sessions_subscribers[session_id].erase(client_id);
-            }
-            clients_subscriptions.erase(client_id);
-            clients.erase(it->second->fd);
-            delete it->second;
-            client_by_client_id.erase(it);
+            drop_client(client_id);
         }
         to_drop.clear();
     }
 
-    while (not clients.empty()) {
-        client_by_client_id.erase(clients.begin()->second->client_id);
-        delete clients.begin()->second;
-        clients.erase(clients.begin());
+    while (not client_by_client_id.empty()) {
+        drop_client(client_by_client_id.begin()->first);
     }
 
+    scheduler.stop();
+    close(epoll_fd);
+    epoll_fd = -1;
     close(server_socket);
+    if (unix_socket != -1) {
+        close(unix_socket);
+        unlink(unix_socket_path.c_str());
+    }
+}
+
+void llava_server::accept_client(int listen_socket, bool local) {
+    // New client
+    sockaddr_in new_peer_addr {};
+    socklen_t len = sizeof(sockaddr_in);
+
+    int new_fd = accept4(listen_socket, local ? nullptr : (sockaddr*)&new_peer_addr, local ? nullptr : &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (new_fd < 0) {
+        perror("accept");
+        return;
+    }
+    if (local) {
+        cout << "[*] New local client" << endl;
+    } else {
+        char address[INET_ADDRSTRLEN + 1];
+        cout << "[*] New client from " << inet_ntop(new_peer_addr.sin_family, &new_peer_addr.sin_addr, address, sizeof(address)) << ":" << new_peer_addr.sin_port << endl;
+    }
+
+    // Client sockets are edge-triggered, they are drained on every event
+    auto* new_obj = new client(this, new_fd, local);
+    assert(client_by_client_id.emplace(new_obj->client_id, new_obj).second);
+    epoll_event client_event {};
+    client_event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    client_event.data.ptr = new_obj;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_fd, &client_event) < 0) {
+        perror("epoll_ctl");
+        drop_client(new_obj->client_id);
+    }
+}
+
+bool llava_server::watch_ring_space(client *target) const {
+    return watch_fd(target->get_ring_space_fd(), EPOLLIN, reinterpret_cast<u64>(target) | ring_space_bit);
+}
+
+bool llava_server::watch_fd(int fd, u32 events, u64 data) const {
+    epoll_event event {};
+    event.events = events;
+    event.data.u64 = data;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) >= 0;
+}
+
+void llava_server::drop_client(u32 client_id) {
+    auto it = client_by_client_id.find(client_id);
+    assert(it != client_by_client_id.end());
+    for (auto session_id : clients_subscriptions[client_id]) {
+        sessions_subscribers[session_id].erase(client_id);
+    }
+    clients_subscriptions.erase(client_id);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, it->second->fd, nullptr);
+    if (it->second->get_ring_space_fd() != -1) {
+        // The peer holds the eventfd too, closing ours would not unregister it
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, it->second->get_ring_space_fd(), nullptr);
+    }
+    delete it->second;
+    client_by_client_id.erase(it);
+}
+
+void llava_server::request_flush(client *target) {
+    clients_to_flush.push_back(target);
+}
+
+void llava_server::schedule_session(session_wrapper *target) {
+    scheduler.schedule(target);
+}
+
+ReturnCode llava_server::set_session_priority(session_wrapper *target, u32 priority, u32 weight) {
+    return scheduler.set_priority(target, priority, weight);
 }
 
 void llava_server::create_session(client* calling_client, u32 request_code) {
     auto* ns = new session_wrapper(this);
     sessions.emplace(ns->session_id, ns);
-    for (auto& [_, client] : clients) {
+    for (auto& [_, client] : client_by_client_id) {
         client->add_new_session_to_queue((client == calling_client) ? request_code : 0, ns->session_id);
     }
     ns->start();
@@ -273,36 +362,31 @@ session_wrapper *llava_server::get_session_by_id(u32 i) {
     return nullptr;
 }
 
-void llava_server::remove_client_at_position(u32 position) {
-    if (position + 1 == pollfdArray.size()) {
-        pollfdArray.pop_back();
-        return;
-    }
-    pollfdArray.at(position) = pollfdArray.back();
-    pollfdArray.pop_back();
-    clients.at(pollfdArray.at(position).fd)->position = position;
-}
-
 map<u32, session_wrapper *> const &llava_server::get_sessions() const {
     return sessions;
 }
 
-void llava_server::clear_write_bit_at(u32 position) {
-    pollfdArray.at(position).events &= (~POLLOUT);
-}
-
-void llava_server::set_write_bit_at(u32 position) {
-    pollfdArray.at(position).events |= POLLOUT;
+shared_ptr<vector<u8> const> const& llava_server::get_token_map_message() const {
+    return tokenMapMessage;
 }
 
-const vector<u8> &llava_server::get_token_map_message() const {
-    return tokenMapMessage;
+void llava_server::notify_session_death(u32 session_id) {
+    unique_lock lock(session_messages_mutex);
+    dead_sessions.push_back(session_id);
+    wake_up_main_loop(lock);
 }
 
-void llava_server::notify_session_death(u32 session_id) const {
-    if (write(ping_pipes.second, &session_id, 4) != 4) {
+void llava_server::wake_up_main_loop(unique_lock<mutex>& lock) {
+    // Only the first message queued since the main loop last took them needs a wakeup
+    if (wakeup_pending) {
+        return;
+    }
+    wakeup_pending = true;
+    lock.unlock();
+    u64 one = 1;
+    if (write(wakeup_fd, &one, sizeof(one)) != sizeof(one)) {
         int errsv = errno;
-        cerr << "Ping (death) failed, errno=" << strerror(errsv) << endl;
+        cerr << "Ping failed, errno=" << strerror(errsv) << endl;
     }
 }
 
@@ -316,16 +400,8 @@ void llava_server::drop_subscription(u32 client_id, u32 session_id) {
     sessions_subscribers[session_id].erase(client_id);
 }
 
-void llava_server::receive_session_outbound_packets(list<tuple<u32, OutCommands, u32, vector<u8>>> &packets, list<tuple<u32, OutCommands, vector<u8>>> &broadcasts) {
-    {
-        lock_guard lock(session_messages_mutex);
-        broadcast_messages.splice(broadcast_messages.end(), broadcasts);
-        session_messages.splice(session_messages.end(), packets);
-    }
-
-    int zero = 0;
-    if(write(ping_pipes.second, &zero, 4) != 4) {
-        int errsv = errno;
-        cerr << "Ping failed, errno=" << strerror(errsv) << endl;
-    }
+void llava_server::receive_session_outbound_packets(list<session_message>& messages) {
+    unique_lock lock(session_messages_mutex);
+    session_messages.splice(session_messages.end(), messages);
+    wake_up_main_loop(lock);
 }
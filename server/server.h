@@ -2,13 +2,15 @@
 #define VULKAN_LLAMA_LLAVA_SERVER_H
 
 #include "types.h"
+#include "scheduler.h"
 #include <set>
 #include <string>
 #include <thread>
 #include <list>
 #include <vector>
 #include <map>
-#include <sys/poll.h>
+#include <memory>
+#include <unordered_map>
 #include <condition_variable>
 
 namespace lsrv {
@@ -22,23 +24,28 @@ public:
     [[nodiscard]] map<u32, session_wrapper*> const& get_sessions() const;
     llava_context* const ctx;
 
-    void remove_client_at_position(u32 i);
-    void clear_write_bit_at(u32 i);
-    void set_write_bit_at(u32 i);
-    [[nodiscard]] const vector<u8> &get_token_map_message() const;
+    void request_flush(client* target);
+    void schedule_session(session_wrapper* target);
+    ReturnCode set_session_priority(session_wrapper* target, u32 priority, u32 weight);
+    [[nodiscard]] bool watch_ring_space(client* target) const;
+    [[nodiscard]] shared_ptr<vector<u8> const> const& get_token_map_message() const;
 
-    void receive_session_outbound_packets(list<tuple<u32, OutCommands, u32, vector<u8>>> &packets, list<tuple<u32, OutCommands, vector<u8>>> &broadcasts);
-    void notify_session_death(u32 session_i) const;
+    void receive_session_outbound_packets(list<session_message>& messages);
+    void notify_session_death(u32 session_id);
     void add_subscription(u32 client_id, u32 session_id);
     void drop_subscription(u32 client_id, u32 session_id);
 
 private:
-    const pair<int, int> ping_pipes;
-    vector<u8> tokenMapMessage;
-    vector<pollfd> pollfdArray;
-    map<u32, client*> clients;
+    const int wakeup_fd; // eventfd, written when session messages are queued while none were pending
+    shared_ptr<vector<u8> const> tokenMapMessage;
+    int epoll_fd = -1;
     map<u32, session_wrapper*> sessions;
-    map<u32, client*> client_by_client_id;
+    session_scheduler scheduler;
+    unordered_map<u32, client*> client_by_client_id;
+    vector<client*> clients_to_flush; // Clients which queued output since the last wakeup, sent once events are handled
+    [[nodiscard]] bool watch_fd(int fd, u32 events, u64 data) const;
+    void accept_client(int listen_socket, bool local);
+    void drop_client(u32 client_id);
 
 private:
     map<u32, set<u32>> clients_subscriptions;
@@ -47,8 +54,10 @@ private:
 private:
     // When messages from session running in threads are sent, they are put here
     mutex session_messages_mutex;
-    list<tuple<u32, OutCommands, u32, vector<u8>>> session_messages;
-    list<tuple<u32, OutCommands, vector<u8>>> broadcast_messages;
+    list<session_message> session_messages; // Broadcasts and replies in one queue, so that a resync is ordered with tokens
+    list<u32> dead_sessions;
+    bool wakeup_pending = false; // The main loop was woken up and has not taken the messages yet
+    void wake_up_main_loop(unique_lock<mutex>& lock);
 };
 }
 
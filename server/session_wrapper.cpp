@@ -3,7 +3,6 @@
 #include "client.h"
 #include "../llava_context.h"
 #include "../llava_session.h"
-#include <sys/poll.h>
 #include <cstring>
 #include <iostream>
 #include <cassert>
@@ -15,6 +14,10 @@ using namespace lsrv;
 
 u32 session_wrapper::ticker = 1U;
 
+// Coalesced frames are sent once this many tokens are gathered, whatever the window
+static const u32 max_coalesced_tokens = 64;
+static const u32 max_coalescing_window_ms = 1000;
+
 // Main thread handlers
 void session_wrapper::push_order(u32 client_id, u32 request_id, u32 opcode, u32 arg1, string s) {
     // Main thread
@@ -28,17 +31,13 @@ void session_wrapper::push_order(u32 client_id, u32 request_id, u32 opcode, u32
                 .s = std::move(s)
         };
     }
-    cv.notify_one();
+    server->schedule_session(this);
 }
 
 session_wrapper::~session_wrapper() {
-    // SYNC
-    thread* _loop_thread = loop_thread;
-    if (_loop_thread != nullptr and _loop_thread->joinable()) {
-        _loop_thread->join();
-    }
-    delete _loop_thread;
-    loop_thread = nullptr;
+    // SYNC, no worker holds the session anymore
+    delete session;
+    session = nullptr;
 }
 
 session_wrapper::session_wrapper(llava_server *_server) : session_id(ticker++), server(_server) {
@@ -47,81 +46,150 @@ session_wrapper::session_wrapper(llava_server *_server) : session_id(ticker++),
 
 void session_wrapper::start() {
     // SYNC
-    assert(loop_thread == nullptr);
-    loop_thread = new thread([this](){this->run();});
+    server->schedule_session(this);
 }
 
+session_wrapper::step_result session_wrapper::step() {
+    // ASYNC, on a worker. Does at most one token or one prefill chunk of work, so that other sessions get their turn
+    if (session == nullptr) {
+        session = new llava_session(server->ctx);
+    }
+    step_cost = 0;
 
-void session_wrapper::run() {
-    // ASYNC
-    setup_exceptions();
-
-    llava_session session(server->ctx);
+    if (prediction_pending) {
+        // Orders which came while the token was evaluated are handled before it is read
+        process_orders(*session);
+        finish_token_prediction(*session);
+    } else {
+        process_orders(*session);
+        if (should_die) {
+            delete session;
+            session = nullptr;
+            return step_result::finished;
+        }
 
-    while (not should_die) {
-        process_orders(session, not (should_run or should_tick));
-        if (should_run or should_tick) {
-            if (not session.start_next_token_prediction()) {
+        if (deferred_pending) {
+            step_deferred_order(*session);
+        } else if ((should_run or should_tick) and (session->get_sequence_count() > 1)) {
+            // Parallel sequences advance together, one token each per step
+            vector<u32> new_tokens;
+            step_cost = session->get_sequence_count();
+            if (not session->predict_sequence_tokens(new_tokens)) {
+                cerr << "Out of buffer ?" << endl;
                 should_run = false;
-                cerr << "Error starting token generation" << endl;
+                if (should_tick) {
+                    add_outbound_ack(tick_client, should_tick, ReturnCode::nok);
+                }
+            } else {
+                add_outbound_sequence_tokens(*session, new_tokens);
+            }
+            flush_outbound_packets();
+            should_tick = 0;
+            tick_client = 0;
+        } else if ((should_run or should_tick) and (session->get_pending_token_count() > session->get_prefill_chunk())) {
+            // A long input is evaluated one chunk per step, higher priority sessions may run between them
+            step_cost = session->get_prefill_chunk();
+            if (not session->prefill()) {
+                should_run = false;
+                cerr << "Error evaluating the input" << endl;
                 if (should_tick) {
                     add_outbound_ack(tick_client, should_tick, ReturnCode::nok);
                     flush_outbound_packets();
                 }
                 should_tick = 0;
                 tick_client = 0;
-                continue;
             }
-
-            // Let's process some events, if any, while token being generated
-            process_orders(session, false);
-
-            u32 new_token_id = session.finish_next_token_prediction();
-
-            vector<u8> vec(12);
-            memcpy(vec.data(), &session_id, 4);
-            memcpy(vec.data() + 4, &new_token_id, 4);
-            u32 pos = session.get_token_count();
-            memcpy(vec.data() + 8, &pos, 4);
-
-            if (not session.push_token(new_token_id)) {
+        } else if (should_run and session->speculation_enabled()) {
+            // Ticks still give one token, continuous generation takes every token accepted from the draft
+            vector<u32> new_tokens;
+            if (not session->predict_next_tokens(new_tokens)) {
                 cerr << "Out of buffer ?" << endl;
                 should_run = false;
             }
-
-            outbound_broadcasts.emplace_back(session_id, outCmdNewToken, vec);
-
-            if (should_tick) {
-                outbound_packets.emplace_back(tick_client, outCmdNewToken, should_tick, vec);
+            add_outbound_tokens(session->get_token_count() - new_tokens.size(), new_tokens);
+            flush_outbound_packets();
+            step_cost = new_tokens.size();
+        } else if (should_run or should_tick) {
+            // The worker moves on to other sessions while the token is evaluated
+            step_cost = session->get_pending_token_count();
+            if (session->start_next_token_prediction()) {
+                prediction_pending = true;
+            } else {
+                should_run = false;
+                cerr << "Error starting token generation" << endl;
+                if (should_tick) {
+                    add_outbound_ack(tick_client, should_tick, ReturnCode::nok);
+                    flush_outbound_packets();
+                }
+                should_tick = 0;
+                tick_client = 0;
             }
+        }
+    }
 
-            flush_outbound_packets();
-            should_tick = 0;
-            tick_client = 0;
+    if (prediction_pending or should_run or should_tick or should_die or deferred_pending) {
+        return step_result::ready;
+    }
+    {
+        lock_guard guard(session_mutex);
+        if (not orders.empty()) {
+            return step_result::ready;
         }
     }
-    process_orders(session, false);
-    server->notify_session_death(session_id);
+    // Nothing is generated until the next order, so coalesced tokens would wait for it
+    flush_coalesced_tokens();
+    flush_outbound_packets();
+    return step_result::idle;
 }
 
-void session_wrapper::setup_exceptions() {
-    if (this->server->ctx->signal_debug_on()) {
-        return;
+void session_wrapper::finish_token_prediction(llava_session& _session) {
+    // ASYNC
+    prediction_pending = false;
+    u32 new_token_id = _session.finish_next_token_prediction();
+
+    vector<u8> vec(12);
+    memcpy(vec.data(), &session_id, 4);
+    memcpy(vec.data() + 4, &new_token_id, 4);
+    u32 pos = _session.get_token_count();
+    memcpy(vec.data() + 8, &pos, 4);
+
+    if (not _session.push_token(new_token_id)) {
+        cerr << "Out of buffer ?" << endl;
+        should_run = false;
     }
-    sigset_t mask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGINT);
-    sigaddset(&mask, SIGQUIT);
-    sigaddset(&mask, SIGHUP);
-    sigaddset(&mask, SIGTERM);
-    sigprocmask(SIG_BLOCK, &mask, nullptr);
+
+    add_outbound_tokens(pos, {new_token_id});
+
+    if (should_tick) {
+        add_outbound_packet(tick_client, outCmdNewToken, should_tick, vec);
+    }
+
+    flush_outbound_packets();
+    should_tick = 0;
+    tick_client = 0;
 }
 
-void session_wrapper::process_orders(llava_session& session, bool blocking) {
+void session_wrapper::process_orders(llava_session& session) {
     // ASYNC
     unique_lock lock(session_mutex);
-    if (orders.empty() and blocking) {
-        cv.wait(lock, [this](){return not this->orders.empty();});
+    if (not orders.empty()) {
+        // Subscribers get the tokens generated so far before the effects of the orders
+        flush_coalesced_tokens();
+    }
+
+    if (deferred_pending) {
+        // A kill abandons the deferred order, anything else waits for it to finish
+        bool kill_requested = false;
+        for (session_order const& order : orders) {
+            kill_requested |= (order.opcode == cmdKillSession);
+        }
+        if (not kill_requested) {
+            lock.unlock();
+            flush_outbound_packets();
+            return;
+        }
+        session.select_sequence(0);
+        finish_deferred_order(ReturnCode::nok);
     }
 
     while (not orders.empty()) {
@@ -153,6 +221,46 @@ void session_wrapper::process_orders(llava_session& session, bool blocking) {
             case cmdRewind:
                 session.rewind(order.arg1);
                 break;
+            case cmdForkSession:
+                // The input is evaluated over the next steps, the ack follows the sequences' first tokens
+                if (should_run or should_tick) {
+                    return_code = ReturnCode::already_running;
+                } else {
+                    deferred_order = order;
+                    deferred_pending = true;
+                    should_acknowledge = false;
+                }
+                break;
+            case cmdSelectSequence:
+                if (order.arg1 >= session.get_sequence_count()) {
+                    return_code = ReturnCode::bad_arguments;
+                } else {
+                    session.select_sequence(order.arg1);
+                }
+                break;
+            case cmdBeamSearch:
+                // Runs over the next steps until the best hypothesis is known, the session then holds it as its text
+                if (should_run or should_tick) {
+                    return_code = ReturnCode::already_running;
+                } else {
+                    deferred_order = order;
+                    deferred_pending = true;
+                    should_acknowledge = false;
+                }
+                break;
+            case cmdSetContextShift:
+                session.set_context_shift(order.arg1);
+                break;
+            case cmdSetAttentionWindow:
+                return_code = session.set_attention_window(order.arg1);
+                break;
+            case cmdSetTokenCoalescing:
+                if (order.arg1 > max_coalescing_window_ms) {
+                    return_code = ReturnCode::bad_arguments;
+                } else {
+                    coalescing_window_ms = order.arg1;
+                }
+                break;
             case cmdSetSessionOptions:
                 return_code = session.set_options(order.arg1);
                 break;
@@ -170,12 +278,17 @@ void session_wrapper::process_orders(llava_session& session, bool blocking) {
                 }
                 break;
             case cmdGetSessionTokens:
+                // arg1 is set when the server resyncs a lagging subscriber, the tokens then come with the session id
                 should_acknowledge = false;
                 {
                     u32 token_count = session.get_token_count();
-                    vector<u8> nb(4 * token_count);
-                    memcpy(nb.data(), session.get_token_buffer().data(), 4 * token_count);
-                    outbound_packets.emplace_back(order.client_id, outCmdBuffer, order.request_id, nb);
+                    u32 offset = order.arg1 ? 4 : 0;
+                    vector<u8> nb(offset + 4 * token_count);
+                    if (order.arg1) {
+                        memcpy(nb.data(), &session_id, 4);
+                    }
+                    memcpy(nb.data() + offset, session.get_token_buffer().data(), 4 * token_count);
+                    add_outbound_packet(order.client_id, order.arg1 ? outCmdResync : outCmdBuffer, order.request_id, std::move(nb));
                 }
                 break;
             case cmdSaveFrame:
@@ -202,6 +315,9 @@ void session_wrapper::process_orders(llava_session& session, bool blocking) {
             add_outbound_ack(order.client_id, order.request_id, return_code);
         }
         orders.pop_front();
+        if (deferred_pending) {
+            break; // The following orders apply once it is done
+        }
     }
 
     lock.unlock();
@@ -209,21 +325,145 @@ void session_wrapper::process_orders(llava_session& session, bool blocking) {
     flush_outbound_packets();
 }
 
-void session_wrapper::join() {
-    auto* _thread = this->loop_thread;
-    if (_thread) {
-        _thread->join();
+void session_wrapper::step_deferred_order(llava_session& _session) {
+    // ASYNC, a long input is evaluated one chunk per step before the order reads its last row
+    if (not beam_search_started and (_session.get_pending_token_count() > _session.get_prefill_chunk())) {
+        step_cost = _session.get_prefill_chunk();
+        if (not _session.prefill()) {
+            finish_deferred_order(ReturnCode::nok);
+        }
+        flush_outbound_packets();
+        return;
+    }
+    switch (deferred_order.opcode) {
+        case cmdForkSession:
+            step_fork(_session);
+            break;
+        case cmdBeamSearch:
+            step_beam_search(_session);
+            break;
+        default:
+            finish_deferred_order(ReturnCode::nok);
+            break;
+    }
+    flush_outbound_packets();
+}
+
+void session_wrapper::step_fork(llava_session& _session) {
+    // ASYNC, the sequences sample their first tokens from the last row of the input
+    step_cost = _session.get_pending_token_count();
+    vector<u32> first_tokens;
+    if (not _session.fork_sequences(deferred_order.arg1, first_tokens)) {
+        finish_deferred_order(ReturnCode::nok);
+        return;
     }
+    add_outbound_sequence_tokens(_session, first_tokens);
+    finish_deferred_order(ReturnCode::ok);
+}
+
+void session_wrapper::step_beam_search(llava_session& _session) {
+    // ASYNC, the beams advance by one token per step
+    if (not beam_search_started) {
+        step_cost = _session.get_pending_token_count();
+        beam_search_started = _session.start_beam_search(deferred_order.arg1);
+        if (not beam_search_started) {
+            finish_deferred_order(ReturnCode::nok);
+        }
+        return;
+    }
+    if (not _session.beam_search_done()) {
+        step_cost = _session.get_sequence_count();
+        if (_session.advance_beams()) {
+            return;
+        }
+        // Out of buffer, the best hypothesis so far is kept
+    }
+    vector<u32> best_tokens;
+    finish_deferred_order(_session.end_beam_search(best_tokens) ? ReturnCode::ok : ReturnCode::nok);
+}
+
+void session_wrapper::finish_deferred_order(ReturnCode return_code) {
+    if (deferred_order.client_id and deferred_order.request_id) {
+        add_outbound_ack(deferred_order.client_id, deferred_order.request_id, return_code);
+    }
+    deferred_pending = false;
+    beam_search_started = false;
 }
 
 void session_wrapper::flush_outbound_packets() {
-    if (not (outbound_packets.empty() and outbound_broadcasts.empty())) {
-        server->receive_session_outbound_packets(outbound_packets, outbound_broadcasts);
+    if (not outbound_messages.empty()) {
+        server->receive_session_outbound_packets(outbound_messages);
+    }
+}
+
+void session_wrapper::add_outbound_packet(u32 client_id, OutCommands packet_type, u32 reply_code, vector<u8> content) {
+    outbound_messages.push_back({session_id, client_id, packet_type, reply_code, std::move(content)});
+}
+
+void session_wrapper::add_outbound_broadcast(OutCommands packet_type, vector<u8> content) {
+    outbound_messages.push_back({session_id, 0, packet_type, 0, std::move(content)});
+}
+
+void session_wrapper::add_outbound_sequence_tokens(llava_session& session, vector<u32> const& tokens) {
+    // {session, index, count, [token]}, index being the position of the new tokens in their sequences
+    u32 index = session.get_sequence_tokens(0).size() - 1;
+    u32 count = tokens.size();
+    vector<u8> vec(12 + 4 * count);
+    memcpy(vec.data(), &session_id, 4);
+    memcpy(vec.data() + 4, &index, 4);
+    memcpy(vec.data() + 8, &count, 4);
+    memcpy(vec.data() + 12, tokens.data(), 4 * count);
+    add_outbound_broadcast(outCmdSequenceTokens, vec);
+    if (should_tick) {
+        add_outbound_packet(tick_client, outCmdSequenceTokens, should_tick, vec);
     }
 }
 
 void session_wrapper::add_outbound_ack(u32 client_id, u32 request_code, ReturnCode return_code) {
     vector<u8> packet(4);
     memcpy(packet.data(), &return_code, 4);
-    outbound_packets.emplace_back(client_id, outCmdAck, request_code, std::move(packet));
+    add_outbound_packet(client_id, outCmdAck, request_code, std::move(packet));
+}
+
+void session_wrapper::add_outbound_tokens(u32 index, vector<u32> const& tokens) {
+    // Without coalescing, every token is broadcast as a newToken {session, token, index}
+    if (coalescing_window_ms == 0) {
+        for (u32 token : tokens) {
+            vector<u8> vec(12);
+            memcpy(vec.data(), &session_id, 4);
+            memcpy(vec.data() + 4, &token, 4);
+            memcpy(vec.data() + 8, &index, 4);
+            add_outbound_broadcast(outCmdNewToken, std::move(vec));
+            index++;
+        }
+        return;
+    }
+
+    auto now = chrono::steady_clock::now();
+    if (not coalesced_tokens.empty() and (coalesced_index + coalesced_tokens.size() != index)) {
+        flush_coalesced_tokens();
+    }
+    if (coalesced_tokens.empty()) {
+        coalesced_index = index;
+        coalescing_start = now;
+    }
+    coalesced_tokens.insert(coalesced_tokens.end(), tokens.begin(), tokens.end());
+    if ((coalesced_tokens.size() >= max_coalesced_tokens) or (now - coalescing_start >= chrono::milliseconds(coalescing_window_ms))) {
+        flush_coalesced_tokens();
+    }
+}
+
+void session_wrapper::flush_coalesced_tokens() {
+    // {session, index, count, [token]}
+    if (coalesced_tokens.empty()) {
+        return;
+    }
+    u32 count = coalesced_tokens.size();
+    vector<u8> vec(12 + 4 * count);
+    memcpy(vec.data(), &session_id, 4);
+    memcpy(vec.data() + 4, &coalesced_index, 4);
+    memcpy(vec.data() + 8, &count, 4);
+    memcpy(vec.data() + 12, coalesced_tokens.data(), 4 * count);
+    add_outbound_broadcast(outCmdNewTokens, std::move(vec));
+    coalesced_tokens.clear();
 }
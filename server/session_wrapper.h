@@ -2,17 +2,20 @@
 #define VULKAN_LLAMA_SERVER_SESSION_WRAPPER_H
 
 #include "types.h"
+#include "scheduler.h"
 #include <set>
 #include <string>
 #include <thread>
 #include <list>
 #include <vector>
 #include <map>
-#include <sys/poll.h>
+#include <chrono>
 #include <condition_variable>
 
 namespace lsrv {
+// A session is a state machine stepped by the scheduler's workers, it has no thread of its own
 class session_wrapper {
+    friend class session_scheduler;
 public:
     explicit session_wrapper(llava_server *server);
     ~session_wrapper();
@@ -20,17 +23,22 @@ public:
     llava_server *const server;
     void start();
     void push_order(u32 uid, u32 reqId, u32 opcode, u32 arg1 = 0, std::string s = {});
-    void join();
+
+    enum class step_result {
+        idle, // Waits for orders
+        ready, // Has more to do, queued again
+        finished // Killed, may be deleted
+    };
+    step_result step();
 
 private:
-    void run();
     mutex session_mutex;
-    thread *loop_thread = nullptr;
-    condition_variable cv;
     list<session_order> orders;
-    void process_orders(llava_session &session, bool blocking);
-    list<tuple<u32, OutCommands, u32, vector<u8>>> outbound_packets;
-    list<tuple<u32, OutCommands, vector<u8>>> outbound_broadcasts;
+    llava_session* session = nullptr; // Created by the first step, on a worker
+    void process_orders(llava_session &session);
+    list<session_message> outbound_messages;
+    void add_outbound_packet(u32 client_id, OutCommands packet_type, u32 reply_code, vector<u8> content);
+    void add_outbound_broadcast(OutCommands packet_type, vector<u8> content);
     void flush_outbound_packets();
 
 private:
@@ -38,12 +46,42 @@ private:
     u32 should_tick = 0;
     u32 tick_client = 0;
     bool should_die = false;
+    bool prediction_pending = false; // A token is being evaluated, its result is read by the next step
+
+private: // orders taking several steps, the orders after them wait unless one kills the session
+    bool deferred_pending = false;
+    session_order deferred_order;
+    bool beam_search_started = false;
+    void step_deferred_order(llava_session& session);
+    void step_fork(llava_session& session);
+    void step_beam_search(llava_session& session);
+    void finish_deferred_order(ReturnCode return_code);
+
+private: // token coalescing, broadcasts gather the tokens of up to coalescing_window_ms when non-zero
+    u32 coalescing_window_ms = 0;
+    vector<u32> coalesced_tokens;
+    u32 coalesced_index = 0; // Position of the first coalesced token
+    chrono::steady_clock::time_point coalescing_start;
+    void add_outbound_tokens(u32 index, vector<u32> const& tokens);
+    void flush_coalesced_tokens();
+
+private: // scheduler state, guarded by its mutex
+    bool queued = false;
+    bool running = false;
+    bool woken = false; // Orders came while running
+    bool finished = false;
+    u32 priority = default_session_priority;
+    u32 weight = 1;
+    u64 virtual_time = 0;
+    multimap<u64, session_wrapper*>::iterator queue_position;
+    u32 step_cost = 0; // Tokens evaluated by the last step, set by the session
 
 private:
     static u32 ticker;
-    void setup_exceptions();
+    void finish_token_prediction(llava_session& session);
 
     void add_outbound_ack(u32 client_id, u32 request_code, ReturnCode return_code);
+    void add_outbound_sequence_tokens(llava_session& session, vector<u32> const& tokens);
 };
 }
 
@@ -2,6 +2,8 @@
 #define VULKAN_LLAMA_SERVER_TYPES_H
 
 #include "../types.h"
+#include <atomic>
+#include <vector>
 
 #define GUARDED_BY(x) \
   THREAD_ANNOTATION_ATTRIBUTE__(guarded_by(x))
@@ -24,6 +26,8 @@ struct session_order {
 getTokenMap (0)
 newSession (1)
 listSessions (2)
+getProfile (3)
+openSharedRing (4) // AF_UNIX clients only, answered by sharedRing
 getSessionTokens (16, session)
 subscribe (17, session)
 unsubscribe (18, session)
@@ -33,6 +37,13 @@ rewind (32, session, new_pos)
 addToken (33, session, token_id)
 addText (34, session, [chars])
 setSessionOptions (35, session, options)
+forkSession (39, session, sequence_count)
+selectSequence (40, session, sequence)
+beamSearch (41, session, beam_count) // Replaces the generated text with the best hypothesis, then acks
+setContextShift (42, session, keep) // Drops old tokens after the first keep ones when the backlog is full, ~0 to disable
+setAttentionWindow (43, session, window) // Attends to the last window tokens only (power of two, 64 to 1024), 0 to disable
+setTokenCoalescing (44, session, window_ms) // Broadcasts tokens as newTokens frames gathering up to window_ms (1000 max) of them, 0 to disable
+setSessionPriority (45, session, priority, weight) // Priority 0 (batch), 1 (normal, default) or 2 (interactive), weight 1 to 1024 (1 by default)
 
 From session:
 newToken (0, token)
@@ -45,6 +56,12 @@ newSession (3, req_id, session) // Response or not
 sessionList (4, req_id, [session]) // Response
 droppedSession (5, req_id, session) // Broadcast
 ack (6, req_id)
+sessionStatus (7, req_id, status)
+profile (8, req_id, bucket_count, pipeline_count, layer_count, [pipeline stats], [layer stats]) // Response, needs --profile
+sequenceTokens (9, req_id, session, index, count, [token]) // Subscription, one token per parallel sequence
+newTokens (10, req_id, session, index, count, [token]) // Subscription, consecutive tokens when coalescing is enabled
+sharedRing (11, req_id, ring_size) // Response, carries {ring memfd, doorbell eventfd, space eventfd}, later packets are written to the ring
+resync (12, req_id, session, [tokens]) // Subscription, replaces the session's text after broadcasts were dropped for a lagging subscriber
 */
 
 enum Commands : u32 {
@@ -52,6 +69,8 @@ enum Commands : u32 {
     cmdGetTokenMap = 0,
     cmdNewSession = 1,
     cmdListSessions = 2,
+    cmdGetProfile = 3,
+    cmdOpenSharedRing = 4,
 
     // Data = {session}
     cmdGetSessionTokens = 16,
@@ -70,6 +89,13 @@ enum Commands : u32 {
     cmdSaveFrame = 36,
     cmdSnapshot = 37,
     cmdRestore = 38,
+    cmdForkSession = 39,
+    cmdSelectSequence = 40,
+    cmdBeamSearch = 41,
+    cmdSetContextShift = 42,
+    cmdSetAttentionWindow = 43,
+    cmdSetTokenCoalescing = 44,
+    cmdSetSessionPriority = 45,
 };
 
 enum OutCommands : u32 {
@@ -81,6 +107,30 @@ enum OutCommands : u32 {
     outCmdDroppedSession = 5,
     outCmdAck = 6,
     outCmdSessionStatus = 7,
+    outCmdProfile = 8,
+    outCmdSequenceTokens = 9,
+    outCmdNewTokens = 10,
+    outCmdSharedRing = 11,
+    outCmdResync = 12,
+};
+
+// Output of a session for the main loop, delivered in the order it was produced
+struct session_message {
+    u32 session_id;
+    u32 client_id; // 0 for a broadcast to the session's subscribers
+    OutCommands packet_type;
+    u32 reply_code;
+    std::vector<u8> content;
+};
+
+// Start of the shared memory mapping sent with sharedRing, followed by ring_size bytes of data
+// Packets are written as on the socket at write_position % ring_size, wrapping around the end. The server writes the
+// doorbell eventfd after writing packets, the client writes the space eventfd after consuming them
+struct shared_ring_header {
+    u32 ring_size;
+    u32 pad;
+    std::atomic<u64> write_position; // Advanced by the server
+    std::atomic<u64> read_position; // Advanced by the client
 };
 
 struct cmdRewind_data {
@@ -93,6 +143,17 @@ struct cmdSetSessionOptions_data {
     u32 options;
 } __attribute__((packed));
 
+struct cmdSessionArgument_data {
+    u32 session;
+    u32 argument; // forkSession, selectSequence, beamSearch, setContextShift, setAttentionWindow and setTokenCoalescing take one argument
+} __attribute__((packed));
+
+struct cmdSetSessionPriority_data {
+    u32 session;
+    u32 priority;
+    u32 weight;
+} __attribute__((packed));
+
 struct cmdAddToken_data {
     u32 session;
     u32 token_id;
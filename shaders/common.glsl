@@ -1,6 +1,10 @@
 #extension GL_EXT_control_flow_attributes:enable
 #extension GL_EXT_shader_16bit_storage:enable
 
+#ifdef USE_FP16_ACTIVATIONS
+#extension GL_EXT_shader_explicit_arithmetic_types_float16:require
+#endif
+
 #ifdef USE_SPEVAR
 
 layout (constant_id = 0) const uint HEAD_COUNT = 32;
@@ -55,6 +59,41 @@ layout (constant_id = 20) const uint BATCH_ENABLED = 1;
 
 #define DIM (ROT * HEAD_COUNT)
 
+// Storage type of the intermediate activations (normalized logits, Q/K/V, attention and FF outputs)
+// The residual stream, attention scores and output probabilities always stay in f32
+#ifdef USE_FP16_ACTIVATIONS
+#define ACT_FLOAT float16_t
+#define ACT_VEC2 f16vec2
+#define ACT_VEC4 f16vec4
+#else
+#define ACT_FLOAT float
+#define ACT_VEC2 vec2
+#define ACT_VEC4 vec4
+#endif
+
+#ifdef USE_KV_SLOTS
+// KV cache slots hold the shared prefix, then the tokens of the parallel sequences interleaved
+// Without parallel sequences, prefix_size is 0 and sequence_count 1, so slots are positions
+uint slot_position(const uint slot, const uint prefix_size, const uint sequence_count) {
+    return (slot < prefix_size) ? slot : prefix_size + (slot - prefix_size) / sequence_count;
+}
+
+bool slot_visible(const uint slot, const uint query_slot, const uint prefix_size, const uint sequence_count) {
+    return (slot <= query_slot) && ((slot < prefix_size) || (((slot - prefix_size) % sequence_count) == ((query_slot - prefix_size) % sequence_count)));
+}
+
+// In sliding-window mode, the cache is a ring of BACKLOG = 2 * window slots, slot s holding the latest position congruent to s
+// A batch holds at most window tokens, so the slots it overwrites are out of the window of its earlier tokens
+uint ring_distance(const uint slot, const uint query_position) {
+    return (query_position - slot) & (BACKLOG - 1);
+}
+
+bool ring_visible(const uint slot, const uint query_position, const uint window) {
+    const uint position_delta = ring_distance(slot, query_position);
+    return (position_delta <= query_position) && (position_delta < window);
+}
+#endif
+
 #ifdef LOCAL_SUM_BITS
 
 #ifndef LOCAL_SUM_VEC4
@@ -73,8 +112,8 @@ float local_sum(const uint subgroup_id, const uint self_id, const float element)
     return sum_buffer[subgroup_id << LOCAL_SUM_BITS];
 }
 #else
-shared vec4 sum_buffer[MAX_WGS];
-vec4 local_sum(const uint subgroup_id, const uint self_id, const vec4 element) {
+shared ACT_VEC4 sum_buffer[MAX_WGS];
+ACT_VEC4 local_sum(const uint subgroup_id, const uint self_id, const ACT_VEC4 element) {
     sum_buffer[(subgroup_id << LOCAL_SUM_BITS) + self_id] = element;
     barrier();
     uint curmax = (1 << LOCAL_SUM_BITS);
@@ -89,4 +128,23 @@ vec4 local_sum(const uint subgroup_id, const uint self_id, const vec4 element) {
 }
 #endif
 
+#ifdef LOCAL_SUM_STATS
+// Reduces (sum, sum of squares) of an input row, always in f32, and returns the normalize.comp scale
+shared vec2 stats_buffer[MAX_WGS];
+float norm_inv_std(const uint subgroup_id, const uint self_id, const vec2 element) {
+    stats_buffer[(subgroup_id << LOCAL_SUM_BITS) + self_id] = element;
+    barrier();
+    uint curmax = (1 << LOCAL_SUM_BITS);
+    [[unroll]] for (int j = 0; j < LOCAL_SUM_BITS; j++) {
+        curmax >>= 1;
+        if (self_id < curmax) {
+            stats_buffer[(subgroup_id << LOCAL_SUM_BITS) + self_id] += stats_buffer[(subgroup_id << LOCAL_SUM_BITS) + curmax + self_id];
+        }
+        barrier();
+    }
+    const vec2 stats = stats_buffer[subgroup_id << LOCAL_SUM_BITS] / DIM;
+    return inversesqrt(stats.y - stats.x * stats.x);
+}
+#endif
+
 #endif
@@ -4,18 +4,42 @@
 
 #define LOCAL_SUM_BITS MATMUL_ROW_WORKER_COUNT_LOG2
 #define LOCAL_SUM_VEC4
+#ifdef MATMUL_NORM
+#define LOCAL_SUM_STATS
+#endif
 
 #include "common.glsl"
 
-#ifdef MATMUL_ADD
+#if defined(MATMUL_QKV)
+// Fused projection: the matrix holds wq, wk and wv rows back to back, each DIM rows long
+layout (binding = 0) buffer writeonly OutQBuffer {
+    ACT_VEC4 values[]; // [Z][DIM/4]
+} outq;
+
+layout (binding = 1) buffer writeonly OutKBuffer {
+    ACT_VEC4 values[]; // [Z][DIM/4]
+} outk;
+
+layout (binding = 2) buffer writeonly OutVBuffer {
+    ACT_VEC4 values[]; // [Z][DIM/4]
+} outv;
+
+#define MATMUL_IN_BINDING 3
+#elif defined(MATMUL_ADD)
 layout (binding = 0) buffer OutBuffer {
+    vec4 values[]; // [Z][MATMUL_Q4_BLOCKS_PER_ROW * 8]
+} outp;
+
+#define MATMUL_IN_BINDING 1
 #else
 layout (binding = 0) buffer writeonly OutBuffer {
-#endif
-    vec4 values[]; // [Z][MATMUL_Q4_BLOCKS_PER_ROW * 8]
+    ACT_VEC4 values[]; // [Z][MATMUL_Q4_BLOCKS_PER_ROW * 8]
 } outp;
 
-layout (binding = 1) buffer readonly MatrixDBuffer {
+#define MATMUL_IN_BINDING 1
+#endif
+
+layout (binding = MATMUL_IN_BINDING) buffer readonly MatrixDBuffer {
 #ifdef USE_FP16_DBASE
     f16vec4 values[];
 #else
@@ -23,14 +47,29 @@ layout (binding = 1) buffer readonly MatrixDBuffer {
 #endif
 } matd;
 
-layout (binding = 2) buffer readonly MatrixQBuffer {
+layout (binding = MATMUL_IN_BINDING + 1) buffer readonly MatrixQBuffer {
     uvec4 values[][8];
 } matq;
 
-layout (binding = 3) buffer readonly InFBuffer {
-    vec4 values[][8]; // [Z][MATMUL_Q4_BLOCKS_PER_ROW][4][2]
+#ifdef MATMUL_NORM
+// Un-normalized residual stream, normalized on the fly like normalize.comp does
+layout (binding = MATMUL_IN_BINDING + 2) buffer readonly InFBuffer {
+    vec4 values[][8]; // [Z][MATMUL_Q4_BLOCKS_PER_ROW][8]
+} inp;
+
+layout (binding = MATMUL_IN_BINDING + 3) buffer readonly NormWeightBuffer {
+    vec4 values[][8]; // [MATMUL_Q4_BLOCKS_PER_ROW][8]
+} normw;
+
+#define MATMUL_INPUT(block_id, i) (inp.values[z_id * MATMUL_Q4_BLOCKS_PER_ROW + block_id][i] * normw.values[block_id][i])
+#else
+layout (binding = MATMUL_IN_BINDING + 2) buffer readonly InFBuffer {
+    ACT_VEC4 values[][8]; // [Z][MATMUL_Q4_BLOCKS_PER_ROW][4][2]
 } inp;
 
+#define MATMUL_INPUT(block_id, i) vec4(inp.values[z_id * MATMUL_Q4_BLOCKS_PER_ROW + block_id][i])
+#endif
+
 
 #ifdef USE_SPEVAR
 layout (local_size_x_id = MATMUL_X_CID, local_size_y_id = MATMUL_Y_CID, local_size_z = 1) in;
@@ -46,6 +85,9 @@ void main()
     const uint z_id = gl_GlobalInvocationID.z * BATCH_ENABLED;
 
     vec4 worker_sum = vec4(0);
+#ifdef MATMUL_NORM
+    vec2 worker_stats = vec2(0);
+#endif
     [[unroll]] for (int t = 0; t < MATMUL_Q4_BLOCK_COUNT_PER_WORKER; t++) {
         vec4 block_mat_value = vec4(0.);
         uint block_id = min(t * MATMUL_Y + worker_id, MATMUL_Q4_BLOCKS_PER_ROW - 1);
@@ -54,19 +96,38 @@ void main()
             uvec4 sub_block = matq.values[row_id * MATMUL_Q4_BLOCKS_PER_ROW + block_id][block_block_id];
             // sub_block ^= 0x80808080;
             mat4 m = mat4(vec4(sub_block & 0xff), vec4((sub_block >> 8) & 0xff), vec4((sub_block >> 16) & 0xff), vec4((sub_block >> 24) & 0xff));
-            block_mat_value += (m - 128.) * inp.values[z_id * MATMUL_Q4_BLOCKS_PER_ROW + block_id][block_block_id];
+            block_mat_value += (m - 128.) * MATMUL_INPUT(block_id, block_block_id);
         }
         if (t * MATMUL_Y + worker_id < MATMUL_Q4_BLOCKS_PER_ROW) {
             worker_sum += block_mat_value * vec4(matd.values[row_id * MATMUL_Q4_BLOCKS_PER_ROW + block_id]);
+        #ifdef MATMUL_NORM
+            [[unroll]] for (int i = 0; i < 8; i++) {
+                const vec4 x = inp.values[z_id * MATMUL_Q4_BLOCKS_PER_ROW + block_id][i];
+                worker_stats += vec2(dot(x, vec4(1.)), dot(x, x));
+            }
+        #endif
         }
     }
 
-    const vec4 result = local_sum(local_row_id, worker_id, worker_sum);
+#ifdef MATMUL_NORM
+    // The norm scale is per input row, so it can be applied to the partial sums before the reduction
+    worker_sum *= norm_inv_std(local_row_id, worker_id, worker_stats);
+#endif
+    const vec4 result = vec4(local_sum(local_row_id, worker_id, ACT_VEC4(worker_sum)));
     if (worker_id == 0) {
-    #ifdef MATMUL_ADD
+    #if defined(MATMUL_QKV)
+        const uint out_id = z_id * (DIM / 4) + row_id % (DIM / 4);
+        if (row_id < (DIM / 4)) {
+            outq.values[out_id] = ACT_VEC4(result);
+        } else if (row_id < 2 * (DIM / 4)) {
+            outk.values[out_id] = ACT_VEC4(result);
+        } else {
+            outv.values[out_id] = ACT_VEC4(result);
+        }
+    #elif defined(MATMUL_ADD)
         outp.values[z_id * gl_NumWorkGroups.x * MATMUL_X + row_id] += result;
     #else
-        outp.values[z_id * gl_NumWorkGroups.x * MATMUL_X + row_id] = result;
+        outp.values[z_id * gl_NumWorkGroups.x * MATMUL_X + row_id] = ACT_VEC4(result);
     #endif
     }
 }
@@ -0,0 +1,128 @@
+#ifndef MATMUL_X
+#error "This file should be included, not compiled"
+#endif
+
+#define LOCAL_SUM_BITS MATMUL_ROW_WORKER_COUNT_LOG2
+#define LOCAL_SUM_VEC4
+#ifdef MATMUL_NORM
+#define LOCAL_SUM_STATS
+#endif
+
+#include "common.glsl"
+
+layout (binding = 0) buffer writeonly OutBuffer {
+    ACT_VEC4 values[];
+} outp;
+
+layout (binding = 1) buffer readonly Matrix1DBuffer {
+#ifdef USE_FP16_DBASE
+    f16vec4 values[];
+#else
+    vec4 values[];
+#endif
+} mat1d;
+
+layout (binding = 2) buffer readonly Matrix1QBuffer {
+    uvec4 values[][8];
+} mat1q;
+
+layout (binding = 3) buffer readonly Matrix2DBuffer {
+#ifdef USE_FP16_DBASE
+    f16vec4 values[];
+#else
+    vec4 values[];
+#endif
+} mat2d;
+
+layout (binding = 4) buffer readonly Matrix2QBuffer {
+    uvec4 values[][8];
+} mat2q;
+
+#ifdef MATMUL_NORM
+// Un-normalized residual stream, normalized on the fly like normalize.comp does
+layout (binding = 5) buffer readonly InFBuffer {
+    vec4 values[][8];
+} inp;
+
+layout (binding = 6) buffer readonly NormWeightBuffer {
+    vec4 values[][8];
+} normw;
+#else
+layout (binding = 5) buffer readonly InFBuffer {
+    ACT_VEC4 values[][8];
+} inp;
+#endif
+
+#ifdef MATMUL_NORM
+#define MATMUL_INPUT(block_id, i) (inp.values[z_id * MATMUL_Q4_BLOCKS_PER_ROW + block_id][i] * normw.values[block_id][i])
+#else
+#define MATMUL_INPUT(block_id, i) vec4(inp.values[z_id * MATMUL_Q4_BLOCKS_PER_ROW + block_id][i])
+#endif
+
+#ifdef USE_SPEVAR
+layout (local_size_x_id = MATMUL_X_CID, local_size_y_id = MATMUL_Y_CID, local_size_z = 1) in;
+#else
+layout (local_size_x = MATMUL_X, local_size_y = MATMUL_Y, local_size_z = 1) in;
+#endif
+
+void main()
+{
+    const uint row_id = gl_GlobalInvocationID.x;
+    const uint local_row_id = gl_LocalInvocationID.x;
+    const uint worker_id = gl_GlobalInvocationID.y;
+    const uint z_id = gl_GlobalInvocationID.z * BATCH_ENABLED;
+
+    vec4 worker_sum = vec4(0);
+#ifdef MATMUL_NORM
+    vec2 worker_stats = vec2(0);
+#endif
+    [[unroll]] for (int t = 0; t < MATMUL_Q4_BLOCK_COUNT_PER_WORKER; t++) {
+        vec4 block_mat_value = vec4(0.);
+        uint block_id = min(t * MATMUL_Y + worker_id, MATMUL_Q4_BLOCKS_PER_ROW - 1);
+
+        [[unroll]] for (int block_block_id = 0; block_block_id < 8; block_block_id++) {
+            uvec4 sub_block = mat1q.values[row_id * MATMUL_Q4_BLOCKS_PER_ROW + block_id][block_block_id];
+            mat4 m = mat4(vec4(sub_block & 0xff), vec4((sub_block >> 8) & 0xff), vec4((sub_block >> 16) & 0xff), vec4((sub_block >> 24) & 0xff));
+            block_mat_value += (m - 128.) * MATMUL_INPUT(block_id, block_block_id);
+        }
+        if (t * MATMUL_Y + worker_id < MATMUL_Q4_BLOCKS_PER_ROW) {
+            worker_sum += block_mat_value * vec4(mat1d.values[row_id * MATMUL_Q4_BLOCKS_PER_ROW + block_id]);
+        #ifdef MATMUL_NORM
+            [[unroll]] for (int i = 0; i < 8; i++) {
+                const vec4 x = inp.values[z_id * MATMUL_Q4_BLOCKS_PER_ROW + block_id][i];
+                worker_stats += vec2(dot(x, vec4(1.)), dot(x, x));
+            }
+        #endif
+        }
+    }
+
+#ifdef MATMUL_NORM
+    // The norm scale is per input row, so it can be applied to the partial sums before the reduction
+    const float inv_std = norm_inv_std(local_row_id, worker_id, worker_stats);
+    worker_sum *= inv_std;
+#endif
+    const vec4 result1 = vec4(local_sum(local_row_id, worker_id, ACT_VEC4(worker_sum)));
+
+    worker_sum = vec4(0);
+    [[unroll]] for (int t = 0; t < MATMUL_Q4_BLOCK_COUNT_PER_WORKER; t++) {
+        vec4 block_mat_value = vec4(0.);
+        uint block_id = min(t * MATMUL_Y + worker_id, MATMUL_Q4_BLOCKS_PER_ROW - 1);
+
+        [[unroll]] for (int block_block_id = 0; block_block_id < 8; block_block_id++) {
+            uvec4 sub_block = mat2q.values[row_id * MATMUL_Q4_BLOCKS_PER_ROW + block_id][block_block_id];
+            mat4 m = mat4(vec4(sub_block & 0xff), vec4((sub_block >> 8) & 0xff), vec4((sub_block >> 16) & 0xff), vec4((sub_block >> 24) & 0xff));
+            block_mat_value += (m - 128.) * MATMUL_INPUT(block_id, block_block_id);
+        }
+        if (t * MATMUL_Y + worker_id < MATMUL_Q4_BLOCKS_PER_ROW) {
+            worker_sum += block_mat_value * vec4(mat2d.values[row_id * MATMUL_Q4_BLOCKS_PER_ROW + block_id]);
+        }
+    }
+
+#ifdef MATMUL_NORM
+    worker_sum *= inv_std;
+#endif
+    const vec4 result2 = vec4(local_sum(local_row_id, worker_id, ACT_VEC4(worker_sum)));
+    if (worker_id == 0) {
+        outp.values[z_id * gl_NumWorkGroups.x * MATMUL_X + row_id] = ACT_VEC4(result1 * result2 / (exp(-result2) + 1));
+    }
+}
@@ -0,0 +1,28 @@
+#!/bin/sh
+# Auto-tunes from an empty cache, both matmul families must get benchmarked without crashing or hanging
+# LLAVA_DRAFT_MODEL, when set, also tunes a draft model from an empty cache, its dimensions miss the target's entries
+binary="$1"
+if [ -z "$LLAVA_MODEL" ] || [ ! -f "$LLAVA_MODEL" ]; then
+    echo "LLAVA_MODEL not set, skipping"
+    exit 77
+fi
+
+temp_dir=$(mktemp -d)
+trap 'rm -rf "$temp_dir"' EXIT
+# Not created yet, the auto-tuner makes it
+cache_home="$temp_dir/cache"
+
+XDG_CACHE_HOME="$cache_home" timeout 600 "$binary" -m "$LLAVA_MODEL" --tune-only || exit 1
+
+if [ ! -s "$cache_home/llava_autotune.txt" ]; then
+    # No GPU, the CPU backend does not tune
+    echo "No auto-tuning cache written, skipping"
+    exit 77
+fi
+[ "$(grep -c ':dim:' "$cache_home/llava_autotune.txt")" -ge 1 ] && [ "$(grep -c ':ff:' "$cache_home/llava_autotune.txt")" -ge 1 ] || exit 1
+
+if [ -n "$LLAVA_DRAFT_MODEL" ] && [ -f "$LLAVA_DRAFT_MODEL" ]; then
+    rm -f "$cache_home/llava_autotune.txt"
+    XDG_CACHE_HOME="$cache_home" timeout 600 "$binary" -m "$LLAVA_MODEL" --draft-model "$LLAVA_DRAFT_MODEL" --tune-only || exit 1
+    [ "$(grep -c ':dim:' "$cache_home/llava_autotune.txt")" -ge 1 ] && [ "$(grep -c ':ff:' "$cache_home/llava_autotune.txt")" -ge 1 ] || exit 1
+fi
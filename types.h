@@ -18,7 +18,11 @@ class llava_device_memory;
 class llava_command_buffer;
 class llava_session;
 class llava_layer_session_data;
+class llava_cpu_backend;
+class llava_device;
+class ggml_data_descriptor;
 struct specialization_variables_t;
+struct session_partition_t;
 
 using u64 = uint64_t;
 using u32 = uint32_t;
@@ -52,6 +56,7 @@ enum class ReturnCode : u32 {
     batched_tick = 6,
     bad_arguments = 7,
     unknown_command = 8,
+    not_profiling = 9,
 };
 
 namespace vk {